@@ -0,0 +1,96 @@
+#pragma once
+
+#include <vector>
+using std::vector;
+
+#include "ray_stream.h"
+
+enum accel_type
+{
+	ACCEL_EMBREE, // Embree 2, see embree_accelerator.h
+	ACCEL_BVH,    // the built-in BVH, see bvh.h
+};
+
+// how the built-in BVH keeps its triangles
+enum bvh_geometry
+{
+	BVH_GEOMETRY_COPY,      // the three corners of every triangle, the fastest to trace
+	BVH_GEOMETRY_SHARED,    // the meshes' own vertex and index arrays, no copy at all
+	BVH_GEOMETRY_QUANTIZED, // vertices on a 21 bit grid, and indices as deltas
+};
+
+// Ray tracing backend. Meshes go in with add_mesh(), then commit() builds the
+// acceleration structure; after that the queries are safe to call from any
+// number of threads.
+//
+// Geometry that's used more than once goes in as a prototype: the meshes
+// added between begin_prototype() and end_prototype() are built once, and
+// not traced themselves, and add_instance() places the whole prototype in the
+// scene as often as needed for the cost of a transform.
+struct accelerator
+{
+	virtual ~accelerator() {}
+
+	virtual const char* name() const = 0;
+
+	// positions has 3 floats per vertex, indices 3 per triangle. Returns the
+	// geometry id hits on this mesh report.
+	virtual unsigned int add_mesh(const vector<float>& positions, const vector<unsigned int>& indices) = 0;
+	// The same from buffers that outlive the accelerator, with 4 floats per
+	// vertex (the last one unused) 16 byte aligned. Backends that can trace
+	// straight out of them don't make a copy.
+	virtual unsigned int add_shared_mesh(const float* vertices, size_t num_vertices, const unsigned int* indices, size_t num_triangles)
+	{
+		vector<float> positions(3 * num_vertices);
+		for (size_t v = 0; v < num_vertices; ++v)
+		{
+			positions[3 * v + 0] = vertices[4 * v + 0];
+			positions[3 * v + 1] = vertices[4 * v + 1];
+			positions[3 * v + 2] = vertices[4 * v + 2];
+		}
+		return add_mesh(positions, vector<unsigned int>(indices, indices + 3 * num_triangles));
+	}
+	// Whether it reads the buffers of add_shared_mesh() after that returns.
+	// If not, they can go as soon as the meshes are in.
+	virtual bool traces_shared_meshes() const { return false; }
+	// Returns the prototype's id. Meshes in it get ids of their own, from 0.
+	virtual unsigned int begin_prototype() = 0;
+	virtual void end_prototype() = 0;
+	// transform takes the prototype to world space. Returns the geometry id
+	// of the instance, which hits on it report as inst_id.
+	virtual unsigned int add_instance(unsigned int prototype, const mat4& transform) = 0;
+
+	virtual void commit() = 0;
+	// box around the whole scene, instances included, after commit()
+	virtual void scene_bounds(vec3& lo, vec3& hi) = 0;
+
+	// closest hit
+	virtual void intersect1(ray_hit& ray) = 0;
+	// any hit, for shadow rays
+	virtual void occluded1(ray_hit& ray) = 0;
+
+	// The same for a whole batch. coherent hints that the rays start close
+	// together and point the same way, like camera rays.
+	virtual void intersect_stream(ray_stream& rays, bool /*coherent*/)
+	{
+		for (int i = 0; i < rays.size(); ++i)
+		{
+			ray_hit r = rays.ray(i);
+			intersect1(r);
+			rays.store(i, r);
+		}
+	}
+	virtual void occluded_stream(ray_stream& rays, bool /*coherent*/)
+	{
+		for (int i = 0; i < rays.size(); ++i)
+		{
+			ray_hit r = rays.ray(i);
+			occluded1(r);
+			rays.geom_id[i] = r.geom_id;
+		}
+	}
+
+	// true if a query since the last call could not run, e.g. a packet width
+	// the CPU doesn't support
+	virtual bool query_failed() { return false; }
+};
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <new>
+
+// Heap allocations made by the current thread so far. The global operator
+// new is replaced to count them, so a benchmark can check that a loop
+// doesn't allocate; it costs one thread local increment per allocation.
+thread_local uint64_t thread_allocations = 0;
+
+void* operator new(size_t size)
+{
+	++thread_allocations;
+	if (void* p = malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+void operator delete(void* p) noexcept
+{
+	free(p);
+}
+void operator delete[](void* p) noexcept
+{
+	free(p);
+}
+void operator delete(void* p, size_t) noexcept
+{
+	free(p);
+}
+void operator delete[](void* p, size_t) noexcept
+{
+	free(p);
+}
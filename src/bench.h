@@ -0,0 +1,235 @@
+#pragma once
+
+#include <stdio.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "tiny_obj_loader.h"
+
+#include "accelerator.h"
+#include "bvh.h"
+#include "mesh_buffer.h"
+#include "obj_parser.h"
+#include "ray_stream.h"
+#include "thread_pool.h"
+#ifndef ALBEDO_NO_EMBREE
+#include "embree_accelerator.h"
+#endif
+
+double seconds_since(std::chrono::high_resolution_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+// Loads the geometry of an .obj into accel and times the build. Materials
+// and lights don't matter here, so this skips everything else addObj does.
+double build_benchmark_scene(accelerator& accel, const char* filename)
+{
+	std::vector<tinyobj::shape_t> shapes;
+	std::vector<tinyobj::material_t> materials;
+	tinyobj::LoadObj(shapes, materials, filename, "models/");
+
+	for (const tinyobj::shape_t& shape : shapes)
+		accel.add_mesh(shape.mesh.positions, shape.mesh.indices);
+
+	auto start = std::chrono::high_resolution_clock::now();
+	accel.commit();
+	return seconds_since(start);
+}
+
+// Times one trace of every ray in rays, returns Mrays/s. The stream is copied
+// first since tracing overwrites tfar and the hit fields.
+float time_trace(accelerator& accel, const ray_stream& rays, bool occlusion, bool coherent)
+{
+	ray_stream s = rays;
+	accel.query_failed(); // clear anything left over
+
+	auto start = std::chrono::high_resolution_clock::now();
+	if (occlusion)
+		accel.occluded_stream(s, coherent);
+	else
+		accel.intersect_stream(s, coherent);
+	double seconds = seconds_since(start);
+
+	// e.g. rtcIntersect16 on a CPU without AVX-512
+	if (accel.query_failed())
+		return -1;
+
+	return (float)(rays.size() / seconds / 1e6);
+}
+
+void print_trace_result(const char* name, float mrays)
+{
+	if (mrays < 0)
+		printf("    %-12s  not supported\n", name);
+	else
+		printf("    %-12s %8.2f Mrays/s\n", name, mrays);
+}
+
+// Single threaded, so the numbers are per core.
+void benchmark_accelerator(const char* label, accelerator& accel, const ray_stream& primary, const ray_stream& bounce, const ray_stream& shadow)
+{
+	printf("  %s\n", label);
+	print_trace_result("camera", time_trace(accel, primary, false, true));
+	print_trace_result("bounce", time_trace(accel, bounce, false, false));
+	print_trace_result("shadow", time_trace(accel, shadow, false, false));
+	print_trace_result("occluded", time_trace(accel, shadow, true, false));
+}
+
+// Builds filename with every backend, then traces the same camera, diffuse
+// bounce and shadow rays through each backend and query type. "shadow" is a
+// closest-hit query on the shadow rays, "occluded" the any-hit query the
+// renderer uses for them.
+void benchmark_accelerators(const char* filename, const ray_stream& primary, const ray_stream& bounce, const ray_stream& shadow)
+{
+	printf("%d camera, %d bounce and %d shadow rays\n", primary.size(), bounce.size(), shadow.size());
+
+#ifndef ALBEDO_NO_EMBREE
+	{
+		embree_accelerator embree(TRACE_SINGLE, 8, true);
+		printf("embree: built in %.1f ms\n", build_benchmark_scene(embree, filename) * 1000);
+
+		struct embree_config
+		{
+			const char* label;
+			trace_mode mode;
+			int packet_width;
+		};
+		embree_config configs[] = {
+			{ "rtcIntersect", TRACE_SINGLE, 1 },
+			{ "rtcIntersect4", TRACE_PACKET, 4 },
+			{ "rtcIntersect8", TRACE_PACKET, 8 },
+			{ "rtcIntersect16", TRACE_PACKET, 16 },
+			{ "rtcIntersect1M", TRACE_STREAM, 1 },
+		};
+		for (const embree_config& c : configs)
+		{
+			embree.mode = c.mode;
+			embree.packet_width = c.packet_width;
+			benchmark_accelerator(c.label, embree, primary, bounce, shadow);
+		}
+	}
+#endif
+
+	const char* geometry_names[] = { "copy", "shared", "quantized" };
+	for (int g = BVH_GEOMETRY_COPY; g <= BVH_GEOMETRY_QUANTIZED; ++g)
+	{
+		bvh_accelerator bvh((bvh_geometry)g);
+		double build_time = build_benchmark_scene(bvh, filename);
+		printf("bvh, %s geometry: built in %.1f ms, %d BVH4 nodes, %.1f MB of triangles\n", geometry_names[g],
+			build_time * 1000, (int)bvh.nodes4.size(), bvh.triangle_bytes() / (1024.0 * 1024.0));
+		benchmark_accelerator("single rays", bvh, primary, bounce, shadow);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Loader benchmark
+//-----------------------------------------------------------------------------
+// A grid of size x size quads with normals, two triangles each, as an .obj
+void write_synthetic_obj(const char* filename, int size)
+{
+	FILE* f = fopen(filename, "w");
+	for (int y = 0; y <= size; ++y)
+		for (int x = 0; x <= size; ++x)
+			fprintf(f, "v %f %f %f\n", (float)x / size, 0.1f * sinf(x * 0.05f) * cosf(y * 0.05f), (float)y / size);
+	for (int y = 0; y <= size; ++y)
+		for (int x = 0; x <= size; ++x)
+			fprintf(f, "vn %f %f %f\n", 0.f, 1.f, 0.f);
+	fprintf(f, "g grid\n");
+	for (int y = 0; y < size; ++y)
+	{
+		for (int x = 0; x < size; ++x)
+		{
+			int i = y * (size + 1) + x + 1;
+			int j = i + size + 1;
+			fprintf(f, "f %d//%d %d//%d %d//%d %d//%d\n", i, i, i + 1, i + 1, j + 1, j + 1, j, j);
+		}
+	}
+	fclose(f);
+}
+
+// Loads filename with tinyobj, load_obj() and load_obj_meshes(), prints
+// MB/s for each and checks that they agree.
+void benchmark_obj_loader(const char* filename, thread_pool& pool)
+{
+	uint64_t size;
+	int64_t mtime;
+	if (!file_stamp(filename, size, mtime))
+	{
+		printf("Can't open %s\n", filename);
+		return;
+	}
+	double mb = size / (1024.0 * 1024.0);
+	printf("%s: %.1f MB\n", filename, mb);
+
+	std::vector<tinyobj::shape_t> shapes_tiny, shapes_fast;
+	std::vector<tinyobj::material_t> materials_tiny, materials_fast;
+
+	auto start = std::chrono::high_resolution_clock::now();
+	tinyobj::LoadObj(shapes_tiny, materials_tiny, filename, "models/");
+	double tiny_time = seconds_since(start);
+
+	start = std::chrono::high_resolution_clock::now();
+	load_obj(shapes_fast, materials_fast, filename, "models/", pool);
+	double fast_time = seconds_since(start);
+
+	mesh_buffer buffer;
+	std::vector<obj_mesh> meshes;
+	std::vector<tinyobj::material_t> materials_meshes;
+	start = std::chrono::high_resolution_clock::now();
+	load_obj_meshes(buffer, meshes, materials_meshes, filename, "models/", pool);
+	double mesh_time = seconds_since(start);
+
+	printf("    %-12s %8.1f MB/s  %8.1f ms\n", "tinyobj", mb / tiny_time, tiny_time * 1000);
+	printf("    %-12s %8.1f MB/s  %8.1f ms  (%.1fx)\n", "load_obj", mb / fast_time, fast_time * 1000, tiny_time / fast_time);
+	printf("    %-12s %8.1f MB/s  %8.1f ms  (%.1fx)\n", "meshes", mb / mesh_time, mesh_time * 1000, tiny_time / mesh_time);
+
+	// the same triangles corner by corner, from fewer vertices
+	bool same_meshes = meshes.size() == shapes_fast.size();
+	for (size_t i = 0; same_meshes && i < meshes.size(); ++i)
+	{
+		const tinyobj::mesh_t& a = shapes_fast[i].mesh;
+		const float* vertices = buffer.vertices(i);
+		const unsigned int* indices = buffer.indices(i);
+		same_meshes = meshes[i].name == shapes_fast[i].name && buffer.meshes[i].num_triangles == a.indices.size() / 3;
+		for (size_t k = 0; same_meshes && k < a.indices.size(); ++k)
+			for (int c = 0; c < 3; ++c)
+				same_meshes = same_meshes && vertices[4 * indices[k] + c] == a.positions[3 * a.indices[k] + c];
+	}
+	if (!same_meshes)
+		printf("    MESHES DIFFER\n");
+
+	// same meshes, positions may differ in the last bit since tinyobj's
+	// float parser doesn't always round correctly
+	bool same = shapes_tiny.size() == shapes_fast.size() && materials_tiny.size() == materials_fast.size();
+	float max_diff = 0;
+	size_t triangles = 0;
+	for (size_t i = 0; same && i < shapes_tiny.size(); ++i)
+	{
+		const tinyobj::mesh_t& a = shapes_tiny[i].mesh;
+		const tinyobj::mesh_t& b = shapes_fast[i].mesh;
+		same = shapes_tiny[i].name == shapes_fast[i].name && a.indices == b.indices &&
+			a.material_ids == b.material_ids && a.positions.size() == b.positions.size() &&
+			a.normals.size() == b.normals.size() && a.texcoords.size() == b.texcoords.size();
+		for (size_t k = 0; same && k < a.positions.size(); ++k)
+			max_diff = std::max(max_diff, fabsf(a.positions[k] - b.positions[k]));
+		triangles += a.indices.size() / 3;
+	}
+	if (same)
+		printf("    %zu shapes, %zu triangles, same result (positions differ by at most %g)\n", shapes_fast.size(), triangles, max_diff);
+	else
+		printf("    RESULTS DIFFER\n");
+}
+
+// GP.obj, then a synthetic mesh of about two million triangles
+void benchmark_obj_loaders(const char* filename, thread_pool& pool)
+{
+	printf("Parsing with %d threads\n", pool.size());
+	benchmark_obj_loader(filename, pool);
+
+	const char* synthetic = "bench_synthetic.obj";
+	write_synthetic_obj(synthetic, 1000);
+	benchmark_obj_loader(synthetic, pool);
+	remove(synthetic);
+}
@@ -0,0 +1,248 @@
+#pragma once
+
+#include <math.h>
+#include <algorithm>
+
+#include <glm/glm.hpp>
+using namespace glm;
+
+#include "material.h"
+#include "spectrum.h"
+
+// Reflection off the materials that aren't diffuse (material.h): GGX
+// microfacets with Smith's height-correlated shadowing, under a Schlick
+// Fresnel tinted by the specular color for conductors, and under the
+// dielectric Fresnel of the coat's ior, over the diffuse base, for
+// dielectrics. Only reflection, no transmission.
+//
+// Directions point away from the surface: in is back the way the path came,
+// out where it goes next. Both have to be on the side the normal faces.
+// Sampling picks among the microfacet normals visible from in (Heitz 2018),
+// so the weight f * cos / pdf of a reflection is Fresnel times shadowing,
+// without the spikes of the distribution itself, however smooth it is.
+
+const float BSDF_PI = 3.14159265f;
+
+//-----------------------------------------------------------------------------
+// GGX
+//-----------------------------------------------------------------------------
+// distribution of microfacet normals at cos_h from the normal
+float ggx_d(float cos_h, float alpha)
+{
+	float a2 = alpha * alpha;
+	float t = cos_h * cos_h * (a2 - 1) + 1;
+	return a2 / (BSDF_PI * t * t);
+}
+
+// Smith's Lambda of a direction at cos from the normal; G1 is 1 / (1 + it)
+float ggx_lambda(float cos, float alpha)
+{
+	float cos2 = cos * cos;
+	float tan2 = std::max(0.f, 1 - cos2) / cos2;
+	return (sqrt(1 + alpha * alpha * tan2) - 1) / 2;
+}
+
+// A microfacet normal, in the frame of the surface's (z), seen from w with
+// probability D_w(h) = G1(w) max(0, w.h) D(h) / w.z
+vec3 sample_ggx_vndf(vec3 w, float alpha, vec2 u)
+{
+	// stretch to the hemisphere configuration, where visible normals are
+	// uniform over a projected disk, half of it foreshortened
+	vec3 v = normalize(vec3(alpha * w.x, alpha * w.y, w.z));
+	float len2 = v.x * v.x + v.y * v.y;
+	vec3 t1 = len2 > 0 ? vec3(-v.y, v.x, 0) / sqrt(len2) : vec3(1, 0, 0);
+	vec3 t2 = cross(v, t1);
+
+	float r = sqrt(u.x);
+	float phi = 2 * BSDF_PI * u.y;
+	float p1 = r * cos(phi);
+	float p2 = r * sin(phi);
+	float s = (1 + v.z) / 2;
+	p2 = (1 - s) * sqrt(std::max(0.f, 1 - p1 * p1)) + s * p2;
+	vec3 h = t1 * p1 + t2 * p2 + v * sqrt(std::max(0.f, 1 - p1 * p1 - p2 * p2));
+
+	return normalize(vec3(alpha * h.x, alpha * h.y, std::max(0.f, h.z)));
+}
+
+//-----------------------------------------------------------------------------
+// Fresnel
+//-----------------------------------------------------------------------------
+// of light arriving at cos from the normal, from air into a dielectric
+float fresnel_dielectric(float cos, float ior)
+{
+	float sin2_t = std::max(0.f, 1 - cos * cos) / (ior * ior);
+	if (sin2_t >= 1)
+		return 1;
+	float cos_t = sqrt(1 - sin2_t);
+	float rs = (cos - ior * cos_t) / (cos + ior * cos_t);
+	float rp = (ior * cos - cos_t) / (ior * cos + cos_t);
+	return (rs * rs + rp * rp) / 2;
+}
+
+spectrum fresnel_schlick(const spectrum& f0, float cos)
+{
+	float c = 1 - std::max(0.f, cos);
+	float c5 = c * c * c * c * c;
+	spectrum f;
+	for (int i = 0; i < SPECTRUM_LANES; ++i)
+		f[i] = f0[i] + (1 - f0[i]) * c5;
+	return f;
+}
+
+//-----------------------------------------------------------------------------
+// Materials
+//-----------------------------------------------------------------------------
+// Chance of sampling a dielectric's reflection rather than its diffuse base,
+// for a path arriving where the coat reflects fresnel of the light: what
+// each would return in the middle of the spectrum, kept off 0 and 1 so
+// neither lobe goes unsampled.
+float specular_chance(const material& m, float fresnel)
+{
+	float s = m.specular.eval(550.f) * fresnel;
+	float d = m.reflectance.eval(550.f) * (1 - s);
+	return s + d > 0 ? std::min(0.9f, std::max(0.25f, s / (s + d))) : 0.5f;
+}
+
+// The geometry of a reflection from in to out, and what it takes to sample
+struct microfacet_reflection
+{
+	float cos_in, cos_out;
+	float cos_h; // of the half vector, from the normal
+	float cos_in_h; // between in (or out) and the half vector
+	float d;
+	float lambda_in, lambda_out;
+
+	// false if in or out is below the surface
+	bool set(const material& m, vec3 n, vec3 in, vec3 out)
+	{
+		cos_in = dot(n, in);
+		cos_out = dot(n, out);
+		if (cos_in <= 0 || cos_out <= 0)
+			return false;
+		vec3 h = normalize(in + out);
+		cos_h = dot(n, h);
+		cos_in_h = std::max(0.f, dot(in, h));
+		d = ggx_d(cos_h, m.roughness);
+		lambda_in = ggx_lambda(cos_in, m.roughness);
+		lambda_out = ggx_lambda(cos_out, m.roughness);
+		return true;
+	}
+
+	// of sample_ggx_vndf() from in reflecting to out, and from out to in
+	float pdf_from_in() const
+	{
+		return d / (4 * cos_in * (1 + lambda_in));
+	}
+	float pdf_from_out() const
+	{
+		return d / (4 * cos_out * (1 + lambda_out));
+	}
+	// D G / (4 cos_in cos_out), Fresnel to go
+	float specular() const
+	{
+		return d / ((1 + lambda_in + lambda_out) * 4 * cos_in * cos_out);
+	}
+};
+
+// the pdfs of sampling out from in (pdf) and in from out (pdf_rev) of r
+void bsdf_pdfs(const material& m, const microfacet_reflection& r, float& pdf, float& pdf_rev)
+{
+	if (m.type == BSDF_CONDUCTOR)
+	{
+		pdf = r.pdf_from_in();
+		pdf_rev = r.pdf_from_out();
+		return;
+	}
+	float p_in = specular_chance(m, fresnel_dielectric(r.cos_in, m.ior));
+	float p_out = specular_chance(m, fresnel_dielectric(r.cos_out, m.ior));
+	pdf = p_in * r.pdf_from_in() + (1 - p_in) * r.cos_out / BSDF_PI;
+	pdf_rev = p_out * r.pdf_from_out() + (1 - p_out) * r.cos_in / BSDF_PI;
+}
+
+// f of a reflection at a surface facing n, and its pdfs in both directions,
+// all 0 if in or out is below the surface
+spectrum eval_bsdf(const spectrum& lambda, const material& m, vec3 n, vec3 in, vec3 out, float& pdf, float& pdf_rev)
+{
+	microfacet_reflection r;
+	if (!r.set(m, n, in, out))
+	{
+		pdf = pdf_rev = 0;
+		return spectrum(0);
+	}
+	bsdf_pdfs(m, r, pdf, pdf_rev);
+
+	spectrum ks = m.specular.eval(lambda);
+	if (m.type == BSDF_CONDUCTOR)
+		return fresnel_schlick(ks, r.cos_in_h) * r.specular();
+
+	// what the coat lets through on the way in and out reaches the base
+	float f_in = fresnel_dielectric(r.cos_in, m.ior);
+	float f_out = fresnel_dielectric(r.cos_out, m.ior);
+	spectrum kd = m.reflectance.eval(lambda);
+	float specular = fresnel_dielectric(r.cos_in_h, m.ior) * r.specular();
+	spectrum f;
+	for (int i = 0; i < SPECTRUM_LANES; ++i)
+		f[i] = ks[i] * specular + kd[i] / BSDF_PI * (1 - ks[i] * f_in) * (1 - ks[i] * f_out);
+	return f;
+}
+
+// pdf of sampling out from in, as eval_bsdf() gives it
+float bsdf_pdf(const material& m, vec3 n, vec3 in, vec3 out)
+{
+	microfacet_reflection r;
+	if (!r.set(m, n, in, out))
+		return 0;
+	float pdf, pdf_rev;
+	bsdf_pdfs(m, r, pdf, pdf_rev);
+	return pdf;
+}
+
+// A sampled bounce: where to, f and f * cos / pdf for it, and its pdfs
+// both ways as eval_bsdf() gives them.
+struct bsdf_sample
+{
+	vec3 dir;
+	spectrum f;
+	spectrum weight;
+	float pdf;
+	float pdf_rev;
+};
+
+// Picks out for a path that arrived from in at a surface facing n, with
+// u_lobe choosing between a dielectric's reflection and base, and u the
+// direction. False if there is none, when the reflection leaves below.
+bool sample_bsdf(const spectrum& lambda, const material& m, vec3 n, vec3 in, float u_lobe, vec2 u, bsdf_sample& s)
+{
+	// the surface's frame (Duff et al. 2017)
+	float sign = n.z >= 0 ? 1.f : -1.f;
+	float a = -1 / (sign + n.z);
+	float b = n.x * n.y * a;
+	vec3 tangent = vec3(1 + sign * n.x * n.x * a, sign * b, -sign * n.x);
+	vec3 bitangent = vec3(b, sign + n.y * n.y * a, -n.y);
+
+	vec3 w = vec3(dot(in, tangent), dot(in, bitangent), dot(in, n));
+	if (w.z <= 0)
+		return false;
+
+	vec3 out;
+	if (m.type == BSDF_CONDUCTOR || u_lobe < specular_chance(m, fresnel_dielectric(w.z, m.ior)))
+	{
+		vec3 h = sample_ggx_vndf(w, m.roughness, u);
+		out = h * (2 * dot(w, h)) - w;
+	}
+	else
+	{
+		float r = sqrt(u.x);
+		float phi = 2 * BSDF_PI * u.y;
+		out = vec3(r * cos(phi), r * sin(phi), sqrt(std::max(0.f, 1 - u.x)));
+	}
+	if (out.z <= 0)
+		return false;
+
+	s.dir = normalize(tangent * out.x + bitangent * out.y + n * out.z);
+	s.f = eval_bsdf(lambda, m, n, in, s.dir, s.pdf, s.pdf_rev);
+	if (s.pdf <= 0)
+		return false;
+	s.weight = s.f * (dot(n, s.dir) / s.pdf);
+	return true;
+}
@@ -0,0 +1,1055 @@
+#pragma once
+
+#include <assert.h>
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <algorithm>
+#include <memory>
+#include <vector>
+using std::vector;
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define BVH_SSE 1
+#endif
+
+#include <glm/glm.hpp>
+using namespace glm;
+
+#include "accelerator.h"
+
+// Built-in ray tracing backend, no dependencies. commit() runs a binned SAH
+// build into a binary BVH of 32 byte nodes, then collapses that into a
+// four-wide BVH whose child boxes are tested together with SSE. Triangles are
+// intersected with the watertight test of Woop, Benthin and Wald (2013), so
+// rays can't slip through shared edges.
+//
+// With instances it's two levels: every prototype is a BVH of its own, and
+// the top level is built the same way over the instances' boxes. A ray that
+// reaches an instance goes on through its prototype in the prototype's
+// space.
+//
+// Triangles are kept one of three ways (bvh_geometry). By default the leaves
+// hold the three corners of each, 44 bytes a triangle on top of the mesh.
+// For scenes that don't fit like that, they can instead point into the
+// meshes' own arrays, which are then all there is (8 bytes), or hold indices
+// into a copy of the vertices rounded to a grid of 2^21 steps across each
+// mesh (16 bytes, and 8 a vertex), after which the meshes can go. Both look
+// the corners up as they intersect, which costs some speed. A vertex shared
+// by triangles decodes to the same point for each of them, so rays still
+// can't slip between them. Meshes whose sizes are within the same power of
+// two share a grid too; an edge between others can open by half a step.
+
+// Binary node, as it comes out of the builder. The two children of an inner
+// node are stored next to each other.
+struct bvh_node
+{
+	float lo[3];
+	unsigned int left_or_first; // inner: index of the left child; leaf: first triangle
+	float hi[3];
+	unsigned int count;         // triangles in a leaf, 0 for inner nodes
+};
+
+// Four-wide node used for traversal. Child boxes are stored SoA so one SIMD
+// slab test covers all four; empty slots have a box at +infinity, which no
+// ray can hit.
+struct alignas(16) bvh4_node
+{
+	float lo_x[4], lo_y[4], lo_z[4];
+	float hi_x[4], hi_y[4], hi_z[4];
+	int child[4]; // inner: index of a bvh4_node; leaf: first triangle
+	int count[4]; // triangles in a leaf, 0 for inner children, -1 for empty slots
+};
+
+// BVH_GEOMETRY_COPY
+struct bvh_triangle
+{
+	vec3 v0, v1, v2;
+	unsigned int geom_id;
+	unsigned int prim_id;
+};
+
+// BVH_GEOMETRY_SHARED: triangle prim_id of mesh geom_id
+struct bvh_triangle_ref
+{
+	unsigned int geom_id;
+	unsigned int prim_id;
+};
+
+// BVH_GEOMETRY_QUANTIZED: the corners by vertex in the mesh's grid, the
+// second and third as differences from the first. If those don't fit, d1 is
+// BVH_WIDE_TRIANGLE and v0 is where the three indices start in
+// bvh_accelerator::wide_indices.
+struct bvh_packed_triangle
+{
+	unsigned int geom_id;
+	unsigned int prim_id;
+	unsigned int v0;
+	int16_t d1, d2;
+};
+
+const int16_t BVH_WIDE_TRIANGLE = INT16_MIN;
+const int BVH_GRID_BITS = 21;
+
+// The vertices of a mesh, for the triangles that don't have their own
+struct bvh_mesh
+{
+	// BVH_GEOMETRY_SHARED: 4 floats per vertex and 3 indices per triangle,
+	// the caller's or, for add_mesh(), copies
+	const float* vertices = nullptr;
+	const unsigned int* indices = nullptr;
+	vector<float> own_vertices;
+	vector<unsigned int> own_indices;
+
+	// BVH_GEOMETRY_QUANTIZED: BVH_GRID_BITS per coordinate from x up; a
+	// vertex is at (origin + its coordinates) * step, step a power of two
+	vector<uint64_t> grid;
+	int64_t origin[3] = {};
+	float step = 1;
+
+	vec3 grid_vertex(unsigned int v) const
+	{
+		const uint64_t mask = (1ull << BVH_GRID_BITS) - 1;
+		uint64_t g = grid[v];
+		return vec3((float)(origin[0] + (int64_t)(g & mask)),
+			(float)(origin[1] + (int64_t)((g >> BVH_GRID_BITS) & mask)),
+			(float)(origin[2] + (int64_t)(g >> (2 * BVH_GRID_BITS)))) * step;
+	}
+};
+
+struct bvh_bounds
+{
+	vec3 lo = vec3(FLT_MAX);
+	vec3 hi = vec3(-FLT_MAX);
+
+	void grow(vec3 p)
+	{
+		lo = min(lo, p);
+		hi = max(hi, p);
+	}
+	void grow(const bvh_bounds& b)
+	{
+		lo = min(lo, b.lo);
+		hi = max(hi, b.hi);
+	}
+	float area() const
+	{
+		vec3 e = hi - lo;
+		if (e.x < 0)
+			return 0;
+		return 2 * (e.x * e.y + e.y * e.z + e.z * e.x);
+	}
+};
+
+struct bvh_accelerator;
+
+// a prototype placed in the scene
+struct bvh_instance
+{
+	const bvh_accelerator* prototype;
+	mat4 to_object;
+	mat3 normal_to_world;
+	unsigned int id; // INVALID_GEOMETRY_ID for the scene's own meshes, see commit()
+};
+
+//-----------------------------------------------------------------------------
+// Per ray precomputation
+//-----------------------------------------------------------------------------
+struct bvh_ray
+{
+	vec3 org;
+	vec3 inv_dir;
+
+	// watertight triangle test: the axis the ray mostly points along becomes
+	// z, then the triangle is sheared so the ray runs straight down it
+	int kx, ky, kz;
+	float sx, sy, sz;
+
+	bvh_ray(vec3 o, vec3 d)
+	{
+		org = o;
+		for (int k = 0; k < 3; ++k)
+		{
+			// keep the slab test free of 0 * inf
+			float dk = fabsf(d[k]) < 1e-20f ? (d[k] < 0 ? -1e-20f : 1e-20f) : d[k];
+			inv_dir[k] = 1 / dk;
+		}
+
+		vec3 a = abs(d);
+		kz = a.x > a.y ? (a.x > a.z ? 0 : 2) : (a.y > a.z ? 1 : 2);
+		kx = (kz + 1) % 3;
+		ky = (kx + 1) % 3;
+		if (d[kz] < 0)
+			std::swap(kx, ky);
+
+		sx = d[kx] / d[kz];
+		sy = d[ky] / d[kz];
+		sz = 1.0f / d[kz];
+	}
+};
+
+// t, u and v are only written on a hit closer than tfar
+bool intersect_triangle(const bvh_ray& r, vec3 v0, vec3 v1, vec3 v2, float tfar, float& t, float& u, float& v)
+{
+	vec3 a = v0 - r.org;
+	vec3 b = v1 - r.org;
+	vec3 c = v2 - r.org;
+
+	float ax = a[r.kx] - r.sx * a[r.kz];
+	float ay = a[r.ky] - r.sy * a[r.kz];
+	float bx = b[r.kx] - r.sx * b[r.kz];
+	float by = b[r.ky] - r.sy * b[r.kz];
+	float cx = c[r.kx] - r.sx * c[r.kz];
+	float cy = c[r.ky] - r.sy * c[r.kz];
+
+	// scaled barycentrics of v0, v1, v2
+	float U = cx * by - cy * bx;
+	float V = ax * cy - ay * cx;
+	float W = bx * ay - by * ax;
+
+	// exactly on an edge, redo it in double to get the sign right
+	if (U == 0 || V == 0 || W == 0)
+	{
+		U = (float)((double)cx * by - (double)cy * bx);
+		V = (float)((double)ax * cy - (double)ay * cx);
+		W = (float)((double)bx * ay - (double)by * ax);
+	}
+
+	// two sided: all signs have to agree
+	if ((U < 0 || V < 0 || W < 0) && (U > 0 || V > 0 || W > 0))
+		return false;
+
+	float det = U + V + W;
+	if (det == 0)
+		return false;
+
+	float az = r.sz * a[r.kz];
+	float bz = r.sz * b[r.kz];
+	float cz = r.sz * c[r.kz];
+	float T = U * az + V * bz + W * cz;
+
+	float inv_det = 1.0f / det;
+	float hit_t = T * inv_det;
+	if (hit_t <= 0 || hit_t >= tfar)
+		return false;
+
+	t = hit_t;
+	u = V * inv_det;
+	v = W * inv_det;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Backend
+//-----------------------------------------------------------------------------
+struct bvh_accelerator : accelerator
+{
+	static const int NUM_BINS = 16;
+	static const int MAX_LEAF_SIZE = 4;
+	// levels of the binary tree at most, and so of the four-wide one, whose
+	// traversal has at most three children of each level left on its stack
+	static const int MAX_DEPTH = 64;
+	static const int STACK_SIZE = 3 * MAX_DEPTH + 1;
+
+	bvh_geometry geometry;
+	// one of these, in leaf order after commit()
+	vector<bvh_triangle> triangles;
+	vector<bvh_triangle_ref> triangle_refs;
+	vector<bvh_packed_triangle> packed_triangles;
+	vector<bvh_mesh> meshes; // by geometry id, for the last two
+	vector<unsigned int> wide_indices;
+	unsigned int num_meshes = 0; // and instances, which share the ids
+
+	// With instances the leaves hold those, in leaf order, instead of
+	// triangles.
+	vector<std::unique_ptr<bvh_accelerator>> prototypes;
+	vector<bvh_instance> instances;
+	vector<mat4> instance_transforms; // to world, by index in instances until commit()
+	bool building_prototype = false;
+	bvh_bounds bounds; // of everything, after commit()
+
+	vector<bvh_node> nodes;
+	vector<bvh4_node> nodes4;
+
+	// build only
+	vector<unsigned int> prim_index;
+	vector<bvh_bounds> prim_bounds;
+
+	bvh_accelerator(bvh_geometry g = BVH_GEOMETRY_COPY) : geometry(g) {}
+
+	const char* name() const override
+	{
+		return "bvh";
+	}
+
+	unsigned int add_mesh(const vector<float>& positions, const vector<unsigned int>& indices) override
+	{
+		if (building_prototype)
+			return prototypes.back()->add_mesh(positions, indices);
+		return add_triangles(positions.data(), 3, positions.size() / 3, indices.data(), indices.size() / 3, false);
+	}
+
+	unsigned int add_shared_mesh(const float* vertices, size_t num_vertices, const unsigned int* indices, size_t num_triangles) override
+	{
+		if (building_prototype)
+			return prototypes.back()->add_shared_mesh(vertices, num_vertices, indices, num_triangles);
+		return add_triangles(vertices, 4, num_vertices, indices, num_triangles, true);
+	}
+
+	bool traces_shared_meshes() const override
+	{
+		return geometry == BVH_GEOMETRY_SHARED;
+	}
+
+	// vertices has stride floats per vertex; shared if they outlive the
+	// accelerator, as add_shared_mesh() promises
+	unsigned int add_triangles(const float* vertices, int stride, size_t num_vertices, const unsigned int* indices,
+		size_t num_triangles, bool shared)
+	{
+		unsigned int geom_id = num_meshes++;
+		auto position = [&](unsigned int v)
+		{
+			const float* p = vertices + (size_t)stride * v;
+			return vec3(p[0], p[1], p[2]);
+		};
+
+		if (geometry == BVH_GEOMETRY_COPY)
+		{
+			for (size_t i = 0; i < num_triangles; ++i)
+			{
+				bvh_triangle t;
+				t.v0 = position(indices[3 * i + 0]);
+				t.v1 = position(indices[3 * i + 1]);
+				t.v2 = position(indices[3 * i + 2]);
+				t.geom_id = geom_id;
+				t.prim_id = (unsigned int)i;
+				triangles.push_back(t);
+			}
+			return geom_id;
+		}
+
+		if (geom_id >= meshes.size())
+			meshes.resize(geom_id + 1);
+		bvh_mesh& m = meshes[geom_id];
+		if (geometry == BVH_GEOMETRY_SHARED)
+		{
+			if (shared)
+			{
+				m.vertices = vertices;
+				m.indices = indices;
+			}
+			else
+			{
+				m.own_vertices.assign(4 * num_vertices, 0.f);
+				for (size_t v = 0; v < num_vertices; ++v)
+					for (int k = 0; k < 3; ++k)
+						m.own_vertices[4 * v + k] = vertices[(size_t)stride * v + k];
+				m.own_indices.assign(indices, indices + 3 * num_triangles);
+				m.vertices = m.own_vertices.data();
+				m.indices = m.own_indices.data();
+			}
+			for (size_t i = 0; i < num_triangles; ++i)
+				triangle_refs.push_back({ geom_id, (unsigned int)i });
+			return geom_id;
+		}
+
+		quantize(m, num_vertices, position);
+		for (size_t i = 0; i < num_triangles; ++i)
+		{
+			const unsigned int* t = indices + 3 * i;
+			int64_t d1 = (int64_t)t[1] - t[0], d2 = (int64_t)t[2] - t[0];
+			bvh_packed_triangle p;
+			p.geom_id = geom_id;
+			p.prim_id = (unsigned int)i;
+			if (d1 > INT16_MIN && d1 <= INT16_MAX && d2 > INT16_MIN && d2 <= INT16_MAX)
+			{
+				p.v0 = t[0];
+				p.d1 = (int16_t)d1;
+				p.d2 = (int16_t)d2;
+			}
+			else
+			{
+				p.v0 = (unsigned int)wide_indices.size();
+				p.d1 = BVH_WIDE_TRIANGLE;
+				p.d2 = 0;
+				wide_indices.insert(wide_indices.end(), t, t + 3);
+			}
+			packed_triangles.push_back(p);
+		}
+		return geom_id;
+	}
+
+	// Rounds the vertices to the grid of the smallest power of two step that
+	// spans the mesh in BVH_GRID_BITS, with one bit to spare; a mesh far
+	// from the origin for its size gets no finer a step than its floats have.
+	template <typename position_fn>
+	static void quantize(bvh_mesh& m, size_t num_vertices, const position_fn& position)
+	{
+		bvh_bounds b;
+		for (size_t v = 0; v < num_vertices; ++v)
+			b.grow(position((unsigned int)v));
+		vec3 extent = b.hi - b.lo;
+		vec3 reach = max(abs(b.lo), abs(b.hi));
+		float size = std::max(std::max(extent.x, extent.y), extent.z);
+		size = std::max(size, std::max(std::max(reach.x, reach.y), reach.z) * ldexpf(1, -24));
+		m.step = size > 0 ? ldexpf(1, ilogbf(size) - (BVH_GRID_BITS - 2)) : 1;
+
+		auto snap = [&](float x)
+		{
+			return (int64_t)floor((double)x / m.step + 0.5);
+		};
+		for (int k = 0; k < 3; ++k)
+			m.origin[k] = num_vertices > 0 ? snap(b.lo[k]) : 0;
+		m.grid.resize(num_vertices);
+		for (size_t v = 0; v < num_vertices; ++v)
+		{
+			vec3 p = position((unsigned int)v);
+			uint64_t g = 0;
+			for (int k = 0; k < 3; ++k)
+				g |= (uint64_t)(snap(p[k]) - m.origin[k]) << (k * BVH_GRID_BITS);
+			m.grid[v] = g;
+		}
+	}
+
+	// the corners of triangle i, however they're kept
+	void triangle(unsigned int i, vec3& v0, vec3& v1, vec3& v2, unsigned int& geom_id, unsigned int& prim_id) const
+	{
+		if (geometry == BVH_GEOMETRY_COPY)
+		{
+			const bvh_triangle& t = triangles[i];
+			v0 = t.v0;
+			v1 = t.v1;
+			v2 = t.v2;
+			geom_id = t.geom_id;
+			prim_id = t.prim_id;
+		}
+		else if (geometry == BVH_GEOMETRY_SHARED)
+		{
+			const bvh_triangle_ref& t = triangle_refs[i];
+			const bvh_mesh& m = meshes[t.geom_id];
+			const unsigned int* index = m.indices + 3 * (size_t)t.prim_id;
+			const float* p0 = m.vertices + 4 * (size_t)index[0];
+			const float* p1 = m.vertices + 4 * (size_t)index[1];
+			const float* p2 = m.vertices + 4 * (size_t)index[2];
+			v0 = vec3(p0[0], p0[1], p0[2]);
+			v1 = vec3(p1[0], p1[1], p1[2]);
+			v2 = vec3(p2[0], p2[1], p2[2]);
+			geom_id = t.geom_id;
+			prim_id = t.prim_id;
+		}
+		else
+		{
+			const bvh_packed_triangle& t = packed_triangles[i];
+			const bvh_mesh& m = meshes[t.geom_id];
+			unsigned int i0, i1, i2;
+			if (t.d1 != BVH_WIDE_TRIANGLE)
+			{
+				i0 = t.v0;
+				i1 = t.v0 + t.d1;
+				i2 = t.v0 + t.d2;
+			}
+			else
+			{
+				i0 = wide_indices[t.v0 + 0];
+				i1 = wide_indices[t.v0 + 1];
+				i2 = wide_indices[t.v0 + 2];
+			}
+			v0 = m.grid_vertex(i0);
+			v1 = m.grid_vertex(i1);
+			v2 = m.grid_vertex(i2);
+			geom_id = t.geom_id;
+			prim_id = t.prim_id;
+		}
+	}
+
+	// what the triangles take here, not counting shared meshes
+	size_t triangle_bytes() const
+	{
+		size_t bytes = triangles.size() * sizeof(bvh_triangle) + triangle_refs.size() * sizeof(bvh_triangle_ref) +
+			packed_triangles.size() * sizeof(bvh_packed_triangle) + wide_indices.size() * sizeof(unsigned int);
+		for (const bvh_mesh& m : meshes)
+			bytes += m.own_vertices.size() * sizeof(float) + m.own_indices.size() * sizeof(unsigned int) +
+				m.grid.size() * sizeof(uint64_t);
+		for (const auto& p : prototypes)
+			bytes += p->triangle_bytes();
+		return bytes;
+	}
+
+	unsigned int num_triangles() const
+	{
+		if (geometry == BVH_GEOMETRY_COPY)
+			return (unsigned int)triangles.size();
+		if (geometry == BVH_GEOMETRY_SHARED)
+			return (unsigned int)triangle_refs.size();
+		return (unsigned int)packed_triangles.size();
+	}
+
+	unsigned int begin_prototype() override
+	{
+		prototypes.emplace_back(new bvh_accelerator(geometry));
+		building_prototype = true;
+		return (unsigned int)prototypes.size() - 1;
+	}
+
+	void end_prototype() override
+	{
+		building_prototype = false;
+	}
+
+	unsigned int add_instance(unsigned int prototype, const mat4& transform) override
+	{
+		bvh_instance inst;
+		inst.prototype = prototypes[prototype].get();
+		inst.to_object = inverse(transform);
+		mat3 linear = mat3(vec3(inst.to_object[0]), vec3(inst.to_object[1]), vec3(inst.to_object[2]));
+		inst.normal_to_world = transpose(linear);
+		inst.id = num_meshes++;
+		instances.push_back(inst);
+		instance_transforms.push_back(transform);
+		return inst.id;
+	}
+
+	void commit() override
+	{
+		nodes.clear();
+		nodes4.clear();
+		bounds = bvh_bounds();
+		for (auto& p : prototypes)
+			p->commit();
+
+		// The scene's own meshes become one more instance, so there's only
+		// one kind of leaf to test; it reports hits as if it weren't one.
+		if (!instances.empty() && num_triangles() > 0)
+		{
+			std::unique_ptr<bvh_accelerator> own(new bvh_accelerator(geometry));
+			own->triangles.swap(triangles);
+			own->triangle_refs.swap(triangle_refs);
+			own->packed_triangles.swap(packed_triangles);
+			own->meshes.swap(meshes);
+			own->wide_indices.swap(wide_indices);
+			own->commit();
+
+			bvh_instance inst;
+			inst.prototype = own.get();
+			inst.to_object = mat4(1);
+			inst.normal_to_world = mat3(1);
+			inst.id = INVALID_GEOMETRY_ID;
+			instances.push_back(inst);
+			instance_transforms.push_back(mat4(1));
+			prototypes.push_back(std::move(own));
+		}
+
+		unsigned int n = instances.empty() ? num_triangles() : (unsigned int)instances.size();
+		if (n == 0)
+			return;
+
+		prim_index.resize(n);
+		prim_bounds.resize(n);
+		for (unsigned int i = 0; i < n; ++i)
+		{
+			prim_index[i] = i;
+			prim_bounds[i] = instances.empty() ? triangle_bounds(i) : instance_bounds(i);
+			bounds.grow(prim_bounds[i]);
+		}
+
+		nodes.reserve(2 * n);
+		nodes.push_back(bvh_node());
+		build();
+		vector<bvh_bounds>().swap(prim_bounds);
+
+		// leaves index triangles or instances directly
+		if (!instances.empty())
+		{
+			to_leaf_order(instances);
+			vector<mat4>().swap(instance_transforms);
+		}
+		else if (geometry == BVH_GEOMETRY_COPY)
+			to_leaf_order(triangles);
+		else if (geometry == BVH_GEOMETRY_SHARED)
+			to_leaf_order(triangle_refs);
+		else
+			to_leaf_order(packed_triangles);
+
+		vector<unsigned int>().swap(prim_index);
+
+		// traversal only needs the four-wide nodes
+		collapse();
+		vector<bvh_node>().swap(nodes);
+	}
+
+	// Moves prims[prim_index[i]] to i, in place so the triangles are never
+	// in memory twice. Uses up prim_index.
+	template <typename T>
+	void to_leaf_order(vector<T>& prims)
+	{
+		for (unsigned int i = 0; i < prim_index.size(); ++i)
+		{
+			if (prim_index[i] == i)
+				continue;
+			T first = prims[i];
+			unsigned int j = i;
+			while (prim_index[j] != i)
+			{
+				unsigned int from = prim_index[j];
+				prims[j] = prims[from];
+				prim_index[j] = j;
+				j = from;
+			}
+			prims[j] = first;
+			prim_index[j] = j;
+		}
+	}
+
+	void scene_bounds(vec3& lo, vec3& hi) override
+	{
+		lo = bounds.lo;
+		hi = bounds.hi;
+	}
+
+	//-------------------------------------------------------------------------
+	// Binned SAH build
+	//-------------------------------------------------------------------------
+	bvh_bounds triangle_bounds(unsigned int i) const
+	{
+		vec3 v0, v1, v2;
+		unsigned int geom_id, prim_id;
+		triangle(i, v0, v1, v2, geom_id, prim_id);
+		bvh_bounds b;
+		b.grow(v0);
+		b.grow(v1);
+		b.grow(v2);
+		return b;
+	}
+
+	vec3 prim_centroid(unsigned int p) const
+	{
+		return (prim_bounds[p].lo + prim_bounds[p].hi) * 0.5f;
+	}
+
+	// the world space box around the corners of the prototype's box
+	bvh_bounds instance_bounds(unsigned int i) const
+	{
+		const bvh_bounds& b = instances[i].prototype->bounds;
+		bvh_bounds world;
+		if (b.lo.x > b.hi.x)
+			return world;
+		for (int c = 0; c < 8; ++c)
+		{
+			vec3 corner = vec3(c & 1 ? b.hi.x : b.lo.x, c & 2 ? b.hi.y : b.lo.y, c & 4 ? b.hi.z : b.lo.z);
+			world.grow(vec3(instance_transforms[i] * vec4(corner, 1)));
+		}
+		return world;
+	}
+
+	void make_leaf(unsigned int node, unsigned int first, unsigned int count)
+	{
+		nodes[node].left_or_first = first;
+		nodes[node].count = count;
+	}
+
+	// how often count halves until it is 1
+	static int halvings(unsigned int count)
+	{
+		int n = 0;
+		while (count > 1)
+		{
+			count = (count + 1) / 2;
+			n++;
+		}
+		return n;
+	}
+
+	struct build_task
+	{
+		unsigned int node, first, count;
+		int depth;
+	};
+
+	// Splits depth first with an explicit stack, so huge meshes can't run
+	// out of call stack, in the order recursion would number the nodes.
+	void build()
+	{
+		vector<build_task> tasks;
+		tasks.push_back({ 0, 0, (unsigned int)prim_index.size(), 0 });
+		while (!tasks.empty())
+		{
+			build_task t = tasks.back();
+			tasks.pop_back();
+			unsigned int mid;
+			if (!subdivide(t, mid))
+				continue;
+			unsigned int left = nodes[t.node].left_or_first;
+			tasks.push_back({ left + 1, mid, t.first + t.count - mid, t.depth + 1 });
+			tasks.push_back({ left, t.first, mid - t.first, t.depth + 1 });
+		}
+	}
+
+	// Makes t's node a leaf, or splits it at mid and adds its children. SAH
+	// can split off a triangle at a time, so once halving is all that still
+	// fits in MAX_DEPTH it splits at the median instead.
+	bool subdivide(const build_task& t, unsigned int& mid)
+	{
+		unsigned int node = t.node, first = t.first, count = t.count;
+		bvh_bounds bounds, centroid_bounds;
+		for (unsigned int i = first; i < first + count; ++i)
+		{
+			bounds.grow(prim_bounds[prim_index[i]]);
+			centroid_bounds.grow(prim_centroid(prim_index[i]));
+		}
+		for (int k = 0; k < 3; ++k)
+		{
+			nodes[node].lo[k] = bounds.lo[k];
+			nodes[node].hi[k] = bounds.hi[k];
+		}
+
+		if (count <= 2)
+		{
+			make_leaf(node, first, count);
+			return false;
+		}
+
+		vec3 extent = centroid_bounds.hi - centroid_bounds.lo;
+		if (t.depth + halvings(count) >= MAX_DEPTH)
+		{
+			int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : extent.y >= extent.z ? 1 : 2;
+			mid = first + count / 2;
+			std::nth_element(&prim_index[first], &prim_index[mid], &prim_index[first] + count, [&](unsigned int a, unsigned int b)
+			{
+				return prim_centroid(a)[axis] < prim_centroid(b)[axis];
+			});
+			split_node(node);
+			return true;
+		}
+
+		// best split over all three axes, in units of triangle tests
+		int best_axis = -1;
+		int best_bin = 0;
+		float best_cost = FLT_MAX;
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			if (extent[axis] <= 0)
+				continue;
+
+			bvh_bounds bin_bounds[NUM_BINS];
+			unsigned int bin_count[NUM_BINS] = {};
+			float scale = NUM_BINS / extent[axis];
+			for (unsigned int i = first; i < first + count; ++i)
+			{
+				unsigned int p = prim_index[i];
+				int b = std::min(NUM_BINS - 1, (int)((prim_centroid(p)[axis] - centroid_bounds.lo[axis]) * scale));
+				bin_bounds[b].grow(prim_bounds[p]);
+				bin_count[b]++;
+			}
+
+			// sweep from the right, then from the left
+			float right_area[NUM_BINS];
+			unsigned int right_count[NUM_BINS];
+			bvh_bounds acc;
+			unsigned int acc_count = 0;
+			for (int b = NUM_BINS - 1; b > 0; --b)
+			{
+				acc.grow(bin_bounds[b]);
+				acc_count += bin_count[b];
+				right_area[b] = acc.area();
+				right_count[b] = acc_count;
+			}
+
+			acc = bvh_bounds();
+			acc_count = 0;
+			for (int b = 1; b < NUM_BINS; ++b)
+			{
+				acc.grow(bin_bounds[b - 1]);
+				acc_count += bin_count[b - 1];
+				if (acc_count == 0 || right_count[b] == 0)
+					continue;
+
+				float cost = acc.area() * acc_count + right_area[b] * right_count[b];
+				if (cost < best_cost)
+				{
+					best_cost = cost;
+					best_axis = axis;
+					best_bin = b;
+				}
+			}
+		}
+
+		// one traversal step costs about as much as a triangle test
+		float parent_area = bounds.area();
+		float split_cost = 1 + (parent_area > 0 ? best_cost / parent_area : 0);
+		if (count <= MAX_LEAF_SIZE && (best_axis < 0 || split_cost >= count))
+		{
+			make_leaf(node, first, count);
+			return false;
+		}
+
+		if (best_axis >= 0)
+		{
+			float scale = NUM_BINS / extent[best_axis];
+			float lo = centroid_bounds.lo[best_axis];
+			unsigned int* split = std::partition(&prim_index[first], &prim_index[first] + count, [&](unsigned int p)
+			{
+				int b = std::min(NUM_BINS - 1, (int)((prim_centroid(p)[best_axis] - lo) * scale));
+				return b < best_bin;
+			});
+			mid = (unsigned int)(split - &prim_index[0]);
+		}
+		else
+		{
+			// all centroids in one spot, just halve the list
+			mid = first + count / 2;
+		}
+		split_node(node);
+		return true;
+	}
+
+	void split_node(unsigned int node)
+	{
+		unsigned int left = (unsigned int)nodes.size();
+		nodes.push_back(bvh_node());
+		nodes.push_back(bvh_node());
+		nodes[node].left_or_first = left;
+		nodes[node].count = 0;
+	}
+
+	//-------------------------------------------------------------------------
+	// Collapse to BVH4
+	//-------------------------------------------------------------------------
+	float node_area(unsigned int node) const
+	{
+		const bvh_node& n = nodes[node];
+		float ex = n.hi[0] - n.lo[0], ey = n.hi[1] - n.lo[1], ez = n.hi[2] - n.lo[2];
+		return ex * ey + ey * ez + ez * ex;
+	}
+
+	void collapse()
+	{
+		if (nodes[0].count > 0)
+		{
+			// the whole scene is one leaf; give it a parent
+			unsigned int kids[1] = { 0 };
+			emit_node4(kids, 1);
+			return;
+		}
+		// at most one per inner node, reserved so growing never copies them
+		nodes4.reserve(nodes.size() / 2);
+		collapse_node(0);
+	}
+
+	// the children of binary node `node` become one bvh4_node: keep opening
+	// up the inner child with the largest surface until there are four
+	int collapse_node(unsigned int node)
+	{
+		unsigned int kids[4];
+		int num_kids = 2;
+		kids[0] = nodes[node].left_or_first;
+		kids[1] = nodes[node].left_or_first + 1;
+
+		while (num_kids < 4)
+		{
+			int best = -1;
+			float best_area = -1;
+			for (int i = 0; i < num_kids; ++i)
+			{
+				if (nodes[kids[i]].count == 0 && node_area(kids[i]) > best_area)
+				{
+					best = i;
+					best_area = node_area(kids[i]);
+				}
+			}
+			if (best < 0)
+				break;
+
+			unsigned int opened = kids[best];
+			kids[best] = nodes[opened].left_or_first;
+			kids[num_kids++] = nodes[opened].left_or_first + 1;
+		}
+
+		return emit_node4(kids, num_kids);
+	}
+
+	int emit_node4(const unsigned int* kids, int num_kids)
+	{
+		int index = (int)nodes4.size();
+		nodes4.push_back(bvh4_node());
+
+		for (int i = 0; i < 4; ++i)
+		{
+			// careful, the recursion below reallocates nodes4
+			if (i >= num_kids)
+			{
+				bvh4_node& n4 = nodes4[index];
+				n4.lo_x[i] = n4.lo_y[i] = n4.lo_z[i] = INFINITY;
+				n4.hi_x[i] = n4.hi_y[i] = n4.hi_z[i] = INFINITY;
+				n4.child[i] = 0;
+				n4.count[i] = -1;
+				continue;
+			}
+
+			const bvh_node& n = nodes[kids[i]];
+			int child = n.count > 0 ? (int)n.left_or_first : collapse_node(kids[i]);
+
+			bvh4_node& n4 = nodes4[index];
+			n4.lo_x[i] = n.lo[0]; n4.lo_y[i] = n.lo[1]; n4.lo_z[i] = n.lo[2];
+			n4.hi_x[i] = n.hi[0]; n4.hi_y[i] = n.hi[1]; n4.hi_z[i] = n.hi[2];
+			n4.child[i] = child;
+			n4.count[i] = (int)n.count;
+		}
+		return index;
+	}
+
+	//-------------------------------------------------------------------------
+	// Traversal
+	//-------------------------------------------------------------------------
+	// slab test against all four children; returns a bit mask of the hits and
+	// the entry distance of each
+	int intersect_boxes(const bvh4_node& n, const bvh_ray& r, float tfar, float* tnear) const
+	{
+#ifdef BVH_SSE
+		__m128 ox = _mm_set1_ps(r.org.x), oy = _mm_set1_ps(r.org.y), oz = _mm_set1_ps(r.org.z);
+		__m128 ix = _mm_set1_ps(r.inv_dir.x), iy = _mm_set1_ps(r.inv_dir.y), iz = _mm_set1_ps(r.inv_dir.z);
+
+		__m128 t0x = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(n.lo_x), ox), ix);
+		__m128 t1x = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(n.hi_x), ox), ix);
+		__m128 t0y = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(n.lo_y), oy), iy);
+		__m128 t1y = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(n.hi_y), oy), iy);
+		__m128 t0z = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(n.lo_z), oz), iz);
+		__m128 t1z = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(n.hi_z), oz), iz);
+
+		__m128 tmin = _mm_max_ps(_mm_max_ps(_mm_min_ps(t0x, t1x), _mm_min_ps(t0y, t1y)),
+			_mm_max_ps(_mm_min_ps(t0z, t1z), _mm_setzero_ps()));
+		__m128 tmax = _mm_min_ps(_mm_min_ps(_mm_max_ps(t0x, t1x), _mm_max_ps(t0y, t1y)),
+			_mm_min_ps(_mm_max_ps(t0z, t1z), _mm_set1_ps(tfar)));
+		// a little slack on the exit distance so rounding can't make us miss a box we graze
+		tmax = _mm_mul_ps(tmax, _mm_set1_ps(1.0000004f));
+
+		_mm_storeu_ps(tnear, tmin);
+		return _mm_movemask_ps(_mm_cmple_ps(tmin, tmax));
+#else
+		int mask = 0;
+		for (int i = 0; i < 4; ++i)
+		{
+			float t0x = (n.lo_x[i] - r.org.x) * r.inv_dir.x, t1x = (n.hi_x[i] - r.org.x) * r.inv_dir.x;
+			float t0y = (n.lo_y[i] - r.org.y) * r.inv_dir.y, t1y = (n.hi_y[i] - r.org.y) * r.inv_dir.y;
+			float t0z = (n.lo_z[i] - r.org.z) * r.inv_dir.z, t1z = (n.hi_z[i] - r.org.z) * r.inv_dir.z;
+			float tmin = std::max(std::max(std::min(t0x, t1x), std::min(t0y, t1y)), std::max(std::min(t0z, t1z), 0.f));
+			float tmax = std::min(std::min(std::max(t0x, t1x), std::max(t0y, t1y)), std::min(std::max(t0z, t1z), tfar));
+			tnear[i] = tmin;
+			if (tmin <= tmax * 1.0000004f)
+				mask |= 1 << i;
+		}
+		return mask;
+#endif
+	}
+
+	// returns true on the first hit if any_hit is set
+	bool traverse(ray_hit& ray, bool any_hit) const
+	{
+		if (nodes4.empty())
+			return false;
+
+		bvh_ray r(ray.org, ray.dir);
+		bool found = false;
+
+		struct entry
+		{
+			int node;
+			float tnear;
+		};
+		entry stack[STACK_SIZE];
+		int sp = 0;
+		stack[sp++] = { 0, 0.f };
+
+		while (sp > 0)
+		{
+			entry e = stack[--sp];
+			if (e.tnear > ray.tfar)
+				continue; // something closer was found since this was pushed
+
+			const bvh4_node& n = nodes4[e.node];
+			alignas(16) float tnear[4];
+			int mask = intersect_boxes(n, r, ray.tfar, tnear);
+
+			int inner[4];
+			int num_inner = 0;
+			for (int i = 0; i < 4; ++i)
+			{
+				if (!(mask & (1 << i)) || n.count[i] < 0)
+					continue;
+
+				if (n.count[i] == 0)
+				{
+					inner[num_inner++] = i;
+					continue;
+				}
+
+				for (int k = n.child[i]; k < n.child[i] + n.count[i]; ++k)
+				{
+					if (!instances.empty())
+					{
+						if (!intersect_instance(instances[k], ray, any_hit))
+							continue;
+						found = true;
+						if (any_hit)
+							return true;
+						continue;
+					}
+
+					vec3 v0, v1, v2;
+					unsigned int geom_id, prim_id;
+					triangle(k, v0, v1, v2, geom_id, prim_id);
+					if (!intersect_triangle(r, v0, v1, v2, ray.tfar, ray.tfar, ray.u, ray.v))
+						continue;
+
+					found = true;
+					ray.geom_id = geom_id;
+					ray.prim_id = prim_id;
+					if (any_hit)
+						return true;
+					ray.ng = cross(v0 - v1, v2 - v0);
+				}
+			}
+
+			// push far to near so the nearest child comes off the stack first
+			for (int a = 1; a < num_inner; ++a)
+				for (int b = a; b > 0 && tnear[inner[b]] > tnear[inner[b - 1]]; --b)
+					std::swap(inner[b], inner[b - 1]);
+			assert(sp + num_inner <= STACK_SIZE);
+			for (int a = 0; a < num_inner; ++a)
+				stack[sp++] = { n.child[inner[a]], tnear[inner[a]] };
+		}
+		return found;
+	}
+
+	// the ray in the prototype's space has the same t, as its direction
+	// isn't normalized
+	bool intersect_instance(const bvh_instance& inst, ray_hit& ray, bool any_hit) const
+	{
+		const mat4& m = inst.to_object;
+		ray_hit local(vec3(m * vec4(ray.org, 1)), vec3(m * vec4(ray.dir, 0)), ray.tfar);
+		if (!inst.prototype->traverse(local, any_hit))
+			return false;
+
+		ray.tfar = local.tfar;
+		ray.u = local.u;
+		ray.v = local.v;
+		ray.geom_id = local.geom_id;
+		ray.prim_id = local.prim_id;
+		ray.inst_id = inst.id;
+		ray.ng = inst.id == INVALID_GEOMETRY_ID ? local.ng : inst.normal_to_world * local.ng;
+		return true;
+	}
+
+	void intersect1(ray_hit& ray) override
+	{
+		traverse(ray, false);
+	}
+
+	void occluded1(ray_hit& ray) override
+	{
+		// an occlusion query doesn't report where it hit
+		ray_hit r = ray;
+		if (traverse(r, true))
+			ray.geom_id = 0;
+	}
+};
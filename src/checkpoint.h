@@ -0,0 +1,191 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+using std::string;
+using std::vector;
+
+#include "file.h"
+#include "film.h"
+#include "sampler.h"
+#include "spectrum.h"
+
+// Progress of a render on disk: a small header followed by the film's
+// buffers as they are in memory, feature buffers included. The samplers
+// hash the pixel and sample index into their random numbers, so the
+// per-pixel sample counts, and the index the render started counting from,
+// are all the RNG state there is to save.
+//
+// Those sums are also how a frame is split over processes: each renders a
+// range of samples (--first-sample) or of tiles (--tiles), and the files
+// add up to the whole (merge_checkpoints()).
+struct checkpoint_header
+{
+	char magic[4]; // "ALBC"
+	uint32_t version;
+	uint32_t width;
+	uint32_t height;
+	uint32_t passes; // completed sampling rounds
+	uint32_t sampler;
+	uint32_t spectrum_lanes;
+	uint32_t first_sample; // sample index of each pixel's first sample
+};
+
+const uint32_t CHECKPOINT_VERSION = 2;
+
+// Writes to a temporary file first and renames it over the old checkpoint,
+// so a crash while saving keeps the last good one.
+bool save_checkpoint(const string& filename, const film& image, int passes, sampler_type sampler, int first_sample)
+{
+	string tmp = filename + ".tmp";
+	FILE* f = fopen(tmp.c_str(), "wb");
+	if (!f)
+	{
+		printf("Can't write checkpoint %s\n", tmp.c_str());
+		return false;
+	}
+
+	checkpoint_header h;
+	memcpy(h.magic, "ALBC", 4);
+	h.version = CHECKPOINT_VERSION;
+	h.width = image.width;
+	h.height = image.height;
+	h.passes = passes;
+	h.sampler = sampler;
+	h.spectrum_lanes = SPECTRUM_LANES;
+	h.first_sample = first_sample;
+
+	size_t n = image.width * image.height;
+	bool ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+		fwrite(image.xyz.data(), sizeof(vec3), n, f) == n &&
+		fwrite(image.y2.data(), sizeof(float), n, f) == n &&
+		fwrite(image.samples.data(), sizeof(unsigned), n, f) == n &&
+		fwrite(image.albedo.data(), sizeof(vec3), n, f) == n &&
+		fwrite(image.normal.data(), sizeof(vec3), n, f) == n &&
+		fwrite(image.depth.data(), sizeof(float), n, f) == n;
+	ok = fclose(f) == 0 && ok;
+	if (!ok)
+	{
+		printf("Failed writing checkpoint %s\n", tmp.c_str());
+		remove(tmp.c_str());
+		return false;
+	}
+
+	return replace_file(tmp, filename);
+}
+
+// opens filename and reads its header, or prints why not and returns null
+FILE* open_checkpoint(const string& filename, checkpoint_header& h)
+{
+	FILE* f = fopen(filename.c_str(), "rb");
+	if (!f)
+	{
+		printf("Can't open checkpoint %s\n", filename.c_str());
+		return nullptr;
+	}
+	if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, "ALBC", 4) != 0 || h.version != CHECKPOINT_VERSION)
+	{
+		printf("%s is not a checkpoint\n", filename.c_str());
+		fclose(f);
+		return nullptr;
+	}
+	return f;
+}
+
+// Loads a checkpoint saved by a render of the same size, sampler and
+// spectrum width into image, and returns how many passes it holds (or -1),
+// and the sample index it started from in first_sample.
+int load_checkpoint(const string& filename, film& image, sampler_type sampler, int& first_sample)
+{
+	checkpoint_header h;
+	FILE* f = open_checkpoint(filename, h);
+	if (!f)
+		return -1;
+	if ((int)h.width != image.width || (int)h.height != image.height || h.sampler != sampler || h.spectrum_lanes != SPECTRUM_LANES)
+	{
+		printf("Checkpoint %s is from a different render (%ux%u, sampler %u, %u wavelengths)\n",
+			filename.c_str(), h.width, h.height, h.sampler, h.spectrum_lanes);
+		fclose(f);
+		return -1;
+	}
+
+	size_t n = image.width * image.height;
+	bool ok = fread(image.xyz.data(), sizeof(vec3), n, f) == n &&
+		fread(image.y2.data(), sizeof(float), n, f) == n &&
+		fread(image.samples.data(), sizeof(unsigned), n, f) == n &&
+		fread(image.albedo.data(), sizeof(vec3), n, f) == n &&
+		fread(image.normal.data(), sizeof(vec3), n, f) == n &&
+		fread(image.depth.data(), sizeof(float), n, f) == n;
+	fclose(f);
+	if (!ok)
+	{
+		printf("Checkpoint %s is truncated\n", filename.c_str());
+		return -1;
+	}
+	first_sample = h.first_sample;
+	return h.passes;
+}
+
+// Adds the checkpoints in files, which must all be from renders of the
+// same size, sampler and spectrum width, to image. The result starts from
+// the lowest first_sample, and holds as many passes as the longest part.
+// Parts whose samples overlap in a pixel are the same samples twice, which
+// only looks like less noise, so that's reported. Returns false if a file
+// can't be read.
+bool merge_checkpoints(const vector<string>& files, film& image, int& passes, sampler_type& sampler, int& first_sample)
+{
+	// taken in order of where they start, so an overlap is a part starting
+	// before the samples of a pixel so far end
+	struct part
+	{
+		string filename;
+		int first_sample;
+	};
+	vector<part> parts;
+	for (const string& filename : files)
+	{
+		checkpoint_header h;
+		FILE* f = open_checkpoint(filename, h);
+		if (!f)
+			return false;
+		fclose(f);
+		if (parts.empty())
+			sampler = (sampler_type)h.sampler;
+		parts.push_back({ filename, (int)h.first_sample });
+	}
+	passes = 0;
+	first_sample = INT32_MAX;
+	std::stable_sort(parts.begin(), parts.end(), [](const part& a, const part& b) { return a.first_sample < b.first_sample; });
+
+	size_t n = image.width * image.height;
+	vector<int> end(n, 0);
+	film part_image(image.width, image.height);
+	for (const part& p : parts)
+	{
+		int start;
+		int part_passes = load_checkpoint(p.filename, part_image, sampler, start);
+		if (part_passes < 0)
+			return false;
+
+		size_t overlapping = 0;
+		for (size_t i = 0; i < n; ++i)
+		{
+			if (part_image.samples[i] == 0)
+				continue;
+			if (start < end[i])
+				overlapping++;
+			end[i] = std::max(end[i], start + (int)part_image.samples[i]);
+		}
+		if (overlapping > 0)
+			printf("Warning: %s has samples of %zu pixels that an earlier part has too\n", p.filename.c_str(), overlapping);
+
+		image.merge(part_image);
+		passes = std::max(passes, part_passes);
+		first_sample = std::min(first_sample, start);
+	}
+	return true;
+}
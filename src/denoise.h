@@ -0,0 +1,185 @@
+#pragma once
+
+#include <math.h>
+#include <algorithm>
+#include <vector>
+using std::vector;
+
+#include <glm/glm.hpp>
+using namespace glm;
+
+#include "film.h"
+#include "thread_pool.h"
+
+//-----------------------------------------------------------------------------
+// Edge-avoiding a-trous wavelet denoiser
+//-----------------------------------------------------------------------------
+// Dammertz et al. 2010, with the colour weight driven by each pixel's noise
+// estimate as in SVGF (Schied et al. 2017). Every pass runs a 5x5 B3 spline
+// kernel whose taps are 1, 2, 4, 8 and then 16 pixels apart. Each tap counts
+// only as much as its first hit looks like the centre's in normal, depth
+// and albedo, and as its colour is close to the centre's given how noisy
+// both are. It filters illumination, that is colour over albedo, so texture
+// and material edges stay sharp when the albedo goes back on.
+
+const int DENOISE_PASSES = 5;
+const int MIN_VARIANCE_SAMPLES = 4; // per pixel, to trust its own variance estimate
+
+struct denoise_params
+{
+	float color = 4;     // colour differences are scaled by this many standard deviations
+	float normal = 64;   // exponent on the cosine between normals
+	float depth = 0.02f; // relative depth difference per pixel of tap distance
+	float albedo = 0.1f;
+};
+
+float denoise_luminance(vec3 c)
+{
+	return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+}
+
+// rgb is linear, 3 floats per pixel, as bright as the film times scale
+void denoise(const film& image, float scale, vector<float>& rgb, thread_pool* pool = nullptr, const denoise_params& params = denoise_params())
+{
+	const int w = image.width, h = image.height, n = w * h;
+	vector<vec3> albedo(n), normal(n), color(n), next_color(n);
+	vector<float> depth(n), variance(n), next_variance(n);
+
+	// guides, and the colour divided by the albedo
+	run_parallel(pool, h, [&](int y)
+	{
+		for (int i = y * w; i < (y + 1) * w; ++i)
+		{
+			sample_features f = image.mean_features(i);
+			float l = length(f.normal);
+			albedo[i] = max(f.albedo, vec3(0.01f));
+			normal[i] = l > 0 ? f.normal / l : vec3(0);
+			depth[i] = f.depth;
+			color[i] = vec3(rgb[3 * i], rgb[3 * i + 1], rgb[3 * i + 2]) / albedo[i];
+			float a = denoise_luminance(albedo[i]);
+			variance[i] = image.variance_of_mean(i) * scale * scale / (a * a);
+		}
+	});
+
+	// With only a few samples the pixel's own variance is mostly noise
+	// itself, so take that of its neighbours' means instead.
+	run_parallel(pool, h, [&](int y)
+	{
+		for (int x = 0; x < w; ++x)
+		{
+			int p = y * w + x;
+			if (image.samples[p] >= MIN_VARIANCE_SAMPLES)
+			{
+				next_variance[p] = variance[p];
+				continue;
+			}
+			bool hit = depth[p] > 0;
+			float sum = 0, sum2 = 0;
+			int count = 0;
+			for (int qy = std::max(0, y - 2); qy <= std::min(h - 1, y + 2); ++qy)
+			{
+				for (int qx = std::max(0, x - 2); qx <= std::min(w - 1, x + 2); ++qx)
+				{
+					int q = qy * w + qx;
+					if (hit != (depth[q] > 0))
+						continue;
+					float l = denoise_luminance(color[q]);
+					sum += l;
+					sum2 += l * l;
+					count++;
+				}
+			}
+			float mean = sum / count;
+			next_variance[p] = std::max(0.f, sum2 / count - mean * mean);
+		}
+	});
+	std::swap(variance, next_variance);
+
+	const float kernel[3] = { 3 / 8.f, 1 / 4.f, 1 / 16.f };
+	const float inv_albedo2 = 1 / (params.albedo * params.albedo);
+	// 3x3 Gaussian of the variance around a pixel, steadier than its own
+	auto blurred_variance = [&](int x, int y)
+	{
+		const float gauss[2] = { 1 / 2.f, 1 / 4.f };
+		float sum = 0, weights = 0;
+		for (int qy = std::max(0, y - 1); qy <= std::min(h - 1, y + 1); ++qy)
+		{
+			for (int qx = std::max(0, x - 1); qx <= std::min(w - 1, x + 1); ++qx)
+			{
+				float g = gauss[abs(qx - x)] * gauss[abs(qy - y)];
+				sum += g * variance[qy * w + qx];
+				weights += g;
+			}
+		}
+		return sum / weights;
+	};
+
+	for (int pass = 0; pass < DENOISE_PASSES; ++pass)
+	{
+		int step = 1 << pass;
+		run_parallel(pool, h, [&](int y)
+		{
+			for (int x = 0; x < w; ++x)
+			{
+				int p = y * w + x;
+				float lp = denoise_luminance(color[p]);
+				float sigma_l = params.color * sqrt(blurred_variance(x, y)) + 1e-3f;
+				float sigma_d = params.depth * step * depth[p] + 1e-4f;
+				bool hit = depth[p] > 0;
+
+				vec3 sum = vec3(0);
+				float weights = 0, sum_variance = 0;
+				for (int dy = -2; dy <= 2; ++dy)
+				{
+					int qy = y + dy * step;
+					if (qy < 0 || qy >= h)
+						continue;
+					for (int dx = -2; dx <= 2; ++dx)
+					{
+						int qx = x + dx * step;
+						if (qx < 0 || qx >= w)
+							continue;
+						int q = qy * w + qx;
+
+						float wt = kernel[abs(dx)] * kernel[abs(dy)];
+						if (q != p)
+						{
+							if (hit != (depth[q] > 0))
+								continue;
+							// the exponents of every Gaussian-like weight, for one exp()
+							vec3 da = albedo[p] - albedo[q];
+							float e = dot(da, da) * inv_albedo2 + fabs(lp - denoise_luminance(color[q])) / sigma_l;
+							if (hit)
+							{
+								float c = std::max(0.f, dot(normal[p], normal[q]));
+								if (c <= 0)
+									continue;
+								e += fabs(depth[p] - depth[q]) / sigma_d - params.normal * log(c);
+							}
+							wt *= exp(-e);
+						}
+
+						sum += wt * color[q];
+						sum_variance += wt * wt * variance[q];
+						weights += wt;
+					}
+				}
+				next_color[p] = sum / weights;
+				next_variance[p] = sum_variance / (weights * weights);
+			}
+		});
+		std::swap(color, next_color);
+		std::swap(variance, next_variance);
+	}
+
+	run_parallel(pool, h, [&](int y)
+	{
+		for (int i = y * w; i < (y + 1) * w; ++i)
+		{
+			vec3 c = color[i] * albedo[i];
+			rgb[3 * i + 0] = c.x;
+			rgb[3 * i + 1] = c.y;
+			rgb[3 * i + 2] = c.z;
+		}
+	});
+}
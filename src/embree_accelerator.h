@@ -0,0 +1,347 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+using std::vector;
+
+#include <embree2/rtcore.h>
+#include <embree2/rtcore_ray.h>
+
+#include "accelerator.h"
+
+struct embVert
+{
+	float x, y, z, a;
+};
+struct embTriangle
+{
+	int v0, v1, v2;
+};
+
+//-----------------------------------------------------------------------------
+// Conversions
+//-----------------------------------------------------------------------------
+RTCRay make_rtc_ray(vec3 o, vec3 dir, float tfar)
+{
+	RTCRay ray;
+	ray.org[0] = o.x; ray.org[1] = o.y; ray.org[2] = o.z;
+	ray.dir[0] = dir.x; ray.dir[1] = dir.y; ray.dir[2] = dir.z;
+	ray.tnear = 0;
+	ray.tfar = tfar;
+	ray.time = 0;
+	ray.mask = 0xFFFFFFFF;
+	ray.geomID = RTC_INVALID_GEOMETRY_ID;
+	ray.primID = RTC_INVALID_GEOMETRY_ID;
+	ray.instID = RTC_INVALID_GEOMETRY_ID;
+	return ray;
+}
+void store_rtc_hit(const RTCRay& ray, ray_hit& r)
+{
+	r.tfar = ray.tfar;
+	r.geom_id = ray.geomID;
+	r.prim_id = ray.primID;
+	r.inst_id = ray.instID;
+	r.ng = vec3(ray.Ng[0], ray.Ng[1], ray.Ng[2]);
+	r.u = ray.u;
+	r.v = ray.v;
+}
+
+//-----------------------------------------------------------------------------
+// Packets
+//-----------------------------------------------------------------------------
+// Fills packet lanes from rays [base, base + N); lanes past the end of the
+// stream repeat the last ray and are masked off.
+template <int N, typename packet_t>
+void load_packet(const ray_stream& s, int base, packet_t& p, int* valid)
+{
+	for (int lane = 0; lane < N; ++lane)
+	{
+		int i = std::min(base + lane, s.size() - 1);
+		valid[lane] = base + lane < s.size() ? -1 : 0;
+		p.orgx[lane] = s.org_x[i]; p.orgy[lane] = s.org_y[i]; p.orgz[lane] = s.org_z[i];
+		p.dirx[lane] = s.dir_x[i]; p.diry[lane] = s.dir_y[i]; p.dirz[lane] = s.dir_z[i];
+		p.tnear[lane] = 0;
+		p.tfar[lane] = s.tfar[i];
+		p.time[lane] = 0;
+		p.mask[lane] = 0xFFFFFFFF;
+		p.geomID[lane] = RTC_INVALID_GEOMETRY_ID;
+		p.primID[lane] = RTC_INVALID_GEOMETRY_ID;
+		p.instID[lane] = RTC_INVALID_GEOMETRY_ID;
+	}
+}
+
+template <int N, typename packet_t>
+void trace_packets(RTCScene scene, ray_stream& s, bool occlusion,
+	void (*intersect)(const void*, RTCScene, packet_t&),
+	void (*occluded)(const void*, RTCScene, packet_t&))
+{
+	packet_t p;
+	alignas(64) int valid[N];
+
+	for (int base = 0; base < s.size(); base += N)
+	{
+		load_packet<N>(s, base, p, valid);
+
+		if (occlusion)
+			occluded(valid, scene, p);
+		else
+			intersect(valid, scene, p);
+
+		int count = std::min(N, s.size() - base);
+		for (int lane = 0; lane < count; ++lane)
+		{
+			int i = base + lane;
+			s.geom_id[i] = p.geomID[lane];
+			if (occlusion)
+				continue;
+
+			s.tfar[i] = p.tfar[lane];
+			s.prim_id[i] = p.primID[lane];
+			s.inst_id[i] = p.instID[lane];
+			s.ng_x[i] = p.Ngx[lane]; s.ng_y[i] = p.Ngy[lane]; s.ng_z[i] = p.Ngz[lane];
+			s.u[i] = p.u[lane]; s.v[i] = p.v[lane];
+		}
+	}
+}
+
+void trace_packets(RTCScene scene, ray_stream& s, bool occlusion, int width)
+{
+	if (width == 4)
+		trace_packets<4, RTCRay4>(scene, s, occlusion, rtcIntersect4, rtcOccluded4);
+	else if (width == 16)
+		trace_packets<16, RTCRay16>(scene, s, occlusion, rtcIntersect16, rtcOccluded16);
+	else
+		trace_packets<8, RTCRay8>(scene, s, occlusion, rtcIntersect8, rtcOccluded8);
+}
+
+//-----------------------------------------------------------------------------
+// Backend
+//-----------------------------------------------------------------------------
+// Batches go through the API that matches mode: packets of packet_width
+// rays, rtcIntersect1M streams, or single rays.
+struct embree_accelerator : accelerator
+{
+	RTCDevice device;
+	RTCScene scene;
+	RTCAlgorithmFlags flags;
+	trace_mode mode;
+	int packet_width;
+
+	vector<RTCScene> prototypes;
+	RTCScene target; // where meshes go: scene, or the prototype being built
+	// Embree leaves instance hits' normals in the prototype's space; these
+	// take them to world space, by instance id
+	vector<mat3> normal_to_world;
+
+	// all_queries enables every packet width and streams, for benchmarking;
+	// otherwise only what mode needs is built
+	embree_accelerator(trace_mode m, int width, bool all_queries = false)
+		: mode(m), packet_width(width)
+	{
+		int f = RTC_INTERSECT1;
+		if (mode == TRACE_PACKET || all_queries)
+			f |= packet_width == 4 ? RTC_INTERSECT4 : packet_width == 16 ? RTC_INTERSECT16 : RTC_INTERSECT8;
+		if (mode == TRACE_STREAM || all_queries)
+			f |= RTC_INTERSECT_STREAM;
+		if (all_queries)
+			f |= RTC_INTERSECT4 | RTC_INTERSECT8 | RTC_INTERSECT16;
+		flags = (RTCAlgorithmFlags)f;
+
+		device = rtcNewDevice(NULL);
+		scene = rtcDeviceNewScene(device, RTC_SCENE_STATIC, flags);
+		target = scene;
+	}
+
+	~embree_accelerator()
+	{
+		rtcDeleteScene(scene);
+		for (RTCScene p : prototypes)
+			rtcDeleteScene(p);
+		rtcDeleteDevice(device);
+	}
+
+	const char* name() const override
+	{
+		return "embree";
+	}
+
+	unsigned int add_mesh(const vector<float>& positions, const vector<unsigned int>& indices) override
+	{
+		unsigned int mesh = rtcNewTriangleMesh(target,
+			RTC_GEOMETRY_STATIC,
+			indices.size() / 3,
+			positions.size() / 3);
+
+		// setup vertex buffer
+		embVert* verts = (embVert*)rtcMapBuffer(target, mesh, RTC_VERTEX_BUFFER);
+		for (size_t v = 0; v < positions.size() / 3; ++v)
+		{
+			verts[v].x = positions[3 * v + 0];
+			verts[v].y = positions[3 * v + 1];
+			verts[v].z = positions[3 * v + 2];
+		}
+		rtcUnmapBuffer(target, mesh, RTC_VERTEX_BUFFER);
+
+		// setup index buffer
+		embTriangle* tris = (embTriangle*)rtcMapBuffer(target, mesh, RTC_INDEX_BUFFER);
+		for (size_t v = 0; v < indices.size() / 3; ++v)
+		{
+			tris[v].v0 = indices[3 * v + 0];
+			tris[v].v1 = indices[3 * v + 1];
+			tris[v].v2 = indices[3 * v + 2];
+		}
+		rtcUnmapBuffer(target, mesh, RTC_INDEX_BUFFER);
+
+		return mesh;
+	}
+
+	unsigned int add_shared_mesh(const float* vertices, size_t num_vertices, const unsigned int* indices, size_t num_triangles) override
+	{
+		unsigned int mesh = rtcNewTriangleMesh(target, RTC_GEOMETRY_STATIC, num_triangles, num_vertices);
+		rtcSetBuffer2(target, mesh, RTC_VERTEX_BUFFER, vertices, 0, sizeof(embVert), num_vertices);
+		rtcSetBuffer2(target, mesh, RTC_INDEX_BUFFER, indices, 0, sizeof(embTriangle), num_triangles);
+		return mesh;
+	}
+
+	bool traces_shared_meshes() const override
+	{
+		return true;
+	}
+
+	unsigned int begin_prototype() override
+	{
+		target = rtcDeviceNewScene(device, RTC_SCENE_STATIC, flags);
+		prototypes.push_back(target);
+		return (unsigned int)prototypes.size() - 1;
+	}
+
+	void end_prototype() override
+	{
+		target = scene;
+	}
+
+	unsigned int add_instance(unsigned int prototype, const mat4& transform) override
+	{
+		unsigned int instance = rtcNewInstance2(scene, prototypes[prototype], 1);
+		rtcSetTransform2(scene, instance, RTC_MATRIX_COLUMN_MAJOR_ALIGNED16, &transform[0][0]);
+		if (instance >= normal_to_world.size())
+			normal_to_world.resize(instance + 1);
+		normal_to_world[instance] = transpose(inverse(mat3(vec3(transform[0]), vec3(transform[1]), vec3(transform[2]))));
+		return instance;
+	}
+
+	void commit() override
+	{
+		// instanced scenes have to be built before the scenes they're in
+		for (RTCScene p : prototypes)
+			rtcCommit(p);
+		rtcCommit(scene);
+	}
+
+	void scene_bounds(vec3& lo, vec3& hi) override
+	{
+		RTCBounds b;
+		rtcGetBounds(scene, b);
+		lo = vec3(b.lower_x, b.lower_y, b.lower_z);
+		hi = vec3(b.upper_x, b.upper_y, b.upper_z);
+	}
+
+	void intersect1(ray_hit& r) override
+	{
+		RTCRay ray = make_rtc_ray(r.org, r.dir, r.tfar);
+		rtcIntersect(scene, ray);
+		store_rtc_hit(ray, r);
+		if (r.inst_id != INVALID_GEOMETRY_ID)
+			r.ng = normal_to_world[r.inst_id] * r.ng;
+	}
+
+	void occluded1(ray_hit& r) override
+	{
+		RTCRay ray = make_rtc_ray(r.org, r.dir, r.tfar);
+		rtcOccluded(scene, ray);
+		r.geom_id = ray.geomID;
+	}
+
+	void trace(ray_stream& s, bool occlusion, bool coherent)
+	{
+		if (s.size() == 0)
+			return;
+
+		if (mode == TRACE_PACKET)
+		{
+			trace_packets(scene, s, occlusion, packet_width);
+			if (!occlusion)
+				instance_normals_to_world(s);
+			return;
+		}
+
+		thread_local vector<RTCRay> rays;
+		rays.resize(s.size());
+		for (int i = 0; i < s.size(); ++i)
+			rays[i] = make_rtc_ray(s.org(i), s.dir(i), s.tfar[i]);
+
+		if (mode == TRACE_STREAM)
+		{
+			RTCIntersectContext context;
+			context.flags = coherent ? RTC_INTERSECT_COHERENT : RTC_INTERSECT_INCOHERENT;
+			context.userRayExt = nullptr;
+			if (occlusion)
+				rtcOccluded1M(scene, &context, rays.data(), rays.size(), sizeof(RTCRay));
+			else
+				rtcIntersect1M(scene, &context, rays.data(), rays.size(), sizeof(RTCRay));
+		}
+		else
+		{
+			for (RTCRay& ray : rays)
+			{
+				if (occlusion)
+					rtcOccluded(scene, ray);
+				else
+					rtcIntersect(scene, ray);
+			}
+		}
+
+		for (int i = 0; i < s.size(); ++i)
+		{
+			if (occlusion)
+			{
+				s.geom_id[i] = rays[i].geomID;
+				continue;
+			}
+
+			ray_hit r;
+			store_rtc_hit(rays[i], r);
+			s.store(i, r);
+		}
+		if (!occlusion)
+			instance_normals_to_world(s);
+	}
+
+	void instance_normals_to_world(ray_stream& s)
+	{
+		if (normal_to_world.empty())
+			return;
+		for (int i = 0; i < s.size(); ++i)
+		{
+			if (s.geom_id[i] == INVALID_GEOMETRY_ID || s.inst_id[i] == INVALID_GEOMETRY_ID)
+				continue;
+			vec3 ng = normal_to_world[s.inst_id[i]] * s.ng(i);
+			s.ng_x[i] = ng.x; s.ng_y[i] = ng.y; s.ng_z[i] = ng.z;
+		}
+	}
+
+	void intersect_stream(ray_stream& rays, bool coherent) override
+	{
+		trace(rays, false, coherent);
+	}
+
+	void occluded_stream(ray_stream& rays, bool coherent) override
+	{
+		trace(rays, true, coherent);
+	}
+
+	bool query_failed() override
+	{
+		return rtcDeviceGetError(device) != RTC_NO_ERROR;
+	}
+};
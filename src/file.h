@@ -0,0 +1,165 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <string>
+using std::string;
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// Moves tmp over filename. Write a file next to its final name and replace
+// it with this, so a crash mid-write never leaves a half written file.
+bool replace_file(const string& tmp, const string& filename)
+{
+#ifdef _WIN32
+	remove(filename.c_str()); // rename doesn't replace files there
+#endif
+	if (rename(tmp.c_str(), filename.c_str()) != 0)
+	{
+		printf("Can't replace %s\n", filename.c_str());
+		remove(tmp.c_str());
+		return false;
+	}
+	return true;
+}
+
+// size bytes in one write, through a temporary file and replace_file()
+bool write_whole_file(const string& filename, const void* data, size_t size)
+{
+	string tmp = filename + ".tmp";
+	FILE* f = fopen(tmp.c_str(), "wb");
+	if (!f)
+	{
+		printf("Can't write %s\n", tmp.c_str());
+		return false;
+	}
+	bool ok = fwrite(data, 1, size, f) == size;
+	ok = fclose(f) == 0 && ok;
+	if (!ok)
+	{
+		printf("Failed writing %s\n", tmp.c_str());
+		remove(tmp.c_str());
+		return false;
+	}
+	return replace_file(tmp, filename);
+}
+
+// size and modification time, to tell whether a file changed since
+bool file_stamp(const string& filename, uint64_t& size, int64_t& mtime)
+{
+	struct stat st;
+	if (stat(filename.c_str(), &st) != 0)
+		return false;
+	size = (uint64_t)st.st_size;
+	mtime = (int64_t)st.st_mtime;
+	return true;
+}
+
+// A whole file mapped read-only into memory.
+struct mapped_file
+{
+	const char* data = nullptr;
+	size_t size = 0;
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = NULL;
+#endif
+
+	mapped_file() {}
+	mapped_file(const mapped_file&) = delete;
+	mapped_file& operator=(const mapped_file&) = delete;
+	~mapped_file() { close(); }
+
+	bool open(const string& filename)
+	{
+		close();
+#ifdef _WIN32
+		file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+		LARGE_INTEGER file_size;
+		if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0)
+		{
+			close();
+			return false;
+		}
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping)
+			data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		if (!data)
+		{
+			close();
+			return false;
+		}
+		size = (size_t)file_size.QuadPart;
+#else
+		int fd = ::open(filename.c_str(), O_RDONLY);
+		if (fd < 0)
+			return false;
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size == 0)
+		{
+			::close(fd);
+			return false;
+		}
+		void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd); // the mapping keeps the file alive
+		if (p == MAP_FAILED)
+			return false;
+		data = (const char*)p;
+		size = st.st_size;
+#endif
+		return true;
+	}
+
+	// Lets the pages wholly inside [begin, end) go from memory once they've
+	// been read; they come back from the file if they're read again.
+	void release(const char* begin, const char* end)
+	{
+#ifdef _WIN32
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		size_t page = info.dwPageSize;
+#else
+		size_t page = (size_t)sysconf(_SC_PAGESIZE);
+#endif
+		uintptr_t lo = ((uintptr_t)begin + page - 1) & ~(uintptr_t)(page - 1);
+		uintptr_t hi = (uintptr_t)end & ~(uintptr_t)(page - 1);
+		if (hi <= lo)
+			return;
+#ifdef _WIN32
+		// which is what unlocking pages that aren't locked does
+		VirtualUnlock((void*)lo, hi - lo);
+#else
+		madvise((void*)lo, hi - lo, MADV_DONTNEED);
+#endif
+	}
+
+	void close()
+	{
+#ifdef _WIN32
+		if (data)
+			UnmapViewOfFile(data);
+		if (mapping)
+			CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE)
+			CloseHandle(file);
+		mapping = NULL;
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (data)
+			munmap((void*)data, size);
+#endif
+		data = nullptr;
+		size = 0;
+	}
+};
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <math.h>
+#include <algorithm>
+#include <vector>
+using std::vector;
+
+#include <glm/glm.hpp>
+using namespace glm;
+
+// What a camera ray hit first, for the denoiser: the surface's albedo, its
+// normal facing the camera, and how far away it is. All zero for a miss.
+struct sample_features
+{
+	vec3 albedo = vec3(0);
+	vec3 normal = vec3(0);
+	float depth = 0;
+};
+
+// XYZ accumulation buffer, stored row by row. Keeps the sum of the samples
+// and how many there were for every pixel, so a render can be stopped,
+// saved and continued at any time. The sample_features are summed the same
+// way, as albedo, normal and depth buffers.
+struct film
+{
+	int width;
+	int height;
+	vector<vec3> xyz;
+	vector<float> y2; // sum of squared luminance (Y), for the noise estimate
+	vector<unsigned> samples;
+	vector<vec3> albedo;
+	vector<vec3> normal;
+	vector<float> depth;
+
+	film(int w, int h) : width(w), height(h), xyz(w * h), y2(w * h), samples(w * h), albedo(w * h), normal(w * h), depth(w * h) {}
+
+	void add(int x, int y, vec3 value, const sample_features& f)
+	{
+		int i = y * width + x;
+		xyz[i] += value;
+		y2[i] += value.y * value.y;
+		samples[i]++;
+		albedo[i] += f.albedo;
+		normal[i] += f.normal;
+		depth[i] += f.depth;
+	}
+
+	// adds the samples of another film of the same size
+	void merge(const film& f)
+	{
+		for (int i = 0; i < width * height; ++i)
+		{
+			xyz[i] += f.xyz[i];
+			y2[i] += f.y2[i];
+			samples[i] += f.samples[i];
+			albedo[i] += f.albedo[i];
+			normal[i] += f.normal[i];
+			depth[i] += f.depth[i];
+		}
+	}
+
+	unsigned sample_count(int x, int y) const
+	{
+		return samples[y * width + x];
+	}
+
+	vec3 mean(int x, int y) const
+	{
+		int i = y * width + x;
+		return samples[i] > 0 ? xyz[i] / (float)samples[i] : vec3(0);
+	}
+
+	// averaged over the pixel, so the normal isn't quite unit length
+	sample_features mean_features(int i) const
+	{
+		sample_features f;
+		if (samples[i] > 0)
+		{
+			float scale = 1.f / samples[i];
+			f.albedo = albedo[i] * scale;
+			f.normal = normal[i] * scale;
+			f.depth = depth[i] * scale;
+		}
+		return f;
+	}
+
+	// of pixel i's mean luminance (Y)
+	float variance_of_mean(int i) const
+	{
+		float n = (float)samples[i];
+		if (n < 2)
+			return 0;
+		float m = xyz[i].y / n;
+		return std::max(0.f, (y2[i] / n - m * m) / (n - 1));
+	}
+
+	// Standard error of pixel i's luminance after tonemapping with
+	// x / (x + 1), whose slope at the mean scales the error down.
+	float pixel_error(int i) const
+	{
+		float n = (float)samples[i];
+		if (n < 2)
+			return 1;
+		float m = xyz[i].y / n;
+		float variance = std::max(0.f, (y2[i] / n - m * m) * n / (n - 1));
+		float slope = 1 / ((1 + m) * (1 + m));
+		return sqrt(variance / n) * slope;
+	}
+
+	// average pixel_error() over the pixels with samples, so pixels another
+	// process renders (--tiles) don't count, and 1 if there are none
+	float noise() const
+	{
+		double sum = 0;
+		int count = 0;
+		for (int i = 0; i < width * height; ++i)
+		{
+			if (samples[i] == 0)
+				continue;
+			sum += pixel_error(i);
+			count++;
+		}
+		return count > 0 ? (float)(sum / count) : 1.f;
+	}
+};
+
+// A screen-space block of pixels, [x0, x1) x [y0, y1). Tiles never overlap, so
+// whichever thread renders a tile owns those pixels of the film for the pass.
+struct tile
+{
+	int x0, y0;
+	int x1, y1;
+};
+
+vector<tile> make_tiles(int width, int height, int tile_size)
+{
+	vector<tile> tiles;
+	for (int y = 0; y < height; y += tile_size)
+	{
+		for (int x = 0; x < width; x += tile_size)
+		{
+			tile t;
+			t.x0 = x;
+			t.y0 = y;
+			t.x1 = std::min(x + tile_size, width);
+			t.y1 = std::min(y + tile_size, height);
+			tiles.push_back(t);
+		}
+	}
+	return tiles;
+}
+
+// average pixel_error() over the tile, what adaptive sampling compares against
+// its target. Averaging keeps a lone firefly from holding a whole tile back.
+float tile_error(const film& image, const tile& t)
+{
+	double sum = 0;
+	for (int y = t.y0; y < t.y1; ++y)
+		for (int x = t.x0; x < t.x1; ++x)
+			sum += image.pixel_error(y * image.width + x);
+	return (float)(sum / ((t.x1 - t.x0) * (t.y1 - t.y0)));
+}
@@ -0,0 +1,397 @@
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <vector>
+using std::vector;
+
+#include <glm/glm.hpp>
+using namespace glm;
+
+// Path guiding, after Müller, Gross and Novák, "Practical Path Guiding for
+// Efficient Light-Transport Simulation" (2017). An SD-tree learns how much
+// light arrives at each part of the scene from each direction: a binary tree
+// splits space, and each of its leaves has a quadtree over the sphere of
+// directions. Camera paths then bounce towards where light came from half the
+// time, and by the BRDF the other half.
+//
+// It learns over passes of 1, 2, 4, ... rounds of the render. During a pass
+// paths sample from what the previous passes learned and record into a copy
+// of it, lock-free with atomic adds. Between passes leaves that got many
+// samples split, the quadtrees are refined where they saw the most light, and
+// the copy becomes what's sampled.
+
+const float GUIDE_FRACTION = 0.5f;          // of bounces sampled by the guide where it has learned anything
+const float GUIDE_SPATIAL_THRESHOLD = 4000; // samples a leaf may get in a one round pass, times sqrt(rounds), before it splits
+const float GUIDE_DIRECTIONAL_THRESHOLD = 0.01f; // of a leaf's energy that makes a quadrant split
+const int GUIDE_MAX_DEPTH = 20;             // of the quadtrees
+
+inline void atomic_add(std::atomic<float>& a, float value)
+{
+	float old = a.load(std::memory_order_relaxed);
+	while (!a.compare_exchange_weak(old, old + value, std::memory_order_relaxed))
+		;
+}
+
+//-----------------------------------------------------------------------------
+// Directions
+//-----------------------------------------------------------------------------
+// The sphere as a unit square by cos(theta) and phi, which keeps areas, so a
+// density over the square is 4 pi times that over directions.
+inline vec2 direction_to_square(vec3 d)
+{
+	float cos_theta = std::min(1.f, std::max(-1.f, d.z));
+	float phi = atan2(d.y, d.x);
+	if (phi < 0)
+		phi += 2 * 3.14159265f;
+	return vec2((cos_theta + 1) / 2, std::min(phi / (2 * 3.14159265f), 0.99999994f));
+}
+
+inline vec3 square_to_direction(vec2 p)
+{
+	float cos_theta = 2 * p.x - 1;
+	float sin_theta = sqrt(std::max(0.f, 1 - cos_theta * cos_theta));
+	float phi = 2 * 3.14159265f * p.y;
+	return vec3(sin_theta * cos(phi), sin_theta * sin(phi), cos_theta);
+}
+
+//-----------------------------------------------------------------------------
+// Directional quadtree
+//-----------------------------------------------------------------------------
+// Quadrant c of a node covers x from (c & 1) / 2 and y from (c >> 1) / 2.
+struct guide_quad_node
+{
+	std::atomic<float> sum[4]; // recorded in each quadrant
+	uint32_t child[4];         // node index, 0 if the quadrant is a leaf
+
+	guide_quad_node()
+	{
+		for (int c = 0; c < 4; ++c)
+		{
+			sum[c].store(0, std::memory_order_relaxed);
+			child[c] = 0;
+		}
+	}
+	guide_quad_node(const guide_quad_node& n)
+	{
+		*this = n;
+	}
+	guide_quad_node& operator=(const guide_quad_node& n)
+	{
+		for (int c = 0; c < 4; ++c)
+		{
+			sum[c].store(n.sum[c].load(std::memory_order_relaxed), std::memory_order_relaxed);
+			child[c] = n.child[c];
+		}
+		return *this;
+	}
+
+	float total() const
+	{
+		return sum[0].load(std::memory_order_relaxed) + sum[1].load(std::memory_order_relaxed) +
+			sum[2].load(std::memory_order_relaxed) + sum[3].load(std::memory_order_relaxed);
+	}
+
+	// the quadrant p is in, and p moved into its square
+	static int quadrant(vec2& p)
+	{
+		int c = (p.x >= 0.5f ? 1 : 0) | (p.y >= 0.5f ? 2 : 0);
+		p.x = std::min(p.x * 2 - (c & 1), 0.99999994f);
+		p.y = std::min(p.y * 2 - (c >> 1), 0.99999994f);
+		return c;
+	}
+};
+
+struct guide_dtree
+{
+	vector<guide_quad_node> nodes = vector<guide_quad_node>(1);
+
+	float total() const
+	{
+		return nodes[0].total();
+	}
+
+	void record(vec2 p, float value)
+	{
+		uint32_t n = 0;
+		while (true)
+		{
+			int c = guide_quad_node::quadrant(p);
+			atomic_add(nodes[n].sum[c], value);
+			if (nodes[n].child[c] == 0)
+				return;
+			n = nodes[n].child[c];
+		}
+	}
+
+	// density over the unit square
+	float pdf(vec2 p) const
+	{
+		float pdf = 1;
+		uint32_t n = 0;
+		while (true)
+		{
+			float total = nodes[n].total();
+			if (total <= 0)
+				return pdf;
+			int c = guide_quad_node::quadrant(p);
+			pdf *= 4 * nodes[n].sum[c].load(std::memory_order_relaxed) / total;
+			if (nodes[n].child[c] == 0 || pdf == 0)
+				return pdf;
+			n = nodes[n].child[c];
+		}
+	}
+
+	// Warps u through the tree one level at a time: the left or right half by
+	// u.x, then the bottom or top by u.y, each rescaled for the next level.
+	vec2 sample(vec2 u) const
+	{
+		vec2 origin(0, 0);
+		float size = 1;
+		uint32_t n = 0;
+		while (true)
+		{
+			const guide_quad_node& node = nodes[n];
+			float s[4];
+			for (int c = 0; c < 4; ++c)
+				s[c] = node.sum[c].load(std::memory_order_relaxed);
+			float total = s[0] + s[1] + s[2] + s[3];
+			if (total <= 0)
+				return origin + u * size;
+
+			int c = 0;
+			float left = (s[0] + s[2]) / total;
+			if (u.x < left)
+				u.x /= left;
+			else
+			{
+				u.x = (u.x - left) / (1 - left);
+				c |= 1;
+			}
+			float bottom = s[c] / (s[c] + s[c | 2]);
+			if (u.y < bottom)
+				u.y /= bottom;
+			else
+			{
+				u.y = (u.y - bottom) / (1 - bottom);
+				c |= 2;
+			}
+			u.x = std::min(u.x, 0.99999994f);
+			u.y = std::min(u.y, 0.99999994f);
+
+			size /= 2;
+			origin = origin + vec2((float)(c & 1), (float)(c >> 1)) * size;
+			if (node.child[c] == 0)
+				return origin + u * size;
+			n = node.child[c];
+		}
+	}
+
+	// The tree to record the next pass into: every quadrant of the recorded
+	// tree with more than threshold of its energy is split, up to max_depth,
+	// and every sum starts at zero.
+	void refine_from(const guide_dtree& recorded, float threshold, int max_depth)
+	{
+		struct entry
+		{
+			uint32_t node, recorded; // recorded is 0 past the recorded tree's leaves
+			float energy;
+			int depth;
+		};
+
+		nodes.assign(1, guide_quad_node());
+		float total = recorded.total();
+		if (total <= 0)
+			return;
+
+		vector<entry> stack;
+		stack.push_back({ 0, 0, total, 1 });
+		while (!stack.empty())
+		{
+			entry e = stack.back();
+			stack.pop_back();
+			for (int c = 0; c < 4; ++c)
+			{
+				float energy = e.energy / 4;
+				uint32_t child = 0;
+				if (e.recorded != 0 || e.node == 0)
+				{
+					const guide_quad_node& r = recorded.nodes[e.recorded];
+					energy = r.sum[c].load(std::memory_order_relaxed);
+					child = r.child[c];
+				}
+				if (e.depth >= max_depth || energy <= threshold * total)
+					continue;
+
+				uint32_t index = (uint32_t)nodes.size();
+				nodes.push_back(guide_quad_node());
+				nodes[e.node].child[c] = index;
+				stack.push_back({ index, child, energy, e.depth + 1 });
+			}
+		}
+	}
+};
+
+//-----------------------------------------------------------------------------
+// Spatial tree
+//-----------------------------------------------------------------------------
+struct guide_leaf
+{
+	guide_dtree sampling; // what the last passes learned
+	guide_dtree building; // this pass's records
+	std::atomic<uint32_t> samples;
+
+	guide_leaf() : samples(0) {}
+	guide_leaf(const guide_leaf& l) : sampling(l.sampling), building(l.building), samples(l.samples.load()) {}
+	guide_leaf& operator=(const guide_leaf& l)
+	{
+		sampling = l.sampling;
+		building = l.building;
+		samples.store(l.samples.load());
+		return *this;
+	}
+};
+
+// Halves of the box alternate between x, y and z with depth; child and the
+// node after it are the lower and upper half.
+struct guide_spatial_node
+{
+	uint32_t child; // 0 for a leaf
+	uint32_t leaf;
+};
+
+struct path_guide
+{
+	vec3 lo = vec3(0);
+	float size = 1; // a cube, so splits stay even
+	vector<guide_spatial_node> nodes;
+	vector<guide_leaf> leaves;
+
+	bool learning = false;
+	int pass_rounds = 1; // length of the current pass
+	int rounds = 0;      // of the current pass so far
+	int passes = 0;
+
+	void init(vec3 bounds_lo, vec3 bounds_hi)
+	{
+		vec3 extent = glm::max(bounds_hi - bounds_lo, vec3(0));
+		size = std::max(extent.x, std::max(extent.y, extent.z)) * 1.01f + 1e-4f;
+		lo = (bounds_lo + bounds_hi) * 0.5f - vec3(size / 2);
+		nodes.assign(1, { 0, 0 });
+		leaves.assign(1, guide_leaf());
+		learning = true;
+		pass_rounds = 1;
+		rounds = 0;
+		passes = 0;
+	}
+
+	uint32_t leaf_index(vec3 p) const
+	{
+		vec3 q = (p - lo) / size;
+		uint32_t n = 0;
+		int axis = 0;
+		while (nodes[n].child != 0)
+		{
+			float& x = q[axis];
+			if (x < 0.5f)
+			{
+				x *= 2;
+				n = nodes[n].child;
+			}
+			else
+			{
+				x = x * 2 - 1;
+				n = nodes[n].child + 1;
+			}
+			axis = (axis + 1) % 3;
+		}
+		return nodes[n].leaf;
+	}
+
+	// what to sample at p, or null if nothing's known there yet
+	const guide_dtree* distribution(vec3 p) const
+	{
+		if (leaves.empty())
+			return nullptr;
+		const guide_dtree& d = leaves[leaf_index(p)].sampling;
+		return d.total() > 0 ? &d : nullptr;
+	}
+
+	// value is the light that came into p from direction dir, over the pdf
+	// dir was sampled with
+	void record(vec3 p, vec3 dir, float value)
+	{
+		guide_leaf& leaf = leaves[leaf_index(p)];
+		leaf.samples.fetch_add(1, std::memory_order_relaxed);
+		if (value > 0 && std::isfinite(value))
+			leaf.building.record(direction_to_square(dir), value);
+	}
+
+	// Call after every round of the render. Learning stops after the last
+	// pass that fits in training_rounds. Returns true when the guide changed.
+	bool end_round(int training_rounds)
+	{
+		if (!learning || ++rounds < pass_rounds)
+			return false;
+
+		refine(pass_rounds);
+		passes++;
+		int learned = pass_rounds * 2 - 1;
+		rounds = 0;
+		pass_rounds *= 2;
+		learning = learned + pass_rounds <= training_rounds;
+		return true;
+	}
+
+	void refine(int rounds_in_pass)
+	{
+		// split the leaves that got more samples than they can resolve
+		uint32_t threshold = (uint32_t)(GUIDE_SPATIAL_THRESHOLD * sqrt((float)rounds_in_pass));
+		vector<uint32_t> stack(1, 0);
+		while (!stack.empty())
+		{
+			uint32_t n = stack.back();
+			stack.pop_back();
+			if (nodes[n].child != 0)
+			{
+				stack.push_back(nodes[n].child);
+				stack.push_back(nodes[n].child + 1);
+				continue;
+			}
+
+			guide_leaf& leaf = leaves[nodes[n].leaf];
+			uint32_t samples = leaf.samples.load();
+			if (samples <= threshold)
+				continue;
+
+			// both halves start from the leaf's records, each with half its samples
+			leaf.samples.store(samples / 2);
+			uint32_t first = (uint32_t)nodes.size();
+			uint32_t other_leaf = (uint32_t)leaves.size();
+			leaves.push_back(leaves[nodes[n].leaf]);
+			nodes.push_back({ 0, nodes[n].leaf });
+			nodes.push_back({ 0, other_leaf });
+			nodes[n].child = first;
+			stack.push_back(first);
+			stack.push_back(first + 1);
+		}
+
+		for (guide_leaf& leaf : leaves)
+		{
+			std::swap(leaf.sampling, leaf.building);
+			leaf.building.refine_from(leaf.sampling, GUIDE_DIRECTIONAL_THRESHOLD, GUIDE_MAX_DEPTH);
+			leaf.samples.store(0);
+		}
+	}
+
+	size_t quadtree_nodes() const
+	{
+		size_t n = 0;
+		for (const guide_leaf& leaf : leaves)
+			n += leaf.sampling.nodes.size();
+		return n;
+	}
+};
+path_guide guide;
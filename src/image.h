@@ -0,0 +1,533 @@
+#pragma once
+
+#include <ctype.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+using std::string;
+using std::vector;
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define POST_SSE 1
+#endif
+
+#include "denoise.h"
+#include "file.h"
+#include "film.h"
+#include "thread_pool.h"
+
+// From the film to pictures: XYZ to linear sRGB, exposure, optionally the
+// denoiser, a tonemapper and sRGB encoding, four pixels at a time and in
+// blocks of rows on the thread pool. The linear image is kept for HDR output. Files are put
+// together in memory and written in one go.
+
+//-----------------------------------------------------------------------------
+// SIMD
+//-----------------------------------------------------------------------------
+// One float per pixel of four
+struct float4
+{
+#ifdef POST_SSE
+	__m128 v;
+
+	float4(__m128 v) : v(v) {}
+	float4(float f) : v(_mm_set1_ps(f)) {}
+	static float4 load(const float* p) { return _mm_loadu_ps(p); }
+	void store(float* p) const { _mm_storeu_ps(p, v); }
+
+	friend float4 operator+(float4 a, float4 b) { return _mm_add_ps(a.v, b.v); }
+	friend float4 operator-(float4 a, float4 b) { return _mm_sub_ps(a.v, b.v); }
+	friend float4 operator*(float4 a, float4 b) { return _mm_mul_ps(a.v, b.v); }
+	friend float4 operator/(float4 a, float4 b) { return _mm_div_ps(a.v, b.v); }
+	friend float4 vmin(float4 a, float4 b) { return _mm_min_ps(a.v, b.v); }
+	// b where a is NaN
+	friend float4 vmax(float4 a, float4 b) { return _mm_max_ps(a.v, b.v); }
+#else
+	float f[4];
+
+	float4(float x) { f[0] = f[1] = f[2] = f[3] = x; }
+	static float4 load(const float* p) { float4 r(0.f); memcpy(r.f, p, sizeof(r.f)); return r; }
+	void store(float* p) const { memcpy(p, f, sizeof(f)); }
+
+	template<class op> friend float4 apply(float4 a, float4 b, op o)
+	{
+		for (int i = 0; i < 4; ++i)
+			a.f[i] = o(a.f[i], b.f[i]);
+		return a;
+	}
+	friend float4 operator+(float4 a, float4 b) { return apply(a, b, [](float x, float y) { return x + y; }); }
+	friend float4 operator-(float4 a, float4 b) { return apply(a, b, [](float x, float y) { return x - y; }); }
+	friend float4 operator*(float4 a, float4 b) { return apply(a, b, [](float x, float y) { return x * y; }); }
+	friend float4 operator/(float4 a, float4 b) { return apply(a, b, [](float x, float y) { return x / y; }); }
+	friend float4 vmin(float4 a, float4 b) { return apply(a, b, [](float x, float y) { return x < y ? x : y; }); }
+	friend float4 vmax(float4 a, float4 b) { return apply(a, b, [](float x, float y) { return x > y ? x : y; }); }
+#endif
+};
+
+//-----------------------------------------------------------------------------
+// Post-process
+//-----------------------------------------------------------------------------
+enum tonemap_type
+{
+	TONEMAP_REINHARD, // x / (x + 1)
+	TONEMAP_ACES,     // Narkowicz's fit of the ACES film curve
+	TONEMAP_FILMIC,   // Hable's Uncharted 2 curve
+};
+
+struct post_settings
+{
+	float exposure = 0; // stops
+	tonemap_type tonemap = TONEMAP_ACES;
+	bool srgb = true; // encode for display; off stores the tonemapped values as they are
+	bool denoise = false;
+};
+
+// A developed film, row by row from y = 0 like the film
+struct developed_image
+{
+	int width = 0;
+	int height = 0;
+	vector<float> hdr;       // linear sRGB after exposure (and denoising), 3 floats per pixel
+	vector<uint8_t> display; // tonemapped and encoded, 3 bytes per pixel
+};
+
+float4 hable(float4 x)
+{
+	const float A = 0.15f, B = 0.50f, C = 0.10f, D = 0.20f, E = 0.02f, F = 0.30f;
+	return (x * (A * x + C * B) + D * E) / (x * (A * x + B) + D * F) - E / F;
+}
+
+// to [0, 1], and NaN to 0
+float4 tonemap_channel(tonemap_type type, float4 c)
+{
+	switch (type)
+	{
+	case TONEMAP_REINHARD:
+		c = c / (c + 1.f);
+		break;
+	case TONEMAP_ACES:
+		c = c * (2.51f * c + 0.03f) / (c * (2.43f * c + 0.59f) + 0.14f);
+		break;
+	case TONEMAP_FILMIC:
+	{
+		const float white = 11.2f;
+		float4 w = hable(white);
+		c = hable(2.f * c) / w;
+		break;
+	}
+	}
+	return vmin(vmax(c, 0.f), 1.f);
+}
+
+// [0, 1] to bytes, fine enough that every step of the sRGB curve shows
+const int ENCODE_STEPS = 1 << 14;
+
+const uint8_t* encode_table(bool srgb)
+{
+	struct tables
+	{
+		uint8_t linear[ENCODE_STEPS + 1];
+		uint8_t srgb[ENCODE_STEPS + 1];
+
+		tables()
+		{
+			for (int i = 0; i <= ENCODE_STEPS; ++i)
+			{
+				float v = (float)i / ENCODE_STEPS;
+				float s = v <= 0.0031308f ? 12.92f * v : 1.055f * powf(v, 1 / 2.4f) - 0.055f;
+				linear[i] = (uint8_t)(v * 255 + 0.5f);
+				this->srgb[i] = (uint8_t)(s * 255 + 0.5f);
+			}
+		}
+	};
+	static const tables t;
+	return srgb ? t.srgb : t.linear;
+}
+
+// pixels [begin, end) of the film to out.hdr
+void develop_linear(const film& image, const post_settings& s, int begin, int end, developed_image& out)
+{
+	const float scale = exp2f(s.exposure);
+
+	for (int i = begin; i < end; i += 4)
+	{
+		int n = std::min(4, end - i);
+		float x[4] = {}, y[4] = {}, z[4] = {}, inv[4] = {};
+		for (int k = 0; k < n; ++k)
+		{
+			const vec3& sum = image.xyz[i + k];
+			x[k] = sum.x;
+			y[k] = sum.y;
+			z[k] = sum.z;
+			unsigned count = image.samples[i + k];
+			inv[k] = count > 0 ? 1.f / count : 0.f;
+		}
+		float4 X = float4::load(x) * float4::load(inv);
+		float4 Y = float4::load(y) * float4::load(inv);
+		float4 Z = float4::load(z) * float4::load(inv);
+
+		// xyz_to_rgb(), then exposure
+		float4 r = 3.2406f * X - 1.5372f * Y - 0.4986f * Z;
+		float4 g = -0.9689f * X + 1.8758f * Y + 0.0415f * Z;
+		float4 b = 0.0557f * X - 0.2040f * Y + 1.0570f * Z;
+		float4 out_of_gamut = vmin(vmin(vmin(r, g), b), 0.f);
+
+		float linear[3][4];
+		((r - out_of_gamut) * scale).store(linear[0]);
+		((g - out_of_gamut) * scale).store(linear[1]);
+		((b - out_of_gamut) * scale).store(linear[2]);
+		for (int k = 0; k < n; ++k)
+			for (int c = 0; c < 3; ++c)
+				out.hdr[3 * (i + k) + c] = linear[c][k];
+	}
+}
+
+// pixels [begin, end) of out.hdr to out.display
+void develop_display(const post_settings& s, int begin, int end, developed_image& out)
+{
+	const uint8_t* encode = encode_table(s.srgb);
+
+	for (int i = begin; i < end; i += 4)
+	{
+		int n = std::min(4, end - i);
+		float linear[3][4] = {};
+		for (int k = 0; k < n; ++k)
+			for (int c = 0; c < 3; ++c)
+				linear[c][k] = out.hdr[3 * (i + k) + c];
+
+		float mapped[3][4];
+		for (int c = 0; c < 3; ++c)
+			(tonemap_channel(s.tonemap, float4::load(linear[c])) * (float)ENCODE_STEPS + 0.5f).store(mapped[c]);
+		for (int k = 0; k < n; ++k)
+			for (int c = 0; c < 3; ++c)
+				out.display[3 * (i + k) + c] = encode[(int)mapped[c][k]];
+	}
+}
+
+// On the pool if there is one, on this thread if not.
+void develop(const film& image, const post_settings& s, developed_image& out, thread_pool* pool = nullptr)
+{
+	const int ROWS = 8;
+	out.width = image.width;
+	out.height = image.height;
+	out.hdr.resize(3 * image.width * image.height);
+	out.display.resize(3 * image.width * image.height);
+
+	int pixels = image.width * image.height, block = ROWS * image.width;
+	int blocks = (pixels + block - 1) / block;
+	run_parallel(pool, blocks, [&](int i)
+	{
+		develop_linear(image, s, i * block, std::min(pixels, (i + 1) * block), out);
+	});
+	if (s.denoise)
+		denoise(image, exp2f(s.exposure), out.hdr, pool);
+	run_parallel(pool, blocks, [&](int i)
+	{
+		develop_display(s, i * block, std::min(pixels, (i + 1) * block), out);
+	});
+}
+
+//-----------------------------------------------------------------------------
+// File formats
+//-----------------------------------------------------------------------------
+struct byte_writer
+{
+	vector<uint8_t> bytes;
+
+	void raw(const void* p, size_t n)
+	{
+		const uint8_t* b = (const uint8_t*)p;
+		bytes.insert(bytes.end(), b, b + n);
+	}
+	void text(const string& s) { raw(s.data(), s.size()); }
+	void cstr(const char* s) { raw(s, strlen(s) + 1); }
+	void u8(uint8_t v) { bytes.push_back(v); }
+	void le32(uint32_t v) { for (int i = 0; i < 4; ++i) u8((uint8_t)(v >> (8 * i))); }
+	void le64(uint64_t v) { for (int i = 0; i < 8; ++i) u8((uint8_t)(v >> (8 * i))); }
+	void be32(uint32_t v) { for (int i = 3; i >= 0; --i) u8((uint8_t)(v >> (8 * i))); }
+	void f32(float v) { uint32_t u; memcpy(&u, &v, 4); le32(u); }
+};
+
+bool has_extension(const string& filename, const char* ext)
+{
+	size_t n = strlen(ext);
+	if (filename.size() < n)
+		return false;
+	for (size_t i = 0; i < n; ++i)
+		if (tolower(filename[filename.size() - n + i]) != ext[i])
+			return false;
+	return true;
+}
+
+// binary PPM, top row first
+vector<uint8_t> encode_ppm(const developed_image& img)
+{
+	byte_writer w;
+	w.text("P6 " + std::to_string(img.width) + " " + std::to_string(img.height) + " 255\n");
+	for (int y = img.height - 1; y >= 0; --y)
+		w.raw(&img.display[3 * y * img.width], 3 * img.width);
+	return w.bytes;
+}
+
+uint32_t crc32(const uint8_t* p, size_t n, uint32_t crc = 0)
+{
+	static uint32_t table[256];
+	static bool made = [] {
+		for (uint32_t i = 0; i < 256; ++i)
+		{
+			uint32_t c = i;
+			for (int k = 0; k < 8; ++k)
+				c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+		return true;
+	}();
+	(void)made;
+
+	crc = ~crc;
+	for (size_t i = 0; i < n; ++i)
+		crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+// 8 bit RGB PNG. With no zlib around the image data goes in stored
+// (uncompressed) deflate blocks, which any PNG reader takes.
+vector<uint8_t> encode_png(const developed_image& img)
+{
+	// scanlines top first, each with filter type 0
+	vector<uint8_t> raw;
+	raw.reserve((3 * img.width + 1) * img.height);
+	for (int y = img.height - 1; y >= 0; --y)
+	{
+		raw.push_back(0);
+		raw.insert(raw.end(), &img.display[3 * y * img.width], &img.display[3 * (y + 1) * img.width]);
+	}
+
+	byte_writer z;
+	z.u8(0x78);
+	z.u8(0x01);
+	const size_t BLOCK = 65535;
+	for (size_t i = 0; i == 0 || i < raw.size(); i += BLOCK)
+	{
+		uint16_t n = (uint16_t)std::min(BLOCK, raw.size() - i);
+		z.u8(i + BLOCK >= raw.size() ? 1 : 0); // last block
+		z.u8(n & 0xff);
+		z.u8(n >> 8);
+		z.u8(~n & 0xff);
+		z.u8((uint16_t)~n >> 8);
+		z.raw(raw.data() + i, n);
+	}
+	uint32_t a = 1, b = 0; // Adler-32
+	for (uint8_t c : raw)
+	{
+		a = (a + c) % 65521;
+		b = (b + a) % 65521;
+	}
+	z.be32(b << 16 | a);
+
+	byte_writer w;
+	const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	w.raw(signature, 8);
+	auto chunk = [&](const char* type, const vector<uint8_t>& data)
+	{
+		w.be32((uint32_t)data.size());
+		size_t start = w.bytes.size();
+		w.raw(type, 4);
+		w.raw(data.data(), data.size());
+		w.be32(crc32(&w.bytes[start], w.bytes.size() - start));
+	};
+	byte_writer header;
+	header.be32(img.width);
+	header.be32(img.height);
+	header.u8(8); // bits per channel
+	header.u8(2); // RGB
+	header.u8(0); // deflate
+	header.u8(0); // adaptive filtering
+	header.u8(0); // not interlaced
+	chunk("IHDR", header.bytes);
+	chunk("IDAT", z.bytes);
+	chunk("IEND", vector<uint8_t>());
+	return w.bytes;
+}
+
+// Portable float map: little endian RGB floats, bottom row first
+vector<uint8_t> encode_pfm(const developed_image& img)
+{
+	byte_writer w;
+	w.text("PF\n" + std::to_string(img.width) + " " + std::to_string(img.height) + "\n-1.0\n");
+	for (float f : img.hdr)
+		w.f32(f);
+	return w.bytes;
+}
+
+// Uncompressed scanline OpenEXR, 32 bit float RGB, top row first
+vector<uint8_t> encode_exr(const developed_image& img)
+{
+	byte_writer w;
+	w.le32(20000630); // magic
+	w.le32(2);        // version 2, single part scanlines
+
+	auto attribute = [&](const char* name, const char* type, uint32_t size)
+	{
+		w.cstr(name);
+		w.cstr(type);
+		w.le32(size);
+	};
+	const char* channels[3] = { "B", "G", "R" }; // sorted by name
+	attribute("channels", "chlist", 3 * 18 + 1);
+	for (const char* c : channels)
+	{
+		w.cstr(c);
+		w.le32(2); // float
+		w.le32(0); // linear flag and reserved
+		w.le32(1); // x sampling
+		w.le32(1); // y sampling
+	}
+	w.u8(0);
+	attribute("compression", "compression", 1);
+	w.u8(0); // none
+	for (const char* window : { "dataWindow", "displayWindow" })
+	{
+		attribute(window, "box2i", 16);
+		w.le32(0);
+		w.le32(0);
+		w.le32(img.width - 1);
+		w.le32(img.height - 1);
+	}
+	attribute("lineOrder", "lineOrder", 1);
+	w.u8(0); // increasing y
+	attribute("pixelAspectRatio", "float", 4);
+	w.f32(1);
+	attribute("screenWindowCenter", "v2f", 8);
+	w.f32(0);
+	w.f32(0);
+	attribute("screenWindowWidth", "float", 4);
+	w.f32(1);
+	w.u8(0); // end of header
+
+	uint32_t line_size = 3 * 4 * img.width;
+	uint64_t first_line = w.bytes.size() + 8 * (uint64_t)img.height;
+	for (int y = 0; y < img.height; ++y)
+		w.le64(first_line + (uint64_t)y * (8 + line_size));
+	for (int y = 0; y < img.height; ++y)
+	{
+		w.le32(y);
+		w.le32(line_size);
+		const float* row = &img.hdr[3 * (img.height - 1 - y) * img.width];
+		for (int c = 2; c >= 0; --c)
+			for (int x = 0; x < img.width; ++x)
+				w.f32(row[3 * x + c]);
+	}
+	return w.bytes;
+}
+
+// The display image as PNG, or PPM by the extension
+bool write_display_image(const string& filename, const developed_image& img)
+{
+	vector<uint8_t> bytes = has_extension(filename, ".ppm") ? encode_ppm(img) : encode_png(img);
+	return write_whole_file(filename, bytes.data(), bytes.size());
+}
+
+// The linear image as OpenEXR, or PFM by the extension
+bool write_hdr_image(const string& filename, const developed_image& img)
+{
+	vector<uint8_t> bytes = has_extension(filename, ".pfm") ? encode_pfm(img) : encode_exr(img);
+	return write_whole_file(filename, bytes.data(), bytes.size());
+}
+
+// The display bytes of a PPM encode_ppm() wrote, in developed_image order.
+// False if it can't be read or isn't width by height.
+bool read_ppm(const string& filename, int width, int height, vector<uint8_t>& display)
+{
+	mapped_file f;
+	if (!f.open(filename))
+		return false;
+	char text[64] = {}; // the header, null terminated for sscanf
+	memcpy(text, f.data, std::min(f.size, sizeof(text) - 1));
+	char magic[3] = {};
+	int w = 0, h = 0, max_value = 0, header = 0;
+	if (sscanf(text, "%2s %d %d %d%n", magic, &w, &h, &max_value, &header) != 4 ||
+		strcmp(magic, "P6") != 0 || w != width || h != height || max_value != 255)
+		return false;
+	size_t row = 3 * (size_t)width;
+	if (f.size < header + 1 + row * height)
+		return false;
+
+	const uint8_t* pixels = (const uint8_t*)f.data + header + 1;
+	display.resize(row * height);
+	for (int y = 0; y < height; ++y)
+		memcpy(&display[row * y], pixels + row * (height - 1 - y), row);
+	return true;
+}
+
+// The feature buffers as <prefix>.albedo.exr, <prefix>.normal.exr (in
+// [-1, 1]) and <prefix>.depth.exr
+bool write_feature_images(const string& prefix, const film& image)
+{
+	developed_image albedo, normal, depth;
+	for (developed_image* img : { &albedo, &normal, &depth })
+	{
+		img->width = image.width;
+		img->height = image.height;
+		img->hdr.resize(3 * image.width * image.height);
+	}
+	for (int i = 0; i < image.width * image.height; ++i)
+	{
+		sample_features f = image.mean_features(i);
+		for (int c = 0; c < 3; ++c)
+		{
+			albedo.hdr[3 * i + c] = f.albedo[c];
+			normal.hdr[3 * i + c] = f.normal[c];
+			depth.hdr[3 * i + c] = f.depth;
+		}
+	}
+	return write_hdr_image(prefix + ".albedo.exr", albedo) &&
+		write_hdr_image(prefix + ".normal.exr", normal) &&
+		write_hdr_image(prefix + ".depth.exr", depth);
+}
+
+//-----------------------------------------------------------------------------
+// Snapshots
+//-----------------------------------------------------------------------------
+// Develops and writes copies of a film on a thread of its own while the
+// render goes on. A snapshot asked for while the last one is still being
+// written is skipped.
+struct snapshot_writer
+{
+	std::thread worker;
+	std::atomic<bool> busy{ false };
+
+	~snapshot_writer()
+	{
+		if (worker.joinable())
+			worker.join();
+	}
+
+	bool write(const film& image, const post_settings& s, const string& display_file, const string& hdr_file)
+	{
+		if (busy)
+			return false;
+		if (worker.joinable())
+			worker.join();
+
+		busy = true;
+		worker = std::thread([this, copy = image, s, display_file, hdr_file]()
+		{
+			developed_image developed;
+			develop(copy, s, developed);
+			if (!display_file.empty())
+				write_display_image(display_file, developed);
+			if (!hdr_file.empty())
+				write_hdr_image(hdr_file, developed);
+			busy = false;
+		});
+		return true;
+	}
+};
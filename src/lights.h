@@ -0,0 +1,366 @@
+#pragma once
+
+#include <math.h>
+#include <algorithm>
+#include <vector>
+using std::vector;
+
+#include <glm/glm.hpp>
+using namespace glm;
+
+struct light_triangle
+{
+	vec3 p0, p1, p2;
+	float area;
+	float power; // area * emission
+	int model_id;
+};
+vector<light_triangle> light_triangles;
+
+// the unit normal of a light's triangle, 0 if it has no area
+vec3 light_triangle_normal(const light_triangle& t)
+{
+	vec3 n = cross(t.p1 - t.p0, t.p2 - t.p0);
+	return dot(n, n) > 0 ? normalize(n) : vec3(0);
+}
+
+enum light_sampling_mode
+{
+	LIGHTS_AREA,  // proportional to area
+	LIGHTS_POWER, // proportional to emitted power
+	LIGHTS_TREE,  // by estimated contribution to the shading point
+};
+
+//-----------------------------------------------------------------------------
+// Alias table
+//-----------------------------------------------------------------------------
+// Draws index i with probability weights[i] / sum(weights) in O(1) (Vose's
+// method).
+struct alias_table
+{
+	vector<float> prob;
+	vector<int> alias;
+	vector<float> pdf;
+
+	void build(const vector<float>& weights)
+	{
+		int n = (int)weights.size();
+		prob.assign(n, 1.f);
+		alias.resize(n);
+		pdf.assign(n, 0.f);
+
+		double total = 0;
+		for (float w : weights)
+			total += w;
+		if (total <= 0)
+		{
+			pdf.clear();
+			return;
+		}
+
+		vector<float> scaled(n);
+		vector<int> small, large;
+		for (int i = 0; i < n; ++i)
+		{
+			pdf[i] = (float)(weights[i] / total);
+			scaled[i] = (float)(weights[i] * n / total);
+			alias[i] = i;
+			if (scaled[i] < 1)
+				small.push_back(i);
+			else
+				large.push_back(i);
+		}
+
+		while (!small.empty() && !large.empty())
+		{
+			int s = small.back(); small.pop_back();
+			int l = large.back(); large.pop_back();
+
+			prob[s] = scaled[s];
+			alias[s] = l;
+			scaled[l] = (scaled[l] + scaled[s]) - 1;
+			if (scaled[l] < 1)
+				small.push_back(l);
+			else
+				large.push_back(l);
+		}
+		// whatever is left is 1 up to rounding
+	}
+
+	bool empty() const
+	{
+		return pdf.empty();
+	}
+
+	// u in [0, 1); returns the index and the probability of drawing it
+	int sample(float u, float& p) const
+	{
+		int n = (int)pdf.size();
+		float x = u * n;
+		int i = std::min((int)x, n - 1);
+		int result = x - i < prob[i] ? i : alias[i];
+		p = pdf[result];
+		return result;
+	}
+};
+
+//-----------------------------------------------------------------------------
+// Light tree
+//-----------------------------------------------------------------------------
+// Binary tree over the light triangles, one light per leaf. Sampling walks
+// down from the root and picks a child by how much light it could send to
+// the shading point: its power over the squared distance, times the most
+// the emitters can face the point, and nothing if the box is entirely
+// behind the surface. Costs O(log n) per sample.
+//
+// Lights emit from both sides, so what bounds their facing is a cone around
+// a line: every normal of the node is within angle acos(cos_spread) of axis
+// or of -axis (Conty Estevez and Kulla 2018, two-sided).
+struct light_tree_node
+{
+	vec3 lo, hi;
+	float power;
+	vec3 axis;
+	float cos_spread;
+	int left;  // inner: left child, the right one follows it; -1 for leaves
+	int light; // leaf: index into light_triangles
+};
+
+struct light_tree
+{
+	vector<light_tree_node> nodes;
+	vector<int> parent; // of each node
+	vector<int> leaf;   // of each light
+
+	void build(const vector<light_triangle>& lights)
+	{
+		nodes.clear();
+		parent.clear();
+		leaf.assign(lights.size(), -1);
+		if (lights.empty())
+			return;
+
+		vector<int> order(lights.size());
+		for (int i = 0; i < (int)order.size(); ++i)
+			order[i] = i;
+
+		nodes.reserve(2 * lights.size());
+		nodes.push_back(light_tree_node());
+		parent.push_back(-1);
+		build_node(0, lights, order, 0, (int)order.size());
+	}
+
+	void build_node(int node, const vector<light_triangle>& lights, vector<int>& order, int first, int count)
+	{
+		vec3 lo = vec3(1e30f), hi = vec3(-1e30f);
+		float power = 0;
+		vec3 normals = vec3(0);
+		for (int i = first; i < first + count; ++i)
+		{
+			const light_triangle& t = lights[order[i]];
+			lo = min(lo, min(t.p0, min(t.p1, t.p2)));
+			hi = max(hi, max(t.p0, max(t.p1, t.p2)));
+			power += t.power;
+			// the normals' sum, each flipped to the side of the first one
+			vec3 normal = light_triangle_normal(t);
+			normals += dot(normal, normals) < 0 ? -normal : normal;
+		}
+		nodes[node].lo = lo;
+		nodes[node].hi = hi;
+		nodes[node].power = power;
+
+		float len = length(normals);
+		nodes[node].axis = len > 0 ? normals / len : vec3(0, 0, 1);
+		nodes[node].cos_spread = 1;
+		for (int i = first; i < first + count; ++i)
+		{
+			vec3 normal = light_triangle_normal(lights[order[i]]);
+			if (dot(normal, normal) > 0)
+				nodes[node].cos_spread = std::min(nodes[node].cos_spread, abs(dot(normal, nodes[node].axis)));
+		}
+
+		if (count == 1)
+		{
+			nodes[node].left = -1;
+			nodes[node].light = order[first];
+			leaf[order[first]] = node;
+			return;
+		}
+
+		// median split along the longest axis of the box
+		vec3 e = hi - lo;
+		int axis = e.x > e.y ? (e.x > e.z ? 0 : 2) : (e.y > e.z ? 1 : 2);
+		int mid = first + count / 2;
+		std::nth_element(order.begin() + first, order.begin() + mid, order.begin() + first + count, [&](int a, int b)
+		{
+			const light_triangle& ta = lights[a];
+			const light_triangle& tb = lights[b];
+			return (ta.p0 + ta.p1 + ta.p2)[axis] < (tb.p0 + tb.p1 + tb.p2)[axis];
+		});
+
+		int left = (int)nodes.size();
+		nodes.push_back(light_tree_node());
+		nodes.push_back(light_tree_node());
+		parent.push_back(node);
+		parent.push_back(node);
+		nodes[node].left = left;
+		nodes[node].light = -1;
+
+		build_node(left, lights, order, first, mid - first);
+		build_node(left + 1, lights, order, mid, first + count - mid);
+	}
+
+	float importance(const light_tree_node& node, vec3 p, vec3 n) const
+	{
+		vec3 center = (node.lo + node.hi) * 0.5f;
+		vec3 half_extent = (node.hi - node.lo) * 0.5f;
+
+		// furthest corner in the direction of the normal still below the surface?
+		if (dot(center - p, n) + dot(half_extent, abs(n)) <= 0)
+			return 0;
+
+		// clamp the distance to the box size, so points near or inside a
+		// cluster don't blow up the weight of just that one
+		vec3 d = center - p;
+		float radius2 = dot(half_extent, half_extent);
+		float dist2 = std::max(dot(d, d), radius2);
+		return node.power * facing(node, d, dist2, radius2) / dist2;
+	}
+
+	// Most cos between an emitter normal and the way to the shading point,
+	// d from it to the box center: the angle to the axis, less the cone's
+	// spread and the box's size seen from the point, but no less than 0.
+	static float facing(const light_tree_node& node, vec3 d, float dist2, float radius2)
+	{
+		if (radius2 >= dist2)
+			return 1; // at or inside the box
+		float theta = acos(std::min(1.f, abs(dot(node.axis, d)) / sqrt(dist2)));
+		float theta_box = asin(sqrt(radius2 / dist2));
+		float theta_min = std::max(0.f, theta - acos(node.cos_spread) - theta_box);
+		return std::max(0.f, cos(theta_min));
+	}
+
+	// u in [0, 1); returns the light and the probability of choosing it, or
+	// -1 if no light can reach (p, n)
+	int sample(vec3 p, vec3 n, float u, float& pdf) const
+	{
+		pdf = 1;
+		if (nodes.empty())
+			return -1;
+
+		int node = 0;
+		while (nodes[node].left >= 0)
+		{
+			int left = nodes[node].left;
+			float w_left = importance(nodes[left], p, n);
+			float w_right = importance(nodes[left + 1], p, n);
+			if (w_left + w_right <= 0)
+				return -1;
+
+			// pick a child and stretch u back out to [0, 1) for the next level
+			float p_left = w_left / (w_left + w_right);
+			if (u < p_left)
+			{
+				node = left;
+				u = u / p_left;
+				pdf *= p_left;
+			}
+			else
+			{
+				node = left + 1;
+				u = std::min((u - p_left) / (1 - p_left), 0.99999994f);
+				pdf *= 1 - p_left;
+			}
+		}
+		return nodes[node].light;
+	}
+
+	// the probability that sample(p, n, ...) picks light, walking up from its leaf
+	float pdf(vec3 p, vec3 n, int light) const
+	{
+		float pdf = 1;
+		for (int node = leaf[light]; parent[node] >= 0; node = parent[node])
+		{
+			int left = nodes[parent[node]].left;
+			float w_left = importance(nodes[left], p, n);
+			float w_right = importance(nodes[left + 1], p, n);
+			if (w_left + w_right <= 0)
+				return 0;
+			pdf *= (node == left ? w_left : w_right) / (w_left + w_right);
+		}
+		return pdf;
+	}
+};
+
+//-----------------------------------------------------------------------------
+// Light selection
+//-----------------------------------------------------------------------------
+struct light_selector
+{
+	alias_table by_area;
+	alias_table by_power;
+	light_tree tree;
+	vector<int> model_lights; // first light of each model, -1 if it has none
+
+	void build(const vector<light_triangle>& lights)
+	{
+		vector<float> areas, powers;
+		model_lights.clear();
+		for (int i = 0; i < (int)lights.size(); ++i)
+		{
+			const light_triangle& t = lights[i];
+			areas.push_back(t.area);
+			powers.push_back(t.power);
+
+			// a model's light triangles are added together, in index order
+			if (t.model_id >= (int)model_lights.size())
+				model_lights.resize(t.model_id + 1, -1);
+			if (model_lights[t.model_id] < 0)
+				model_lights[t.model_id] = i;
+		}
+		by_area.build(areas);
+		by_power.build(powers);
+		tree.build(lights);
+	}
+
+	// Chooses a light to sample for shading point (p, n). Returns its index
+	// and the probability of choosing it, or -1 if there's nothing to sample.
+	int sample(light_sampling_mode mode, vec3 p, vec3 n, float u, float& pdf) const
+	{
+		if (mode == LIGHTS_TREE)
+			return tree.sample(p, n, u, pdf);
+
+		const alias_table& table = mode == LIGHTS_AREA ? by_area : by_power;
+		if (table.empty())
+			return -1;
+		return table.sample(u, pdf);
+	}
+
+	// the probability that sample(mode, p, n, ...) picks light i
+	float pdf(light_sampling_mode mode, vec3 p, vec3 n, int i) const
+	{
+		if (mode == LIGHTS_TREE)
+			return tree.pdf(p, n, i);
+		return (mode == LIGHTS_AREA ? by_area : by_power).pdf[i];
+	}
+
+	// Chooses the light a light path starts from. There's no shading point to
+	// go by, so the tree falls back to power.
+	int sample_emitter(light_sampling_mode mode, float u, float& pdf) const
+	{
+		return sample(mode == LIGHTS_TREE ? LIGHTS_POWER : mode, vec3(0), vec3(0), u, pdf);
+	}
+	float emitter_pdf(light_sampling_mode mode, int i) const
+	{
+		return (mode == LIGHTS_AREA ? by_area : by_power).pdf[i];
+	}
+
+	// the light that triangle prim of a model is, or -1 if it isn't one
+	int light_index(int model, unsigned prim) const
+	{
+		if (model >= (int)model_lights.size() || model_lights[model] < 0)
+			return -1;
+		return model_lights[model] + prim;
+	}
+};
+light_selector light_selection;
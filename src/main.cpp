@@ -1,82 +1,74 @@
 #include <stdlib.h>
-#include <fstream>
 #include <vector>
 using namespace std;
 
-#include "glm\glm.hpp"
+#include <glm/glm.hpp>
 using glm::vec3;
 using namespace glm;
 
-#include <embree2\rtcore.h>
-#include <embree2\rtcore_ray.h>
-
 #include "CIE.h"
 #include "model.h"
+#include "accelerator.h"
+#include "alloc_counter.h"
+#include "bench.h"
+#include "bsdf.h"
+#include "bvh.h"
+#include "checkpoint.h"
+#include "film.h"
+#include "guiding.h"
+#include "image.h"
+#include "options.h"
+#include "ray_stream.h"
+#include "sampler.h"
+#include "scene_file.h"
+#include "scenes.h"
+#include "stats.h"
+#include "thread_pool.h"
+#include "workers.h"
+#ifndef ALBEDO_NO_EMBREE
+#include "embree_accelerator.h"
+#endif
 
 const int IMAGE_WIDTH = 400;
 const int IMAGE_HEIGHT = 400;
 
-const int NUM_SAMPLES = 100;
+const int TILE_SIZE = 16;
 
 const float MAX_DIST = 8000;
 const float PI = 3.14159;
 
-vec3 buffer[IMAGE_WIDTH][IMAGE_HEIGHT];
-RTCScene scene;
-
-float nrand()
-{
-	return (float)rand() / RAND_MAX;
-}
-
-// non-normalized bell curve
-float bell(float x, float m, float s)
-{
-	return exp(-(x - m)*(x - m) / (2 * s*s));
-}
-float pdf_gaussian(float x, float m, float s)
-{
-	return bell(x, m, s) / (s * sqrt(2 * PI));
-}
-float cdf_gaussian(float x, float m, float s)
-{
-	return erfc(-(x - m) / (s * sqrt(2))) / 2;
-}
-double gaussian_rand(double m, double s)
-{
-	double u1, u2;
-	do
-	{
-		u1 = nrand();
-		u2 = nrand();
-	}
-	while ( u1 <= 0.001 );
-
-	float z0 = sqrt(-2.0 * log(u1)) * cos(2 * PI * u2);
-	return z0 * s + m;
-}
+accelerator* accel;
+render_options options;
 
 //-----------------------------------------------------------------------------
 // Intersection stuff
 //-----------------------------------------------------------------------------
-float BRDF(float lambda, material m, vec3 inDir, vec3 outDir)
+// f of the material at a surface facing normal, between inDir, back the way
+// the path came, and outDir, where it goes next, and the pdfs (over solid
+// angle) of sampling outDir from inDir and inDir from outDir. Lambertian
+// unless the .mtl gave it a specular color, see bsdf.h.
+spectrum BRDF(const spectrum& lambda, const material& m, vec3 normal, vec3 inDir, vec3 outDir, float& pdf, float& pdf_rev)
 {
-	return m.diffuse_albedo * bell(lambda, m.diffuse_mean, m.diffuse_stddev) / PI;
+	if (m.type == BSDF_DIFFUSE)
+	{
+		pdf = abs(dot(normal, outDir)) / PI;
+		pdf_rev = abs(dot(normal, inDir)) / PI;
+		return m.reflectance.eval(lambda) * (1 / PI);
+	}
+	return eval_bsdf(lambda, m, normal, inDir, outDir, pdf, pdf_rev);
 }
-float emmision(float lambda, material mat)
+// pdf (over solid angle) of sampling outDir when the path arrived from inDir
+float BRDF_pdf(const material& m, vec3 normal, vec3 inDir, vec3 outDir)
 {
-	return mat.light_intensity;
+	if (m.type == BSDF_DIFFUSE)
+		return abs(dot(normal, outDir)) / PI;
+	return bsdf_pdf(m, normal, inDir, outDir);
 }
-
-RTCRay make_ray(vec3 o, vec3 dir)
+spectrum emmision(const spectrum& lambda, const material& mat)
 {
-	RTCRay ray;
-	ray.org[0] = o.x; ray.org[1] = o.y; ray.org[2] = o.z;
-	ray.dir[0] = dir.x; ray.dir[1] = dir.y; ray.dir[2] = dir.z;
-	ray.tnear = 0;
-	ray.tfar = MAX_DIST;
-	ray.geomID = RTC_INVALID_GEOMETRY_ID;
-	return ray;
+	if (mat.light_intensity == 0)
+		return spectrum(0);
+	return mat.emission.eval(lambda) * mat.light_intensity;
 }
 
 struct intersection_info
@@ -85,34 +77,58 @@ struct intersection_info
 	vec2 uv;
 	vec3 pos;
 	vec3 normal;
-	material mat;
+	int model; // index into models
+	unsigned prim; // triangle of the model
 };
-void get_intersection_info(vec3 o, vec3 ray, intersection_info* ret)
+// fills in the hit of ray (o, dir) from what the accelerator returned for it
+void make_intersection_info(vec3 o, vec3 ray, unsigned int geom_id, unsigned int prim_id, unsigned int inst_id, float tfar, vec3 ng,
+	intersection_info* ret)
 {
-	RTCRay rtcNegODir = make_ray(o, ray);
-	rtcIntersect(scene, rtcNegODir);
-
-	if (rtcNegODir.geomID == -1)
+	if (geom_id == INVALID_GEOMETRY_ID)
 	{
 		ret->t = -1;
 		return;
 	}
 
-	ret->t = rtcNegODir.tfar - 0.001f;
+	ret->t = tfar - 0.001f;
 
 	ret->pos = o + ray * ret->t;
-	ret->normal = normalize(vec3(-rtcNegODir.Ng[0], -rtcNegODir.Ng[1], -rtcNegODir.Ng[2]));
+	ret->normal = normalize(-ng);
 	if (dot(ret->normal, ray * -1.0f) < 0)
 		ret->normal *= -1.0f;
 	
-	model m = models[rtcNegODir.geomID];
-	ret->mat = m.mat;
+	ret->model = hit_model(geom_id, inst_id);
+	ret->prim = prim_id;
+}
+void get_intersection_info(vec3 o, vec3 ray, intersection_info* ret)
+{
+	ray_hit hit(o, ray, MAX_DIST);
+	{
+		STATS_TIME(trace_ticks);
+		accel->intersect1(hit);
+	}
+
+	make_intersection_info(o, ray, hit.geom_id, hit.prim_id, hit.inst_id, hit.tfar, hit.ng, ret);
+}
+void get_intersection_info(const ray_stream& rays, int i, intersection_info* ret)
+{
+	make_intersection_info(rays.org(i), rays.dir(i), rays.geom_id[i], rays.prim_id[i], rays.inst_id[i], rays.tfar[i], rays.ng(i), ret);
+}
+
+// true if something blocks the segment from o to o + dir * dist
+bool occluded(vec3 o, vec3 dir, float dist)
+{
+	STATS_ADD(shadow_rays, 1);
+	STATS_TIME(trace_ticks);
+	ray_hit ray(o, dir, dist);
+	accel->occluded1(ray);
+	return ray.geom_id != INVALID_GEOMETRY_ID;
 }
 
 //-----------------------------------------------------------------------------
 // Coloring and ray tracing stuff
 //-----------------------------------------------------------------------------
-// returns any vector perpendicular to the norm (or tangent to surface)
+// returns any unit vector perpendicular to the norm (or tangent to surface)
 vec3 get_tangent(vec3 norm)
 {
 	vec3 tangent;
@@ -122,17 +138,35 @@ vec3 get_tangent(vec3 norm)
 		tangent = c1;
 	else
 		tangent = c2;
-	return tangent;
+	return normalize(tangent);
 }
-vec3 rand_cosine_weighted_ray(vec3 norm)
+// maps the unit square onto the unit disk, keeping strata intact (Shirley & Chiu)
+vec2 concentric_sample_disk(vec2 u)
 {
-	float rx = 1, rz = 1;
-	while (rx*rx + rz*rz >= 1)
+	float a = 2 * u.x - 1;
+	float b = 2 * u.y - 1;
+	if (a == 0 && b == 0)
+		return vec2(0, 0);
+
+	float r, phi;
+	if (a * a > b * b)
 	{
-		rx = 2 * nrand() - 1.0f;
-		rz = 2 * nrand() - 1.0f;
+		r = a;
+		phi = (PI / 4) * (b / a);
 	}
-	float ry = sqrt(1 - rx*rx - rz*rz);
+	else
+	{
+		r = b;
+		phi = PI / 2 - (PI / 4) * (a / b);
+	}
+	return vec2(r * cos(phi), r * sin(phi));
+}
+vec3 rand_cosine_weighted_ray(vec3 norm)
+{
+	// project a disk sample up onto the hemisphere (Malley's method)
+	vec2 d = concentric_sample_disk(nrand2());
+	float rx = d.x, rz = d.y;
+	float ry = sqrt(std::max(0.f, 1 - rx*rx - rz*rz));
 
 	vec3 tangent = get_tangent(norm);
 	vec3 bitangent = cross(norm, tangent);
@@ -140,260 +174,1463 @@ vec3 rand_cosine_weighted_ray(vec3 norm)
 	vec3 castRay = normalize(tangent*rx + bitangent*rz + norm*ry);
 	return castRay;
 }
-vec3 rand_hemisphere_ray(vec3 norm)
+// Picks where a path that arrived from inDir goes next, by the BRDF. False
+// if it's absorbed instead.
+bool sample_BRDF(const spectrum& lambda, const material& m, vec3 normal, vec3 inDir, bsdf_sample& s)
 {
-	float rx = 1, ry = 1, rz = 1;
-	while (rx*rx + ry*ry + rz*rz >= 1)
+	if (m.type == BSDF_DIFFUSE)
 	{
-		rx = 2 * nrand() - 1;
-		ry = 2 * nrand() - 1;
-		rz = 2 * nrand() - 1;
+		s.dir = rand_cosine_weighted_ray(normal);
+		s.f = m.reflectance.eval(lambda) * (1 / PI);
+		s.weight = s.f * PI;
+		s.pdf = BRDF_pdf(m, normal, inDir, s.dir);
+		s.pdf_rev = abs(dot(normal, inDir)) / PI;
+		return true;
 	}
-	vec3 ray = vec3(rx, ry, rz);
+	float u_lobe = nrand();
+	return sample_bsdf(lambda, m, normal, inDir, u_lobe, nrand2(), s);
+}
+vec3 rand_hemisphere_ray(vec3 norm)
+{
+	vec2 u = nrand2();
+	float ry = u.x;
+	float r = sqrt(std::max(0.f, 1 - ry*ry));
+	float rx = r * cos(2 * PI * u.y);
+	float rz = r * sin(2 * PI * u.y);
 
-	ray = normalize(ray);
-	if (dot(ray, norm) < 0)
-		ray *= -1;
+	vec3 tangent = get_tangent(norm);
+	vec3 bitangent = cross(norm, tangent);
 
-	return ray;
+	return normalize(tangent*rx + bitangent*rz + norm*ry);
 }
 
-struct light_path_node
+// Longest path, counting the camera; Russian roulette ends them far sooner.
+const int MAX_PATH_VERTICES = 64;
+
+// The vertices of a path, one fixed size array per field, so building a path
+// never touches the heap. Materials are referenced by model index.
+struct path_vertices
 {
-	vec3 pos;
-	vec3 normal;
-	vec3 ray_towards_camera;
-	vec3 ray_towards_light;
-	material mat;
+	int count;
+	vec3 pos[MAX_PATH_VERTICES];
+	vec3 normal[MAX_PATH_VERTICES];
+	vec3 wo[MAX_PATH_VERTICES]; // towards the previous vertex
+	int model[MAX_PATH_VERTICES]; // -1 for the camera
+
+	// bidirectional only: the pdf (over area) of sampling this vertex from the
+	// previous one, and from the next one going the other way
+	float pdf_fwd[MAX_PATH_VERTICES];
+	float pdf_rev[MAX_PATH_VERTICES];
+	// camera paths only: the pdf (over solid angle) of the direction this
+	// vertex bounced in, for the guide and for pdf_fwd of the next one
+	float pdf_dir[MAX_PATH_VERTICES];
 
 	// thing to multiply against emmision to get total weight
 	// includes this vert's probability, but not thie vert's BRDF and projected area component
-	float accumulated_weight;
+	spectrum weight[MAX_PATH_VERTICES];
 
-	light_path_node() {}
+	void clear()
+	{
+		count = 0;
+	}
+	bool full() const
+	{
+		return count == MAX_PATH_VERTICES;
+	}
+	void add(vec3 p, vec3 n, vec3 w, int m, const spectrum& wt)
+	{
+		pos[count] = p;
+		normal[count] = n;
+		wo[count] = w;
+		model[count] = m;
+		weight[count] = wt;
+		count++;
+	}
+	const material& mat(int i) const
+	{
+		return models[model[i]].mat;
+	}
 };
 
-// only selects lights now
-void construct_light_path(float lambda, vector<light_path_node>& path)
+// uniform point on a light triangle
+vec3 sample_light_triangle(const light_triangle& t, vec2 u)
+{
+	float su = sqrt(u.x);
+	float b1 = 1 - su;
+	float b2 = u.y * su;
+	return t.p0 + b1 * (t.p1 - t.p0) + b2 * (t.p2 - t.p0);
+}
+
+// only selects lights now. (p, n) is the point being lit, used to pick a
+// light that can actually reach it; leaves the path empty if none can
+void construct_light_path(const spectrum& lambda, vec3 p, vec3 n, path_vertices& path)
+{
+	path.clear();
+
+	// Select a triangle
+	float select_pdf;
+	int i = light_selection.sample(options.lights, p, n, nrand(), select_pdf);
+	if (i < 0)
+		return;
+	const light_triangle& t = light_triangles[i];
+
+	vec3 o = sample_light_triangle(t, nrand2());
+	spectrum weight = emmision(lambda, models[t.model_id].mat) * t.area / select_pdf;
+	path.add(o, light_triangle_normal(t), vec3(0), t.model_id, weight);
+}
+// Camera paths bounce by the BRDF, or with --guide by a mixture of that and
+// the path guide wherever it has learned anything. These are null where the
+// guide has nothing to go on, and the pdf of the mixture over solid angle.
+const guide_dtree* bounce_guide(vec3 p)
+{
+	return options.guide ? guide.distribution(p) : nullptr;
+}
+float mix_guide_pdf(const guide_dtree& d, float brdf_pdf, vec3 out)
+{
+	return GUIDE_FRACTION * d.pdf(direction_to_square(out)) / (4 * PI) + (1 - GUIDE_FRACTION) * brdf_pdf;
+}
+// pdf of a camera path at p bouncing towards out, which the BRDF alone
+// would with brdf_pdf
+float guided_pdf(vec3 p, float brdf_pdf, vec3 out)
 {
+	const guide_dtree* d = bounce_guide(p);
+	return d ? mix_guide_pdf(*d, brdf_pdf, out) : brdf_pdf;
+}
+// pdf of a camera path at p that arrived from in bouncing towards out
+float camera_bounce_pdf(const material& m, vec3 p, vec3 normal, vec3 in, vec3 out)
+{
+	return guided_pdf(p, BRDF_pdf(m, normal, in, out), out);
+}
+
+// A camera path while it is being traced. o and ray are the next ray to shoot.
+struct camera_path
+{
+	spectrum lambda;
 	vec3 o;
 	vec3 ray;
+	spectrum accumulated_weight;
+	path_vertices vertices;
+	int light; // the light triangle it ended on, -1 if none
+};
+void start_camera_path(const spectrum& lambda, vec3 o, vec3 ray, camera_path& cp)
+{
+	cp.lambda = lambda;
+	cp.o = o;
+	cp.ray = ray;
+	cp.accumulated_weight = spectrum(1);
+	cp.light = -1;
+
+	// add origin
+	cp.vertices.clear();
+	cp.vertices.add(o, ray, vec3(0), -1, spectrum(1));
+}
+// Adds the hit of cp.ray to the path and picks the next ray. Returns false
+// once the path is done.
+bool extend_camera_path(camera_path& cp, const intersection_info& info)
+{
+	if (cp.vertices.count == 1)
+		STATS_ADD(primary_rays, 1);
+	else
+		STATS_ADD(bounce_rays, 1);
+
+	if (info.t < -0.1)
+	{
+		STATS_PATH_END(PATH_ESCAPED, cp.vertices.count - 1);
+		return false;
+	}
+	if (cp.vertices.full())
+	{
+		STATS_PATH_END(PATH_TOO_LONG, cp.vertices.count - 1);
+		return false;
+	}
+
+	vec3 p = info.pos;
+	vec3 normal = info.normal;
+	const material& mat = models[info.model].mat;
+	cp.vertices.add(p, normal, -cp.ray, info.model, cp.accumulated_weight);
+
+	if (max_value(emmision(cp.lambda, mat)) > 0.01)
+	{
+		cp.light = light_selection.light_index(info.model, info.prim);
+		STATS_PATH_END(PATH_HIT_LIGHT, cp.vertices.count - 1);
+		return false;
+	}
 	
-	// Select a triangle
+	vec3 nextRay;
+	spectrum weight;
+	float& pdf = cp.vertices.pdf_dir[cp.vertices.count - 1];
+	const guide_dtree* d = bounce_guide(p);
+	bsdf_sample s;
+	if (d && nrand() < GUIDE_FRACTION)
+		nextRay = square_to_direction(d->sample(nrand2()));
+	else if (sample_BRDF(cp.lambda, mat, normal, -cp.ray, s))
+		nextRay = s.dir;
+	else
 	{
-		light_triangle t;
-		float r = nrand() * total_light_area;
-		for (int i = 0; i < light_triangles.size(); ++i)
-		{
-			if (r > light_triangles[i].area && i != light_triangles.size() - 1)
-			{
-				r -= light_triangles[i].area;
-				continue;
-			}
+		STATS_PATH_END(PATH_ABSORBED, cp.vertices.count - 1);
+		return false;
+	}
+	if (d)
+	{
+		float brdf_pdf, pdf_rev;
+		spectrum f = BRDF(cp.lambda, mat, normal, -cp.ray, nextRay, brdf_pdf, pdf_rev);
+		pdf = mix_guide_pdf(*d, brdf_pdf, nextRay);
+		weight = f * (pdf > 0 ? std::max(0.f, dot(normal, nextRay)) / pdf : 0);
+	}
+	else
+	{
+		pdf = s.pdf;
+		weight = s.weight;
+	}
+	
+	cp.accumulated_weight *= weight;
 
-			t = light_triangles[i];
-			break;
+	// Store data for next iteration
+	cp.o = p;
+	cp.ray = nextRay;
+
+	// Russian Roulette, the same for every wavelength so the lanes stay one path
+	// todo: weight this also by percieved brightness of lambda for good measure
+	float r = nrand();
+	float russian = std::min(1.f, max_value(cp.accumulated_weight));
+	if (russian < r)
+	{
+		STATS_PATH_END(PATH_RUSSIAN_ROULETTE, cp.vertices.count - 1);
+		return false;
+	}
+	
+	cp.accumulated_weight /= russian;
+	return true;
+}
+
+// the denoiser's view of the first hit
+sample_features first_hit_features(const camera_path& cp)
+{
+	sample_features f;
+	const path_vertices& v = cp.vertices;
+	if (v.count < 2)
+		return f;
+	f.albedo = v.mat(1).albedo;
+	f.normal = dot(v.normal[1], v.wo[1]) < 0 ? -v.normal[1] : v.normal[1];
+	f.depth = length(v.pos[1] - v.pos[0]);
+	return f;
+}
+
+// A light sample from one vertex of a camera path. It only counts if the
+// shadow ray from the vertex makes it to the light.
+struct light_connection
+{
+	int vertex;
+	vec3 o;
+	vec3 dir;
+	float dist;
+	spectrum value;
+};
+
+// MIS weight of a sample taken with pdf, against the other strategy that
+// could have made it with pdf_other
+float pt_mis_weight(float pdf, float pdf_other)
+{
+	if (options.mis == MIS_POWER)
+	{
+		pdf *= pdf;
+		pdf_other *= pdf_other;
+	}
+	return pdf / (pdf + pdf_other);
+}
+
+// pdf over solid angle at from of sampling point to on light l, for a shading
+// point (from, n_from)
+float light_sample_pdf(int l, vec3 from, vec3 n_from, vec3 to, vec3 n_to)
+{
+	const light_triangle& lt = light_triangles[l];
+	vec3 d = to - from;
+	float dist2 = dot(d, d);
+	float cos_to = abs(dot(n_to, d)) / sqrt(dist2);
+	if (cos_to <= 0)
+		return 0;
+	return light_selection.pdf(options.lights, from, n_from, l) / lt.area * dist2 / cos_to;
+}
+
+// Radiance the finished camera path picked up by itself, if it hit a light.
+// Also adds a light sample from each of its vertices that isn't one to c.
+// Both are weighted by MIS against the other way of finding the same light:
+// a light sample against the bounce hitting it, and the other way round.
+spectrum finish_camera_path(const camera_path& cp, vector<light_connection>& c)
+{
+	const spectrum& lambda = cp.lambda;
+	const path_vertices& v = cp.vertices;
+	int last = v.count - 1;
+
+	if (last == 0)
+		return spectrum(0); // it escaped to infinity too early to preempt it
+
+	spectrum result(0);
+	spectrum emm = emmision(lambda, v.mat(last));
+	bool hit_light = max_value(emm) > 0.01;
+	if (hit_light)
+	{
+		// seen straight from the camera, or a light the sampling can't pick
+		float w = 1;
+		if (last >= 2 && cp.light >= 0)
+		{
+			int z = last - 1;
+			float light_pdf = light_sample_pdf(cp.light, v.pos[z], v.normal[z], v.pos[last], v.normal[last]);
+			w = pt_mis_weight(v.pdf_dir[z], light_pdf);
 		}
+		result = emm * v.weight[last] * w;
+	}
 
-		float r1 = nrand();
-		float r2 = nrand();
-		o = t.p0 + r1 * (t.p1 - t.p0) + r2 * (t.p2 - t.p0);
+	for (int z = 1; z < (hit_light ? last : last + 1); ++z)
+	{
+		float select_pdf;
+		int l = light_selection.sample(options.lights, v.pos[z], v.normal[z], nrand(), select_pdf);
+		if (l < 0)
+			continue;
+		const light_triangle& lt = light_triangles[l];
+		vec3 y = sample_light_triangle(lt, nrand2());
+		vec3 ny = light_triangle_normal(lt);
+		vec3 d = y - v.pos[z];
+		float dist2 = dot(d, d);
+		float dist = sqrt(dist2);
+		vec3 dir = d / dist;
+		float cos_z = dot(v.normal[z], dir);
+		float cos_y = abs(dot(ny, dir));
+		if (cos_z <= 0 || cos_y <= 0)
+			continue;
 
-		light_path_node n;
-		n.pos = o;
-		n.normal = normalize(cross(t.p1 - t.p0, t.p2 - t.p0));
-		//n.ray_towards_camera = rand_hemisphere_ray(n.normal);
-		n.mat = models[t.model_id].mat;
-		n.accumulated_weight = emmision(lambda, n.mat) * total_light_area;
-		path.push_back(n);
+		float pdf, pdf_rev;
+		spectrum f = BRDF(lambda, v.mat(z), v.normal[z], v.wo[z], dir, pdf, pdf_rev);
+		float light_pdf = select_pdf / lt.area * dist2 / cos_y;
+		float w = pt_mis_weight(light_pdf, guided_pdf(v.pos[z], pdf, dir));
 
-		ray = n.ray_towards_camera;
+		light_connection lc;
+		lc.value = f * v.weight[z] * emmision(lambda, models[lt.model_id].mat) * (cos_z / light_pdf * w);
+		if (max_value(lc.value) <= 0)
+			continue;
+		// stop just short of the light itself
+		lc.vertex = z;
+		lc.o = v.pos[z];
+		lc.dir = dir;
+		lc.dist = dist - 0.01f;
+		c.push_back(lc);
 	}
+	return result;
 }
-void construct_camera_path(float lambda, vec3 o, vec3 ray, vector<light_path_node>& path)
+
+// Teaches the guide the radiance that came into each bounce of the camera
+// path. arrived[k] is what the sample got through vertex k and no further,
+// its weight included, so what came into vertex i is the sum of those past
+// it over the weight of i + 1. The guide gets the average over wavelengths,
+// times the cosine at i, which every material's bounce weight has in it; the
+// shape of the material's lobe is left to the BRDF half of the mixture.
+void record_guide(const path_vertices& v, const spectrum* arrived)
 {
-	// add origin
+	spectrum after(0);
+	for (int i = v.count - 2; i >= 1; --i)
+	{
+		after += arrived[i + 1];
+		float incoming = 0;
+		for (int k = 0; k < SPECTRUM_LANES; ++k)
+		{
+			if (v.weight[i + 1][k] > 0)
+				incoming += after[k] / v.weight[i + 1][k];
+		}
+		vec3 dir = -v.wo[i + 1];
+		guide.record(v.pos[i], dir, incoming / SPECTRUM_LANES * abs(dot(v.normal[i], dir)) / v.pdf_dir[i]);
+	}
+}
+// radiance along ray (from o), at each of the path's wavelengths
+spectrum radiance(const spectrum& lambda, vec3 o, vec3 ray, sample_features& features)
+{
+	thread_local camera_path cp;
+	start_camera_path(lambda, o, ray, cp);
+
+	intersection_info info;
+	do
+		get_intersection_info(cp.o, cp.ray, &info);
+	while (extend_camera_path(cp, info));
+
+	thread_local vector<light_connection> c;
+	c.clear();
+	spectrum result = finish_camera_path(cp, c);
+
+	// what came in through each vertex, for the guide
+	thread_local spectrum arrived[MAX_PATH_VERTICES];
+	std::fill(arrived, arrived + cp.vertices.count, spectrum(0));
+	arrived[cp.vertices.count - 1] = result;
+
+	// make sure there's line of sight to each light sample
+	for (const light_connection& lc : c)
 	{
-		light_path_node n;
-		n.pos = o;
-		n.normal = ray;
-		n.ray_towards_light = ray;
-		n.accumulated_weight = 1;
+		if (occluded(lc.o, lc.dir, lc.dist))
+			continue;
+		result += lc.value;
+		arrived[lc.vertex] += lc.value;
+	}
+
+	if (options.guide && guide.learning)
+		record_guide(cp.vertices, arrived);
+	features = first_hit_features(cp);
+	return result;
+}
 
-		path.push_back(n);
+//-----------------------------------------------------------------------------
+// Bidirectional path tracing
+//-----------------------------------------------------------------------------
+// A camera path and a path from a light are traced on their own, then every
+// vertex of one is connected to every vertex of the other. Strategy (s, t)
+// uses s light vertices and t camera vertices, and is weighted against the
+// other strategies that could have made the same path (multiple importance
+// sampling). t = 1, connecting light vertices straight to the camera, is left
+// out: it lands in other pixels, and the film counts samples per pixel.
+// Lights are black, as in radiance(), so paths end when they hit one.
+
+// converts a pdf over solid angle at from into one over area at to
+float to_area_pdf(float pdf, vec3 from, vec3 to, vec3 n_to)
+{
+	vec3 d = to - from;
+	float dist2 = dot(d, d);
+	return pdf * abs(dot(n_to, d)) / (dist2 * sqrt(dist2));
+}
+
+// pdf of a light sending its path towards dir: cosine weighted, either side
+float emission_pdf(vec3 normal, vec3 dir)
+{
+	return abs(dot(normal, dir)) / (2 * PI);
+}
+
+// pdf_fwd of vertices 2 and up, and pdf_rev of all but the last two, which
+// depend on what they get connected to. Whoever started the path fills in
+// pdf_fwd of vertices 0 and 1. Camera paths bounce as camera_bounce_pdf()
+// says and light paths by the BRDF, whichever way they're going.
+void set_path_pdfs(path_vertices& v, bool camera)
+{
+	for (int i = 2; i < v.count; ++i)
+	{
+		float pdf = camera ? v.pdf_dir[i - 1] : BRDF_pdf(v.mat(i - 1), v.normal[i - 1], v.wo[i - 1], -v.wo[i]);
+		v.pdf_fwd[i] = to_area_pdf(pdf, v.pos[i - 1], v.pos[i], v.normal[i]);
 	}
+	for (int i = 0; i + 2 < v.count; ++i)
+	{
+		float pdf = camera ? BRDF_pdf(v.mat(i + 1), v.normal[i + 1], -v.wo[i + 2], v.wo[i + 1]) :
+			camera_bounce_pdf(v.mat(i + 1), v.pos[i + 1], v.normal[i + 1], -v.wo[i + 2], v.wo[i + 1]);
+		v.pdf_rev[i] = to_area_pdf(pdf, v.pos[i + 1], v.pos[i], v.normal[i]);
+	}
+}
 
-	float accumulated_weight = 1;
-	while (true)
+// Traces a path from a point on a light, chosen by power (by area with
+// --lights area), until Russian roulette ends it or it hits another light.
+// Returns the light it starts on, or -1 if there are none.
+int trace_light_path(const spectrum& lambda, path_vertices& path)
+{
+	path.clear();
+
+	float select_pdf;
+	int light = light_selection.sample_emitter(options.lights, nrand(), select_pdf);
+	if (light < 0)
+		return -1;
+	const light_triangle& t = light_triangles[light];
+
+	vec3 o = sample_light_triangle(t, nrand2());
+	vec3 normal = light_triangle_normal(t);
+	float pdf_pos = select_pdf / t.area;
+	path.add(o, normal, vec3(0), t.model_id, emmision(lambda, models[t.model_id].mat) / pdf_pos);
+	path.pdf_fwd[0] = pdf_pos;
+
+	// either side, cosine weighted, so emission * cos / pdf is emission * 2 PI
+	vec3 ray = rand_cosine_weighted_ray(nrand() < 0.5f ? normal : -normal);
+	spectrum weight = path.weight[0] * (2 * PI);
+	float start = max_value(weight);
+
+	while (!path.full())
 	{
-		// Intersection
 		intersection_info info;
 		get_intersection_info(o, ray, &info);
+		STATS_ADD(light_rays, 1);
 		if (info.t < -0.1)
 			break;
+		const material& mat = models[info.model].mat;
+		if (max_value(emmision(lambda, mat)) > 0.01)
+			break;
+		path.add(info.pos, info.normal, -ray, info.model, weight);
 
-		vec3 p = info.pos;
-		vec3 normal = info.normal;
-
-		light_path_node n;
-		n.pos = p;
-		n.normal = normal;
-		n.ray_towards_camera = -ray;
-		n.ray_towards_light = vec3(0);
-		n.mat = info.mat;
-		n.accumulated_weight = accumulated_weight;
-		path.push_back(n);
-		light_path_node* cur_n = &(path[path.size() - 1]); // we still need to modify this node a bit
-
-		float emm = emmision(lambda, info.mat);
-		if (dot(emm, emm) > 0.001)
+		bsdf_sample s;
+		if (!sample_BRDF(lambda, mat, info.normal, -ray, s))
 			break;
-		
-		vec3 nextRay = rand_cosine_weighted_ray(normal);
-		float weight = BRDF(lambda, n.mat, nextRay, -ray) * PI;
-		
-		cur_n->ray_towards_light = nextRay;
-		accumulated_weight *= weight;
-
-		// Store data for next iteration
-		o = p;
-		ray = nextRay;
-
-		// Russian Roulette
-		// todo: weight this also by percieved brightness of lambda for good measure
-		float r = nrand();
-		float russian = min(1.f, accumulated_weight);
-		if (russian < r)
+		weight *= s.weight;
+		o = info.pos;
+		ray = s.dir;
+
+		// Russian roulette on the fraction of the light's power still carried
+		float russian = std::min(1.f, max_value(weight) / start);
+		if (russian < nrand())
 			break;
-		
-		accumulated_weight /= russian;
+		weight /= russian;
 	}
+
+	set_path_pdfs(path, false);
+	if (path.count > 1)
+		path.pdf_fwd[1] = to_area_pdf(emission_pdf(normal, -path.wo[1]), path.pos[0], path.pos[1], path.normal[1]);
+	return light;
 }
 
-float radiance(float lambda, vec3 o, vec3 ray)
+float nonzero(float pdf)
 {
-	vector<light_path_node> camera_path;
-	camera_path.reserve(10);
-	construct_camera_path(lambda, o, ray, camera_path);
-
-	light_path_node last_node = camera_path.back();
+	return pdf != 0 ? pdf : 1;
+}
 
-	// if we hit a light by chance, just accumulate it
-	float emm = emmision(lambda, last_node.mat);
-	if (emm > 0.01)
-		return emm * last_node.accumulated_weight;
+// MIS weight of the strategy with t camera vertices, for a path of n. fwd and
+// rev are the pdfs of each vertex from the camera and from the light side;
+// rev of the last one is that of light paths starting there, and select that
+// of the light sample (s = 1) picking it. Vertices 0 and 1 always come from
+// the camera, so they cancel out.
+float mis_weight(const float* fwd, const float* rev, float select, int n, int t)
+{
+	auto heuristic = [](float p) { return options.mis == MIS_POWER ? p * p : p; };
 
-	if (camera_path.size() == 1)
-		return 0; // it escaped to infinity too early to preempt it
+	// every strategy's pdf relative to that of s = 0
+	float sum = 1;
+	float current = t == n ? 1 : 0;
+	float p = 1;
+	for (int k = n - 1; k >= 2; --k)
+	{
+		p *= nonzero(rev[k]) / nonzero(fwd[k]);
+		float h = heuristic(k == n - 1 ? select / nonzero(fwd[k]) : p);
+		sum += h;
+		if (k == t)
+			current = h;
+	}
+	return current / sum;
+}
 
-	// so the path didn't hit a light. now let's append a light sample to the path
-	vector<light_path_node> light_path;
-	construct_light_path(lambda, light_path);
-	light_path_node light_node = light_path.front();
+// radiance along ray (from o), at each of the path's wavelengths, by
+// bidirectional path tracing
+spectrum bdpt_radiance(const spectrum& lambda, vec3 o, vec3 ray, sample_features& features)
+{
+	thread_local camera_path cp;
+	thread_local path_vertices light_path;
+	start_camera_path(lambda, o, ray, cp);
 
-	// make sure there's line of sight to the selected light sample
-	vec3 light_ray = light_node.pos - last_node.pos;
-	vec3 light_ray_norm = normalize(light_ray);
 	intersection_info info;
-	get_intersection_info(last_node.pos, light_ray_norm, &info);
+	do
+		get_intersection_info(cp.o, cp.ray, &info);
+	while (extend_camera_path(cp, info));
+	features = first_hit_features(cp);
+
+	const path_vertices& cam = cp.vertices;
+	set_path_pdfs(cp.vertices, true);
+	int light = trace_light_path(lambda, light_path);
+
+	float fwd[2 * MAX_PATH_VERTICES];
+	float rev[2 * MAX_PATH_VERTICES];
+	spectrum result(0);
+	// what came in through each camera vertex, for the guide
+	thread_local spectrum arrived[MAX_PATH_VERTICES];
+	std::fill(arrived, arrived + cam.count, spectrum(0));
 
-	if (abs(info.t - length(light_ray)) < 0.01)
+	// s = 0: the camera path found a light by itself
+	if (cp.light >= 0)
 	{
-		float camera_weight = last_node.accumulated_weight;
-		float light_weight = light_node.accumulated_weight;
-		float brdf = BRDF(lambda, last_node.mat, last_node.ray_towards_camera, light_ray_norm);
-		return brdf * camera_weight * light_weight *
-			max(0.f, dot(last_node.normal, light_ray_norm) * dot(light_node.normal, light_ray_norm)) / 
-			dot(light_ray, light_ray);
+		int n = cam.count;
+		const light_triangle& lt = light_triangles[cp.light];
+		for (int i = 2; i < n; ++i)
+		{
+			fwd[i] = cam.pdf_fwd[i];
+			rev[i] = cam.pdf_rev[i];
+		}
+		rev[n - 2] = to_area_pdf(emission_pdf(cam.normal[n - 1], cam.wo[n - 1]), cam.pos[n - 1], cam.pos[n - 2], cam.normal[n - 2]);
+		rev[n - 1] = light_selection.emitter_pdf(options.lights, cp.light) / lt.area;
+		float select = light_selection.pdf(options.lights, cam.pos[n - 2], cam.normal[n - 2], cp.light) / lt.area;
+
+		float w = mis_weight(fwd, rev, select, n, n);
+		arrived[n - 1] = emmision(lambda, cam.mat(n - 1)) * cam.weight[n - 1] * w;
+		result += arrived[n - 1];
 	}
 
-	// just give up at this point
-	return 0;
+	// connections from every camera vertex that isn't a light
+	int last = cp.light >= 0 ? cam.count - 1 : cam.count;
+	for (int t = 2; t <= last; ++t)
+	{
+		int z = t - 1;
+		const material& mat_z = cam.mat(z);
+		for (int i = 2; i < t; ++i)
+		{
+			fwd[i] = cam.pdf_fwd[i];
+			rev[i] = cam.pdf_rev[i];
+		}
+
+		// s = 1: a new light sample, picked for this vertex
+		float select_pdf;
+		int l = light_selection.sample(options.lights, cam.pos[z], cam.normal[z], nrand(), select_pdf);
+		if (l >= 0)
+		{
+			const light_triangle& lt = light_triangles[l];
+			vec3 y = sample_light_triangle(lt, nrand2());
+			vec3 ny = light_triangle_normal(lt);
+			vec3 d = y - cam.pos[z];
+			float dist2 = dot(d, d);
+			vec3 dir = d / sqrt(dist2);
+
+			float pdf_z, pdf_z_rev;
+			spectrum f_z = BRDF(lambda, mat_z, cam.normal[z], cam.wo[z], dir, pdf_z, pdf_z_rev);
+			spectrum value = f_z * cam.weight[z] *
+				emmision(lambda, models[lt.model_id].mat) * (lt.area / select_pdf) *
+				(std::max(0.f, dot(cam.normal[z], dir)) * abs(dot(ny, dir)) / dist2);
+
+			int n = t + 1;
+			rev[z] = to_area_pdf(emission_pdf(ny, dir), y, cam.pos[z], cam.normal[z]);
+			rev[z - 1] = to_area_pdf(pdf_z_rev, cam.pos[z], cam.pos[z - 1], cam.normal[z - 1]);
+			fwd[n - 1] = to_area_pdf(guided_pdf(cam.pos[z], pdf_z, dir), cam.pos[z], y, ny);
+			rev[n - 1] = light_selection.emitter_pdf(options.lights, l) / lt.area;
+
+			float w = mis_weight(fwd, rev, select_pdf / lt.area, n, t);
+			if (max_value(value) * w > 0 && !occluded(cam.pos[z], dir, sqrt(dist2) - 0.01f))
+			{
+				result += value * w;
+				arrived[z] += value * w;
+			}
+		}
+
+		// s >= 2: connect to the light path's vertices off the light
+		for (int s = 2; s <= light_path.count; ++s)
+		{
+			int y = s - 1;
+			const material& mat_y = light_path.mat(y);
+			vec3 d = light_path.pos[y] - cam.pos[z];
+			float dist2 = dot(d, d);
+			vec3 dir = d / sqrt(dist2);
+			float cos_z = dot(cam.normal[z], dir);
+			float cos_y = -dot(light_path.normal[y], dir);
+			if (cos_z <= 0 || cos_y <= 0)
+				continue;
+
+			float pdf_z, pdf_z_rev, pdf_y, pdf_y_rev;
+			spectrum f_z = BRDF(lambda, mat_z, cam.normal[z], cam.wo[z], dir, pdf_z, pdf_z_rev);
+			spectrum f_y = BRDF(lambda, mat_y, light_path.normal[y], light_path.wo[y], -dir, pdf_y, pdf_y_rev);
+			spectrum value = cam.weight[z] * f_z * (cos_z * cos_y / dist2) * f_y * light_path.weight[y];
+
+			// each end of the connection, as seen from the other path
+			int n = s + t;
+			rev[z] = to_area_pdf(pdf_y, light_path.pos[y], cam.pos[z], cam.normal[z]);
+			rev[z - 1] = to_area_pdf(pdf_z_rev, cam.pos[z], cam.pos[z - 1], cam.normal[z - 1]);
+			fwd[t] = to_area_pdf(guided_pdf(cam.pos[z], pdf_z, dir), cam.pos[z], light_path.pos[y], light_path.normal[y]);
+			fwd[t + 1] = to_area_pdf(guided_pdf(light_path.pos[y], pdf_y_rev, light_path.wo[y]),
+				light_path.pos[y], light_path.pos[y - 1], light_path.normal[y - 1]);
+			rev[t] = light_path.pdf_fwd[y];
+			rev[t + 1] = light_path.pdf_fwd[y - 1];
+			for (int j = y - 2; j >= 0; --j)
+			{
+				fwd[n - 1 - j] = light_path.pdf_rev[j];
+				rev[n - 1 - j] = light_path.pdf_fwd[j];
+			}
+			const light_triangle& lt = light_triangles[light];
+			float select = light_selection.pdf(options.lights, light_path.pos[1], light_path.normal[1], light) / lt.area;
+
+			float w = mis_weight(fwd, rev, select, n, t);
+			if (max_value(value) * w > 0 && !occluded(cam.pos[z], dir, sqrt(dist2) - 0.01f))
+			{
+				result += value * w;
+				arrived[z] += value * w;
+			}
+		}
+	}
+
+	if (options.guide && guide.learning)
+		record_guide(cam, arrived);
+	return result;
 }
 
-int main()
+// camera ray through a jittered position in pixel (x, y)
+void camera_ray(int x, int y, vec3& o, vec3& ray)
 {
-	RTCDevice device = rtcNewDevice(NULL);
-	scene = rtcDeviceNewScene(device, RTC_SCENE_STATIC, RTC_INTERSECT1);
+	const camera_settings& c = scene_camera;
+	vec2 jitter = nrand2();
+	ray = c.forward + c.right * ((x + jitter.x - IMAGE_WIDTH / 2) / IMAGE_WIDTH) + c.up * ((y + jitter.y - IMAGE_HEIGHT / 2) / IMAGE_HEIGHT);
+	ray = normalize(ray);
+	o = c.position;
+}
 
-	addObj(scene, "models/GP.obj", vec3(0, 0, 0));
+// sample number sample_index of pixel (x, y), in XYZ
+vec3 render_sample(int x, int y, int sample_index, sample_features& features)
+{
+	path_sampler.start_sample(options.sampler, x, y, sample_index);
 
-	rtcCommit(scene);
-	
-	for (int i = 0; i < NUM_SAMPLES; ++i)
+	vec3 o, ray;
+	camera_ray(x, y, o, ray);
+	spectrum lambda = sample_wavelengths(nrand());
+
+	spectrum cur_radiance = options.integrator == INTEGRATOR_BDPT ?
+		bdpt_radiance(lambda, o, ray, features) : radiance(lambda, o, ray, features);
+	cur_radiance *= wavelength_weights(lambda);
+	return wavelength_to_xyz(lambda, cur_radiance);
+}
+
+void render_tile(const tile& t, int sample_index, film& image)
+{
+	for (int y = t.y0; y < t.y1; ++y)
 	{
-		if (i % 10 == 0)
-			printf("Iteration %d\n", i);
-		
-		for (int x = 0; x < IMAGE_WIDTH; ++x)
+		for (int x = t.x0; x < t.x1; ++x)
 		{
-			for (int y = 0; y < IMAGE_HEIGHT; ++y)
+			sample_features features;
+			vec3 xyz = render_sample(x, y, sample_index, features);
+			image.add(x, y, xyz, features);
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Wavefront rendering
+//-----------------------------------------------------------------------------
+// The path tracer of radiance() (--integrator pt), but the paths of a tile
+// advance one bounce at a time, and every generation of rays (camera,
+// bounce, shadow) is traced as one batch, through the packet or stream API
+// with Embree. Each path keeps its own sampler, so it draws the same numbers
+// it would in render_sample(), and the image is that of --integrator pt.
+struct wavefront_path
+{
+	sampler smp;
+	int x, y;
+	spectrum value;
+	camera_path cp;
+	int first_connection, num_connections; // its light samples in connections
+};
+
+void render_tile_wavefront(const tile& t, int sample_index, film& image)
+{
+	thread_local vector<wavefront_path> paths;
+	thread_local ray_stream rays, next_rays;
+	thread_local vector<int> ray_path, next_ray_path; // which path each ray belongs to
+	thread_local vector<light_connection> connections;
+
+	int tile_width = t.x1 - t.x0;
+	paths.resize(tile_width * (t.y1 - t.y0));
+	rays.clear();
+	ray_path.clear();
+
+	// camera rays
+	for (int i = 0; i < (int)paths.size(); ++i)
+	{
+		wavefront_path& p = paths[i];
+		p.x = t.x0 + i % tile_width;
+		p.y = t.y0 + i / tile_width;
+
+		path_sampler.start_sample(options.sampler, p.x, p.y, sample_index);
+		vec3 o, ray;
+		camera_ray(p.x, p.y, o, ray);
+		start_camera_path(sample_wavelengths(nrand()), o, ray, p.cp);
+		p.smp = path_sampler;
+
+		rays.add(o, ray, MAX_DIST);
+		ray_path.push_back(i);
+	}
+
+	// bounces, until every path has terminated
+	bool coherent = true;
+	while (rays.size() > 0)
+	{
+		{
+			STATS_TIME(trace_ticks);
+			accel->intersect_stream(rays, coherent);
+		}
+		coherent = false;
+
+		next_rays.clear();
+		next_ray_path.clear();
+		for (int r = 0; r < rays.size(); ++r)
+		{
+			wavefront_path& p = paths[ray_path[r]];
+			intersection_info info;
+			get_intersection_info(rays, r, &info);
+
+			std::swap(path_sampler, p.smp);
+			if (extend_camera_path(p.cp, info))
 			{
-				vec3 ray = vec3((float)(x - IMAGE_WIDTH / 2) / IMAGE_WIDTH, (float)(y - IMAGE_HEIGHT / 2) / IMAGE_HEIGHT, -1.0);
-				ray = normalize(ray);
-				vec3 o = vec3(0, 1, 2.9);
+				next_rays.add(p.cp.o, p.cp.ray, MAX_DIST);
+				next_ray_path.push_back(ray_path[r]);
+			}
+			std::swap(path_sampler, p.smp);
+		}
+
+		std::swap(rays, next_rays);
+		std::swap(ray_path, next_ray_path);
+	}
+
+	// light samples, with all shadow rays in one batch
+	rays.clear();
+	connections.clear();
+	for (int i = 0; i < (int)paths.size(); ++i)
+	{
+		wavefront_path& p = paths[i];
+		p.first_connection = (int)connections.size();
+		std::swap(path_sampler, p.smp);
+		p.value = finish_camera_path(p.cp, connections);
+		std::swap(path_sampler, p.smp);
+		p.num_connections = (int)connections.size() - p.first_connection;
+	}
+	for (const light_connection& lc : connections)
+		rays.add(lc.o, lc.dir, lc.dist);
+
+	STATS_ADD(shadow_rays, rays.size());
+	{
+		STATS_TIME(trace_ticks);
+		accel->occluded_stream(rays, false);
+	}
+
+	for (wavefront_path& p : paths)
+	{
+		thread_local spectrum arrived[MAX_PATH_VERTICES];
+		std::fill(arrived, arrived + p.cp.vertices.count, spectrum(0));
+		arrived[p.cp.vertices.count - 1] = p.value;
+		for (int r = p.first_connection; r < p.first_connection + p.num_connections; ++r)
+		{
+			if (rays.geom_id[r] != INVALID_GEOMETRY_ID)
+				continue;
+			p.value += connections[r].value;
+			arrived[connections[r].vertex] += connections[r].value;
+		}
+
+		if (options.guide && guide.learning)
+			record_guide(p.cp.vertices, arrived);
+		vec3 xyz = wavelength_to_xyz(p.cp.lambda, p.value * wavelength_weights(p.cp.lambda));
+		image.add(p.x, p.y, xyz, first_hit_features(p.cp));
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Ray tracing benchmark
+//-----------------------------------------------------------------------------
+// Camera rays for the whole image, one diffuse bounce from each of their hits,
+// and a shadow ray from each of those hits to a light sample.
+void make_benchmark_rays(ray_stream& primary, ray_stream& bounce, ray_stream& shadow)
+{
+	path_vertices light_path;
+	for (int y = 0; y < IMAGE_HEIGHT; ++y)
+	{
+		for (int x = 0; x < IMAGE_WIDTH; ++x)
+		{
+			path_sampler.start_sample(options.sampler, x, y, 0);
+			vec3 o, ray;
+			camera_ray(x, y, o, ray);
+			primary.add(o, ray, MAX_DIST);
+
+			intersection_info info;
+			get_intersection_info(o, ray, &info);
+			if (info.t < -0.1)
+				continue;
+			bounce.add(info.pos, rand_cosine_weighted_ray(info.normal), MAX_DIST);
+
+			construct_light_path(spectrum(540), info.pos, info.normal, light_path);
+			if (light_path.count == 0)
+				continue;
+			vec3 light_ray = light_path.pos[0] - info.pos;
+			shadow.add(info.pos, normalize(light_ray), length(light_ray) - 0.01f);
+		}
+	}
+}
+
+// Samples per pixel as a PNG (or PPM), from blue (fewest) through red to yellow (most)
+void write_sample_heatmap(const string& filename, const film& image)
+{
+	unsigned most = 1;
+	for (unsigned n : image.samples)
+		most = std::max(most, n);
+
+	developed_image heatmap;
+	heatmap.width = image.width;
+	heatmap.height = image.height;
+	heatmap.display.resize(3 * image.width * image.height);
+	for (int i = 0; i < image.width * image.height; ++i)
+	{
+		float t = (float)image.samples[i] / most;
+		vec3 c = t < 0.5f ?
+			mix(vec3(0, 0, 1), vec3(1, 0, 0), t * 2) :
+			mix(vec3(1, 0, 0), vec3(1, 1, 0), t * 2 - 1);
+		heatmap.display[3 * i + 0] = (uint8_t)(c.x * 255);
+		heatmap.display[3 * i + 1] = (uint8_t)(c.y * 255);
+		heatmap.display[3 * i + 2] = (uint8_t)(c.z * 255);
+	}
+	if (!write_display_image(filename, heatmap))
+		return;
+	printf("Wrote sample heatmap to %s (at most %u samples)\n", filename.c_str(), most);
+}
+
+//-----------------------------------------------------------------------------
+// Sample loop benchmark
+//-----------------------------------------------------------------------------
+// Renders passes over the whole image on this thread, the way a pool worker
+// does, and reports the speed and heap allocations per sample. The first
+// pass only warms up the per-thread buffers and isn't counted.
+void benchmark_sample_loop(int passes)
+{
+	film image(IMAGE_WIDTH, IMAGE_HEIGHT);
+	vector<tile> tiles = make_tiles(IMAGE_WIDTH, IMAGE_HEIGHT, TILE_SIZE);
+	auto render_pass = [&](int sample_index)
+	{
+		for (const tile& t : tiles)
+		{
+			if (options.trace == TRACE_SINGLE)
+				render_tile(t, sample_index, image);
+			else
+				render_tile_wavefront(t, sample_index, image);
+		}
+	};
+
+	render_pass(0);
+
+	uint64_t allocations = thread_allocations;
+	auto start = std::chrono::high_resolution_clock::now();
+	for (int i = 1; i <= passes; ++i)
+		render_pass(i);
+	double seconds = seconds_since(start);
+	allocations = thread_allocations - allocations;
+
+	double samples = (double)passes * IMAGE_WIDTH * IMAGE_HEIGHT;
+	printf("%d passes: %.3f Msamples/s, %.3f heap allocations per sample (%llu in total)\n",
+		passes, samples / seconds / 1e6, allocations / samples, (unsigned long long)allocations);
+}
+
+//-----------------------------------------------------------------------------
+// Rendering
+//-----------------------------------------------------------------------------
+// Progressive rounds of one more sample per pixel, for every tile that still
+// needs it, until a limit is reached. Each pixel's sample count, after
+// --first-sample, is its next sample index, so tiles can fall out of step.
+// Returns the number of rounds done so far, and how long this took in seconds.
+int render(thread_pool& pool, film& image, const vector<tile>& tiles, int first_round, double& seconds)
+{
+	STATS_STAGE("render");
+	auto start = std::chrono::high_resolution_clock::now();
+	auto last_checkpoint = start;
+	auto last_snapshot = start;
+	snapshot_writer snapshots;
+	vector<tile> active;
+	int i = first_round;
+	while (true)
+	{
+		active.clear();
+		for (const tile& t : tiles)
+		{
+			int n = image.sample_count(t.x0, t.y0);
+			if (options.samples > 0 && n >= options.samples)
+				continue;
+			if (options.adaptive > 0 && n >= options.min_samples && tile_error(image, t) < options.adaptive)
+				continue;
+			active.push_back(t);
+		}
+		if (active.empty())
+			break;
+
+		if (i % 10 == 0)
+			printf("Iteration %d, %d of %d tiles\n", i, (int)active.size(), (int)tiles.size());
+
+		pool.parallel_for((int)active.size(), [&](int tile_index)
+		{
+			STATS_TIME_EVENT(busy_ticks, "tile");
+			const tile& t = active[tile_index];
+			int sample_index = options.first_sample + image.sample_count(t.x0, t.y0);
+			if (options.trace == TRACE_SINGLE)
+				render_tile(t, sample_index, image);
+			else
+				render_tile_wavefront(t, sample_index, image);
+		});
+		++i;
+
+		if (options.guide && guide.learning)
+		{
+			STATS_STAGE("guiding");
+			if (guide.end_round(options.guide_training))
+				printf("Guide pass %d: %d regions, %d directional nodes%s\n", guide.passes, (int)guide.leaves.size(),
+					(int)guide.quadtree_nodes(), guide.learning ? "" : ", done learning");
+		}
+
+		if (!options.checkpoint.empty() && seconds_since(last_checkpoint) >= options.checkpoint_interval)
+		{
+			STATS_STAGE("checkpoint");
+			save_checkpoint(options.checkpoint, image, i, options.sampler, options.first_sample);
+			last_checkpoint = std::chrono::high_resolution_clock::now();
+		}
+
+		if (options.snapshot_interval > 0 && seconds_since(last_snapshot) >= options.snapshot_interval)
+		{
+			if (snapshots.write(image, options.post, options.output, options.hdr_output))
+				last_snapshot = std::chrono::high_resolution_clock::now();
+		}
+
+		if (options.time_limit > 0 && seconds_since(start) >= options.time_limit)
+			break;
+		if (options.noise_limit > 0 && image.noise() < options.noise_limit)
+			break;
+	}
+	seconds = seconds_since(start);
+	return i;
+}
+
+// the tiles of --tiles, or all of them
+vector<tile> assigned_tiles()
+{
+	vector<tile> tiles = make_tiles(IMAGE_WIDTH, IMAGE_HEIGHT, TILE_SIZE);
+	int last = options.last_tile < 0 ? (int)tiles.size() : std::min(options.last_tile, (int)tiles.size());
+	int first = std::min(options.first_tile, last);
+	return vector<tile>(tiles.begin() + first, tiles.begin() + last);
+}
+
+void write_outputs(const film& image, thread_pool& pool)
+{
+	STATS_STAGE("output");
+	developed_image developed;
+	develop(image, options.post, developed, &pool);
+	if (write_display_image(options.output, developed))
+		printf("Wrote %s\n", options.output.c_str());
+	if (!options.hdr_output.empty() && write_hdr_image(options.hdr_output, developed))
+		printf("Wrote %s\n", options.hdr_output.c_str());
+	if (!options.feature_prefix.empty() && write_feature_images(options.feature_prefix, image))
+		printf("Wrote %s.albedo/normal/depth.exr\n", options.feature_prefix.c_str());
+	if (!options.heatmap.empty())
+		write_sample_heatmap(options.heatmap, image);
+}
+
+//-----------------------------------------------------------------------------
+// Splitting a frame over processes
+//-----------------------------------------------------------------------------
+// --merge: adds up the files and writes the outputs of the sum, and saves
+// it to --checkpoint if there is one.
+int merge_renders(const vector<string>& files, thread_pool& pool)
+{
+	film image(IMAGE_WIDTH, IMAGE_HEIGHT);
+	int passes, first_sample;
+	if (!merge_checkpoints(files, image, passes, options.sampler, first_sample))
+		return 1;
+
+	double total_samples = 0;
+	for (unsigned n : image.samples)
+		total_samples += n;
+	printf("Merged %d files: %.1f samples per pixel on average, noise %f\n", (int)files.size(),
+		total_samples / image.samples.size(), image.noise());
+
+	if (!options.checkpoint.empty())
+		save_checkpoint(options.checkpoint, image, passes, options.sampler, first_sample);
+	write_outputs(image, pool);
+	return 0;
+}
+
+#ifndef _WIN32
+// --worker: renders the tiles the coordinator sends, all of --spp on this
+// thread, until it says to save them and quit.
+int run_worker()
+{
+	worker_channel channel;
+	if (!channel.open(options.worker_in, options.worker_out))
+	{
+		printf("Worker can't open its pipes\n");
+		return 1;
+	}
+
+	vector<tile> tiles = make_tiles(IMAGE_WIDTH, IMAGE_HEIGHT, TILE_SIZE);
+	film image(IMAGE_WIDTH, IMAGE_HEIGHT);
+	string line;
+	while (channel.next(line))
+	{
+		int index;
+		if (line == "quit")
+			return save_checkpoint(options.worker_part, image, options.samples, options.sampler, options.first_sample) ? 0 : 1;
+		if (sscanf(line.c_str(), "tile %d", &index) != 1 || index < 0 || index >= (int)tiles.size())
+		{
+			printf("Worker got an unknown command: %s\n", line.c_str());
+			return 1;
+		}
+
+		const tile& t = tiles[index];
+		for (int n = image.sample_count(t.x0, t.y0); n < options.samples; ++n)
+		{
+			if (options.trace == TRACE_SINGLE)
+				render_tile(t, options.first_sample + n, image);
+			else
+				render_tile_wavefront(t, options.first_sample + n, image);
+		}
+		channel.answer("done " + std::to_string(index));
+	}
+	// the coordinator is gone, so nobody wants the film
+	return 1;
+}
+#endif
+
+// --workers: starts the workers, gives each the next tile whenever it's
+// free, and merges their films once every tile is done.
+int run_coordinator(int argc, char** argv, thread_pool& pool)
+{
+#ifdef _WIN32
+	printf("--workers needs fork() and pipes, which this platform doesn't have\n");
+	return 1;
+#else
+	if (options.samples <= 0)
+	{
+		printf("--workers needs --spp, each tile is rendered to it in one go\n");
+		return 1;
+	}
+	// a worker that died shows up as a failed write instead of killing us
+	signal(SIGPIPE, SIG_IGN);
+
+	// the same command line; later options override earlier ones
+	vector<string> args(argv, argv + argc);
+	args.push_back("--threads");
+	args.push_back("1");
+
+	int first = options.first_tile;
+	int last = first + (int)assigned_tiles().size();
+	int total = last - first;
+	printf("Rendering %d tiles with %d workers\n", total, options.workers);
+
+	bool ok = true;
+	vector<worker_process> workers(options.workers);
+	vector<string> parts;
+	for (int k = 0; k < options.workers && ok; ++k)
+	{
+		string part = "albedo." + std::to_string(getpid()) + "." + std::to_string(k) + ".alb";
+		ok = start_worker(args, part, workers[k]);
+		if (!ok)
+		{
+			printf("Can't start worker %d\n", k);
+			workers.resize(k);
+			break;
+		}
+		parts.push_back(part);
+	}
+
+	int next = first;
+	int done = 0;
+	for (worker_process& w : workers)
+	{
+		if (!ok || next >= last)
+			break;
+		w.tile = next++;
+		ok = send_to_worker(w, "tile " + std::to_string(w.tile));
+	}
+	auto start = std::chrono::high_resolution_clock::now();
+	while (ok && done < total)
+	{
+		string line;
+		int k = wait_for_worker(workers, line);
+		int index;
+		if (k < 0 || sscanf(line.c_str(), "done %d", &index) != 1 || index != workers[k].tile)
+		{
+			printf("A worker stopped before it was done\n");
+			ok = false;
+			break;
+		}
+		done++;
+		if (done % 50 == 0 || done == total)
+			printf("%d of %d tiles after %.1f s\n", done, total, seconds_since(start));
+
+		workers[k].tile = -1;
+		if (next < last)
+		{
+			workers[k].tile = next++;
+			ok = send_to_worker(workers[k], "tile " + std::to_string(workers[k].tile));
+		}
+	}
 
-#if 0
-				float lambda = nrand() * 440 + 390;
-				float lambda_prob = 1.0 / 440.0;
+	for (worker_process& w : workers)
+		ok = finish_worker(w) && ok;
+	int result = 1;
+	if (ok)
+		result = merge_renders(parts, pool);
+	else
+		printf("Giving up, a worker failed\n");
+	for (const string& part : parts)
+		remove(part.c_str());
+	return result;
+#endif
+}
+
+accelerator* create_accelerator(accel_type type)
+{
+#ifndef ALBEDO_NO_EMBREE
+	if (type == ACCEL_EMBREE)
+		return new embree_accelerator(options.trace, options.packet_width);
 #else
-				// less efficient, but lower variance
-				intersection_info info;
-				get_intersection_info(o, ray, &info);
-				if (info.t < -0.1)
-					continue;
-				
-				// generate random lambda according to diffuse response
-				float lambda = 0;
-				material mat = info.mat;
-				do
-				{
-					lambda = gaussian_rand(mat.diffuse_mean, mat.diffuse_stddev);
-				} while (lambda < 390 || 830 < lambda);
-				float scale = cdf_gaussian(830, mat.diffuse_mean, mat.diffuse_stddev) - 
-					cdf_gaussian(390, mat.diffuse_mean, mat.diffuse_stddev);
-				float lambda_prob = pdf_gaussian(lambda, mat.diffuse_mean, mat.diffuse_stddev) / scale;
+	(void)type;
 #endif
+	return new bvh_accelerator(options.geometry);
+}
 
-				float cur_radiance = radiance(lambda, o, ray) / lambda_prob;
-				buffer[x][y] += cur_radiance * wavelength_to_xyz(lambda) / (float)NUM_SAMPLES;
-			}
+//-----------------------------------------------------------------------------
+// Render benchmark
+//-----------------------------------------------------------------------------
+const int BENCH_SAMPLES = 16;
+const int BENCH_REFERENCE_SAMPLES = 256;
+
+// of two 8 bit images, in [0, 1]
+float rmse(const vector<uint8_t>& a, const vector<uint8_t>& b)
+{
+	double sum = 0;
+	for (size_t i = 0; i < a.size(); ++i)
+	{
+		double d = ((int)a[i] - (int)b[i]) / 255.0;
+		sum += d * d;
+	}
+	return (float)sqrt(sum / a.size());
+}
+
+// Renders every bench scene with the same settings whatever the command line
+// said, the sampler and integrator aside, and reports how fast that went and
+// how far it is off the scene's reference image. Returns false if any scene
+// is further off than it should be. With write_references it renders the
+// references instead, with many more samples.
+bool benchmark_render(thread_pool& pool, bool write_references)
+{
+	options.samples = write_references ? BENCH_REFERENCE_SAMPLES : BENCH_SAMPLES;
+	options.time_limit = 0;
+	options.noise_limit = 0;
+	options.adaptive = 0;
+	options.checkpoint.clear();
+	vector<tile> tiles = make_tiles(IMAGE_WIDTH, IMAGE_HEIGHT, TILE_SIZE);
+
+	bool ok = true;
+	for (const bench_scene& scene : bench_scenes)
+	{
+		delete accel;
+		accel = create_accelerator(options.accel);
+		clear_models();
+		scene_camera = camera_settings();
+
+		auto start = std::chrono::high_resolution_clock::now();
+		scene.build(*accel, pool, options.mesh_cache);
+		accel->commit();
+		double load_seconds = seconds_since(start);
+
+		// the same look whatever the display defaults are
+		post_settings look;
+		look.exposure = 0;
+		look.tonemap = TONEMAP_REINHARD;
+		look.srgb = false;
+		string reference = string("bench/") + scene.name + ".ppm";
+		vector<uint8_t> expected;
+		bool have_reference = !write_references && read_ppm(reference, IMAGE_WIDTH, IMAGE_HEIGHT, expected);
+
+		// An eighth of the samples and the denoiser first, for how close that
+		// gets, then on to all of them. The samplers count from where they
+		// left off, so the full image is the same as rendering it in one go.
+		film image(IMAGE_WIDTH, IMAGE_HEIGHT);
+		thread_stats before = stats_total();
+		double seconds = 0, denoised_error = -1;
+		int rounds = 0;
+		developed_image developed;
+		if (have_reference)
+		{
+			options.samples = BENCH_SAMPLES / 8;
+			rounds = render(pool, image, tiles, 0, seconds);
+			post_settings denoised_look = look;
+			denoised_look.denoise = true;
+			develop(image, denoised_look, developed, &pool);
+			denoised_error = rmse(developed.display, expected);
+			options.samples = BENCH_SAMPLES;
+		}
+		double more_seconds;
+		render(pool, image, tiles, rounds, more_seconds);
+		seconds += more_seconds;
+		uint64_t rays = stats_total().rays() - before.rays();
+		develop(image, look, developed, &pool);
+
+		if (write_references)
+		{
+			write_display_image(reference, developed);
+			printf("Wrote %s\n", reference.c_str());
+			continue;
+		}
+
+		printf("%s: load %.2f s, render %.2f s, %.3f Msamples/s", scene.name, load_seconds, seconds,
+			(double)IMAGE_WIDTH * IMAGE_HEIGHT * options.samples / seconds / 1e6);
+		if (rays > 0)
+			printf(", %.2f Mrays/s", rays / seconds / 1e6);
+
+		if (!have_reference)
+		{
+			printf(", can't read reference %s\n", reference.c_str());
+			ok = false;
+			continue;
 		}
+		float error = rmse(developed.display, expected);
+		bool pass = error <= scene.max_rmse;
+		printf(", RMSE %.4f (at most %.4f) %s; denoised at %d spp %.4f\n", error, scene.max_rmse, pass ? "ok" : "FAILED",
+			BENCH_SAMPLES / 8, denoised_error);
+		ok = ok && pass;
+	}
+	return ok;
+}
+
+//-----------------------------------------------------------------------------
+// Guiding benchmark
+//-----------------------------------------------------------------------------
+// Renders the indirect scene for the same time with BRDF sampling alone and
+// with the path guide, and compares how noisy each is.
+// The guide learns over the first training rounds, which stay in the image.
+void benchmark_guiding(thread_pool& pool, float seconds)
+{
+	options.samples = 0;
+	options.time_limit = seconds;
+	options.noise_limit = 0;
+	options.adaptive = 0;
+	options.checkpoint.clear();
+	options.snapshot_interval = 0;
+	vector<tile> tiles = make_tiles(IMAGE_WIDTH, IMAGE_HEIGHT, TILE_SIZE);
+
+	delete accel;
+	accel = create_accelerator(options.accel);
+	clear_models();
+	scene_camera = camera_settings();
+	build_indirect_scene(*accel, pool, options.mesh_cache);
+	accel->commit();
+	vec3 lo, hi;
+	accel->scene_bounds(lo, hi);
+
+	float noise[2];
+	for (int guided = 0; guided < 2; ++guided)
+	{
+		options.guide = guided != 0;
+		if (options.guide)
+			guide.init(lo, hi);
+
+		film image(IMAGE_WIDTH, IMAGE_HEIGHT);
+		double render_seconds;
+		int rounds = render(pool, image, tiles, 0, render_seconds);
+		noise[guided] = image.noise();
+		const char* name = guided ? "guided" : "brdf";
+		printf("%s: %d spp in %.1f s, noise %f\n", name, rounds, render_seconds, noise[guided]);
+
+		developed_image developed;
+		develop(image, options.post, developed, &pool);
+		string filename = string("guiding_") + name + ".png";
+		if (write_display_image(filename, developed))
+			printf("Wrote %s\n", filename.c_str());
+	}
+	printf("Variance at equal time, BRDF sampling over guided: %.2f\n", noise[0] * noise[0] / (noise[1] * noise[1]));
+}
+
+int main(int argc, char** argv)
+{
+	options = parse_options(argc, argv);
+	init_sobol_directions();
+
+	thread_pool pool(options.num_threads);
+
+	if (options.bench_load)
+	{
+		benchmark_obj_loaders("models/GP.obj", pool);
+		return 0;
+	}
+
+	if (!options.merge.empty())
+		return merge_renders(options.merge, pool);
+	if (options.workers > 0 && options.worker_in < 0)
+		return run_coordinator(argc, argv, pool);
+
+	if (options.bench_guiding > 0)
+	{
+		benchmark_guiding(pool, options.bench_guiding);
+		delete accel;
+		return 0;
+	}
+
+	if (options.bench_render || options.bench_references)
+	{
+		bool ok = benchmark_render(pool, options.bench_references);
+		delete accel;
+		return ok ? 0 : 1;
 	}
 
-	// World's worst tonemapping
-	for (int x = 0; x < IMAGE_WIDTH; ++x)
+	accel = create_accelerator(options.accel);
+
+	all_stats.timeline = !options.timeline.empty();
 	{
-		for (int y = 0; y < IMAGE_HEIGHT; ++y)
+		STATS_STAGE("scene load");
+		if (options.scene.empty())
+			addObj(*accel, pool, "models/GP.obj", vec3(0, 0, 0), 1, options.mesh_cache);
+		else if (!load_scene(*accel, pool, options.scene, IMAGE_WIDTH, IMAGE_HEIGHT))
 		{
-			buffer[x][y] = xyz_to_rgb(buffer[x][y]);
-			buffer[x][y] /= buffer[x][y] + vec3(1, 1, 1);
+			delete accel;
+			return 1;
 		}
 	}
+	{
+		STATS_STAGE("commit");
+		accel->commit();
+	}
+	printf("Scene ready, peak memory %.1f MB\n", peak_memory() / (1024.0 * 1024.0));
+	if (options.guide && options.worker_in >= 0)
+	{
+		printf("Workers render without --guide, it learns from whole rounds of the image\n");
+		options.guide = false;
+	}
+	if (options.guide)
+	{
+		vec3 lo, hi;
+		accel->scene_bounds(lo, hi);
+		guide.init(lo, hi);
+	}
 
-	// PPM file
-	ofstream file("image.ppm");
-	file << "P3 " << IMAGE_WIDTH << " " << IMAGE_HEIGHT << " 255" << endl;
+	if (options.bench_paths)
+	{
+		benchmark_sample_loop(4);
+		delete accel;
+		return 0;
+	}
 
-	for (int y = IMAGE_HEIGHT - 1; y >= 0; --y)
+	if (options.bench_trace)
 	{
-		for (int x = 0; x < IMAGE_WIDTH; ++x)
+		ray_stream primary, bounce, shadow;
+		make_benchmark_rays(primary, bounce, shadow);
+		benchmark_accelerators("models/GP.obj", primary, bounce, shadow);
+		delete accel;
+		return 0;
+	}
+
+#ifndef _WIN32
+	if (options.worker_in >= 0)
+	{
+		int result = run_worker();
+		delete accel;
+		return result;
+	}
+#endif
+
+	printf("Rendering with %d threads\n", pool.size());
+
+	film image(IMAGE_WIDTH, IMAGE_HEIGHT);
+	vector<tile> tiles = assigned_tiles();
+
+	int first_round = 0;
+	if (!options.resume.empty())
+	{
+		first_round = load_checkpoint(options.resume, image, options.sampler, options.first_sample);
+		if (first_round < 0)
 		{
-			if ((int)(buffer[x][y].x * 255) == 0x80000000 ||
-				(int)(buffer[x][y].y * 255) == 0x80000000 ||
-				(int)(buffer[x][y].z * 255) == 0x80000000)
-			{
-				//cout << "a divide by zero happened" << endl;
-				/*for (int i = 0; i < 50; ++i)
-				file << "\n";*/
-				file << 0 << " " << 0 << " " << 0 << " ";
-			}
-			else
-				file << (int)(buffer[x][y].x * 255) << " " << (int)(buffer[x][y].y * 255) << " " << (int)(buffer[x][y].z * 255) << " ";
+			delete accel;
+			return 1;
 		}
+		printf("Resuming %s after %d rounds\n", options.resume.c_str(), first_round);
 	}
 
-	file.close();
+	double render_seconds;
+	int rounds = render(pool, image, tiles, first_round, render_seconds);
+	double total_samples = 0;
+	for (unsigned n : image.samples)
+		total_samples += n;
+	printf("%.1f samples per pixel on average, noise %f\n", total_samples / image.samples.size(), image.noise());
+
+	if (!options.checkpoint.empty())
+	{
+		STATS_STAGE("checkpoint");
+		save_checkpoint(options.checkpoint, image, rounds, options.sampler, options.first_sample);
+	}
+
+	write_outputs(image, pool);
+
+	print_stats_summary(render_seconds);
+	if (!options.timeline.empty())
+		write_timeline(options.timeline);
+
+	delete accel;
 
 	printf("Finished\n");
 }
\ No newline at end of file
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <math.h>
+#include <algorithm>
+
+#include "rgb_spectrum.h"
+
+// how a surface scatters light, see bsdf.h for all but diffuse
+enum bsdf_type
+{
+	BSDF_DIFFUSE,    // Lambertian
+	BSDF_CONDUCTOR,  // GGX reflection tinted by the specular color, a metal
+	BSDF_DIELECTRIC, // GGX reflection off a clear coat over the diffuse reflectance
+};
+
+struct material
+{
+	float light_intensity = 0; // scale of the emission spectrum
+	rgb_spectrum emission;
+	rgb_spectrum reflectance;
+	vec3 albedo = vec3(1); // linear sRGB of the reflectance, for the denoiser
+
+	bsdf_type type = BSDF_DIFFUSE;
+	rgb_spectrum specular; // a conductor's reflectance head on, a scale on a dielectric's
+	float roughness = 1; // GGX alpha
+	float ior = 1.5f; // of a dielectric's coat
+};
+
+// Sets the reflection of an .mtl's Ks, Ns and Ni (or a scene file's) on a
+// material with diffuse color kd. Without Ks it stays diffuse, without kd
+// it's a conductor, and with both a dielectric. The Phong exponent Ns maps
+// to the roughness of a similar highlight (Walter et al. 2007), and an Ni of
+// 1 or less, which is what exporters write when there isn't one, to 1.5.
+void set_specular(material& m, vec3 kd, vec3 ks, float ns, float ni)
+{
+	float s = std::max(ks.x, std::max(ks.y, ks.z));
+	if (s < 0.01f)
+	{
+		m.type = BSDF_DIFFUSE;
+		return;
+	}
+	float d = std::max(kd.x, std::max(kd.y, kd.z));
+	m.type = d < 0.01f ? BSDF_CONDUCTOR : BSDF_DIELECTRIC;
+	m.specular = fit_rgb_spectrum(ks);
+	m.roughness = std::max(0.01f, sqrt(2 / (std::max(0.f, ns) + 2)));
+	m.ior = ni > 1 ? ni : 1.5f;
+}
+
+// what the denoiser takes for the color of the surface
+vec3 material_albedo(const material& m)
+{
+	return reflectance_to_rgb(m.type == BSDF_CONDUCTOR ? m.specular : m.reflectance);
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <memory>
+#include <vector>
+using std::vector;
+
+// The meshes of a file the way the accelerators read them, back to back in
+// one block: 4 floats per vertex (the last one 0), 16 byte aligned, and 3
+// indices per triangle. The loader writes them here as it indexes the
+// faces, and the block goes to accelerator::add_shared_mesh() as it is, so
+// there's no second copy. A mesh cache is this block with a header in front.
+
+// where one mesh is in a mesh_buffer
+struct mesh_span
+{
+	uint32_t num_vertices;
+	uint32_t num_triangles;
+	uint64_t vertex_offset; // bytes from the start of the block
+	uint64_t index_offset;
+};
+
+struct mesh_buffer
+{
+	vector<mesh_span> meshes;
+	char* data = nullptr; // 16 byte aligned
+	size_t size = 0;
+	void* block = nullptr;
+
+	mesh_buffer() {}
+	mesh_buffer(const mesh_buffer&) = delete;
+	mesh_buffer& operator=(const mesh_buffer&) = delete;
+	~mesh_buffer()
+	{
+		free(block);
+	}
+
+	// Lays out meshes of these sizes and allocates the block, with only the
+	// padding written. False if there isn't the memory.
+	bool allocate(const vector<uint32_t>& num_vertices, const vector<uint32_t>& num_triangles)
+	{
+		free(block);
+		meshes.resize(num_vertices.size());
+		uint64_t offset = 0;
+		for (size_t i = 0; i < meshes.size(); ++i)
+		{
+			meshes[i].num_vertices = num_vertices[i];
+			meshes[i].num_triangles = num_triangles[i];
+			meshes[i].vertex_offset = offset;
+			offset += (uint64_t)num_vertices[i] * 4 * sizeof(float);
+			meshes[i].index_offset = offset;
+			offset += (uint64_t)num_triangles[i] * 3 * sizeof(unsigned int);
+			offset = (offset + 15) & ~15ull;
+		}
+		size = (size_t)offset;
+
+		// malloc hands large blocks out as fresh pages, which only take
+		// memory once they're written
+		block = malloc(size + 15);
+		if (!block)
+		{
+			meshes.clear();
+			data = nullptr;
+			size = 0;
+			return false;
+		}
+		data = (char*)(((uintptr_t)block + 15) & ~(uintptr_t)15);
+		for (const mesh_span& m : meshes)
+		{
+			size_t end = (size_t)(m.index_offset + (uint64_t)m.num_triangles * 3 * sizeof(unsigned int));
+			memset(data + end, 0, ((end + 15) & ~(size_t)15) - end);
+		}
+		return true;
+	}
+
+	float* vertices(size_t mesh)
+	{
+		return (float*)(data + meshes[mesh].vertex_offset);
+	}
+	unsigned int* indices(size_t mesh)
+	{
+		return (unsigned int*)(data + meshes[mesh].index_offset);
+	}
+};
+
+// blocks the accelerator is tracing, see accelerator::traces_shared_meshes()
+vector<std::unique_ptr<mesh_buffer>> shared_mesh_buffers;
@@ -0,0 +1,225 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <memory>
+#include <string>
+#include <vector>
+using std::string;
+using std::vector;
+
+#include "file.h"
+#include "lights.h"
+#include "material.h"
+#include "mesh_buffer.h"
+
+// Binary copy of what addObj() makes of an .obj file, next to it as
+// <file>.cache. It is mapped straight into memory on later runs, and the
+// vertex and index arrays are the loader's mesh_buffer as it was, so the
+// meshes go to the accelerator without parsing or copying. A cache is only
+// used for the same source size, mtime and transform, and the same sizes
+// and mtimes of the .mtl files it read, whose names it keeps.
+struct mesh_cache_key
+{
+	uint64_t source_size;
+	int64_t source_mtime;
+	float origin[3];
+	float scale;
+	uint64_t mtl_stamp; // hash of the .mtl files' names, sizes and mtimes
+};
+
+struct mesh_cache_header
+{
+	char magic[4]; // "ALBM"
+	uint32_t version;
+	mesh_cache_key key;
+	uint32_t num_meshes;
+	uint32_t num_lights;
+	uint32_t mtl_names_size; // bytes of the .mtl names, each ending in '\0'
+	uint64_t file_size;
+};
+
+struct mesh_cache_entry
+{
+	material mat;
+	uint32_t num_vertices;
+	uint32_t num_triangles;
+	uint64_t vertex_offset; // 4 floats per vertex, 16 byte aligned
+	uint64_t index_offset;  // 3 indices per triangle
+};
+
+// followed by the entries, then the light triangles (model_id counts from
+// the file's first mesh), the .mtl names, then the vertex and index arrays
+const uint32_t MESH_CACHE_VERSION = 5;
+
+// The key of source without its .mtl files, see stamp_mtl_files()
+bool make_mesh_cache_key(const string& source, vec3 origin, float scale, mesh_cache_key& key)
+{
+	memset(&key, 0, sizeof(key));
+	if (!file_stamp(source, key.source_size, key.source_mtime))
+		return false;
+	key.origin[0] = origin.x;
+	key.origin[1] = origin.y;
+	key.origin[2] = origin.z;
+	key.scale = scale;
+	return true;
+}
+
+// FNV-1a over the names, sizes and mtimes of the .mtl files, in
+// mtl_basepath. A missing file counts too, as a size of -1.
+uint64_t stamp_mtl_files(const string& mtl_basepath, const vector<string>& names)
+{
+	uint64_t hash = 14695981039346656037ull;
+	auto add = [&](const void* data, size_t size)
+	{
+		for (size_t i = 0; i < size; ++i)
+			hash = (hash ^ ((const unsigned char*)data)[i]) * 1099511628211ull;
+	};
+	for (const string& name : names)
+	{
+		uint64_t size = ~0ull;
+		int64_t mtime = 0;
+		file_stamp(mtl_basepath + name, size, mtime);
+		add(name.c_str(), name.size() + 1);
+		add(&size, sizeof(size));
+		add(&mtime, sizeof(mtime));
+	}
+	return hash;
+}
+
+// An opened cache file. Its buffers are shared with the accelerator, so it
+// has to stay open for as long as that is used.
+struct mesh_cache
+{
+	mapped_file file;
+	const mesh_cache_header* header = nullptr;
+	const mesh_cache_entry* entries = nullptr;
+	const light_triangle* lights = nullptr;
+
+	// False unless filename is a cache for key, with the .mtl files in
+	// mtl_basepath as they were, and everything in it is within the file.
+	bool open(const string& filename, const mesh_cache_key& key, const string& mtl_basepath)
+	{
+		if (!file.open(filename))
+			return false;
+		if (!check(key, mtl_basepath))
+		{
+			file.close();
+			return false;
+		}
+		return true;
+	}
+
+	bool check(mesh_cache_key key, const string& mtl_basepath)
+	{
+		if (file.size < sizeof(mesh_cache_header))
+			return false;
+		header = (const mesh_cache_header*)file.data;
+		if (memcmp(header->magic, "ALBM", 4) != 0 || header->version != MESH_CACHE_VERSION ||
+			header->file_size != file.size)
+			return false;
+
+		uint64_t names = sizeof(mesh_cache_header) + (uint64_t)header->num_meshes * sizeof(mesh_cache_entry) +
+			(uint64_t)header->num_lights * sizeof(light_triangle);
+		uint64_t arrays = names + header->mtl_names_size;
+		if (arrays > file.size || (header->mtl_names_size > 0 && file.data[arrays - 1] != '\0'))
+			return false;
+
+		vector<string> mtl_files;
+		for (const char* p = file.data + names; p < file.data + arrays; p += strlen(p) + 1)
+			mtl_files.push_back(p);
+		key.mtl_stamp = stamp_mtl_files(mtl_basepath, mtl_files);
+		if (memcmp(&header->key, &key, sizeof(key)) != 0)
+			return false;
+
+		entries = (const mesh_cache_entry*)(header + 1);
+		lights = (const light_triangle*)(entries + header->num_meshes);
+		for (uint32_t i = 0; i < header->num_meshes; ++i)
+		{
+			const mesh_cache_entry& e = entries[i];
+			if (e.vertex_offset % 16 != 0 || e.index_offset % 4 != 0 ||
+				e.vertex_offset < arrays || e.index_offset < arrays ||
+				e.vertex_offset > file.size || (file.size - e.vertex_offset) / (4 * sizeof(float)) < e.num_vertices ||
+				e.index_offset > file.size || (file.size - e.index_offset) / (3 * sizeof(unsigned int)) < e.num_triangles)
+				return false;
+		}
+		for (uint32_t i = 0; i < header->num_lights; ++i)
+		{
+			if (lights[i].model_id < 0 || lights[i].model_id >= (int)header->num_meshes)
+				return false;
+		}
+		return true;
+	}
+
+	const float* vertices(int mesh) const
+	{
+		return (const float*)(file.data + entries[mesh].vertex_offset);
+	}
+	const unsigned int* indices(int mesh) const
+	{
+		return (const unsigned int*)(file.data + entries[mesh].index_offset);
+	}
+};
+
+// caches whose meshes the accelerator is tracing, see
+// accelerator::traces_shared_meshes()
+vector<std::unique_ptr<mesh_cache>> open_mesh_caches;
+
+// The meshes of buffer with their materials mats, and the lights addObj()
+// made of them, from the .mtl files mtl_files in mtl_basepath. The arrays go
+// out as they are, after the header.
+bool write_mesh_cache(const string& filename, const mesh_cache_key& key, const mesh_buffer& buffer,
+	const vector<material>& mats, const vector<light_triangle>& lights,
+	const string& mtl_basepath, const vector<string>& mtl_files)
+{
+	string names;
+	for (const string& name : mtl_files)
+		names.append(name.c_str(), name.size() + 1);
+
+	mesh_cache_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, "ALBM", 4);
+	h.version = MESH_CACHE_VERSION;
+	h.key = key;
+	h.key.mtl_stamp = stamp_mtl_files(mtl_basepath, mtl_files);
+	h.num_meshes = (uint32_t)buffer.meshes.size();
+	h.num_lights = (uint32_t)lights.size();
+	h.mtl_names_size = (uint32_t)names.size();
+
+	vector<mesh_cache_entry> entries(buffer.meshes.size());
+	uint64_t tables = sizeof(h) + entries.size() * sizeof(mesh_cache_entry) + lights.size() * sizeof(light_triangle) + names.size();
+	uint64_t arrays = (tables + 15) & ~15ull;
+	for (size_t i = 0; i < entries.size(); ++i)
+	{
+		const mesh_span& m = buffer.meshes[i];
+		entries[i].mat = mats[i];
+		entries[i].num_vertices = m.num_vertices;
+		entries[i].num_triangles = m.num_triangles;
+		entries[i].vertex_offset = arrays + m.vertex_offset;
+		entries[i].index_offset = arrays + m.index_offset;
+	}
+	h.file_size = arrays + buffer.size;
+
+	string tmp = filename + ".tmp";
+	FILE* f = fopen(tmp.c_str(), "wb");
+	if (!f)
+		return false;
+
+	const char zeros[16] = {};
+	size_t padding = (size_t)(arrays - tables);
+	bool ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+		fwrite(entries.data(), sizeof(mesh_cache_entry), entries.size(), f) == entries.size() &&
+		fwrite(lights.data(), sizeof(light_triangle), lights.size(), f) == lights.size() &&
+		fwrite(names.data(), 1, names.size(), f) == names.size() &&
+		fwrite(zeros, 1, padding, f) == padding &&
+		fwrite(buffer.data, 1, buffer.size, f) == buffer.size;
+	ok = fclose(f) == 0 && ok;
+
+	if (!ok)
+	{
+		remove(tmp.c_str());
+		return false;
+	}
+	return replace_file(tmp, filename);
+}
@@ -10,27 +10,17 @@ using namespace glm;
 
 #include "tiny_obj_loader.h"
 
-#include <embree2\rtcore.h>
-#include <embree2\rtcore_ray.h>
+#include "CIE.h"
+#include "accelerator.h"
+#include "lights.h"
+#include "material.h"
+#include "mesh_buffer.h"
+#include "mesh_cache.h"
+#include "obj_parser.h"
+#include "thread_pool.h"
 
 using namespace tinyobj;
 
-struct embVert
-{
-	float x, y, z, a;
-};
-struct embTriangle
-{
-	int v0, v1, v2;
-};
-
-struct material
-{
-	float light_intensity = 0;
-	float diffuse_albedo = 1.f;
-	float diffuse_mean = 540;
-	float diffuse_stddev = 40;
-};
 struct model
 {
 	material mat;
@@ -38,109 +28,255 @@ struct model
 };
 vector<model> models;
 
-struct light_triangle
+// The model of every top level geometry id the accelerator handed out. For
+// an instance it's the model of the first mesh of its prototype; the
+// instance's models for the rest follow in order.
+vector<int> geometry_models;
+
+void set_geometry_model(unsigned int geom_id, int model)
 {
-	vec3 p0, p1, p2;
-	float area;
-	int model_id;
-};
-vector<light_triangle> light_triangles;
-float total_light_area = 0.f;
+	if (geom_id >= geometry_models.size())
+		geometry_models.resize(geom_id + 1, -1);
+	geometry_models[geom_id] = model;
+}
+
+// the model a ray hit, from what the accelerator reported
+inline int hit_model(unsigned int geom_id, unsigned int inst_id)
+{
+	if (inst_id == INVALID_GEOMETRY_ID)
+		return geometry_models[geom_id];
+	return geometry_models[inst_id] + geom_id;
+}
+
+// Also lets go of the meshes the accelerator was tracing, so only call it
+// once that's gone.
+void clear_models()
+{
+	models.clear();
+	geometry_models.clear();
+	light_triangles.clear();
+	shared_mesh_buffers.clear();
+	open_mesh_caches.clear();
+}
+
+// Rebuilds what lights are picked by: the light selection tables, and the
+// distribution hero wavelengths are drawn from. That one follows the lights'
+// emission spectra, weighted by their power and by how much the eye sees of
+// each wavelength, mixed with a little of uniform so every wavelength can
+// still come up.
+void update_light_sampling()
+{
+	light_selection.build(light_triangles);
+
+	vector<float> model_power(models.size(), 0.f);
+	for (const light_triangle& t : light_triangles)
+		model_power[t.model_id] += t.power;
+
+	float weights[WAVELENGTH_BINS] = {};
+	const float bin_width = (LAMBDA_MAX - LAMBDA_MIN) / WAVELENGTH_BINS;
+	float total = 0;
+	for (int i = 0; i < (int)models.size(); ++i)
+	{
+		if (model_power[i] <= 0)
+			continue;
+		for (int b = 0; b < WAVELENGTH_BINS; ++b)
+		{
+			float lambda = LAMBDA_MIN + (b + 0.5f) * bin_width;
+			vec3 cmf = wavelength_to_xyz(lambda);
+			float w = model_power[i] * models[i].mat.emission.eval(lambda) * (cmf.x + cmf.y + cmf.z);
+			weights[b] += w;
+			total += w;
+		}
+	}
+	if (total <= 0)
+	{
+		hero_wavelengths = wavelength_distribution();
+		return;
+	}
+	for (int b = 0; b < WAVELENGTH_BINS; ++b)
+		weights[b] = 0.9f * weights[b] / total + 0.1f / WAVELENGTH_BINS;
+	hero_wavelengths.build(weights);
+}
+
+// If mat emits, adds the mesh's triangles, moved by transform, to the lights
+// as model model_id's. vertices has stride floats per vertex. They go in
+// order, so light_selection can find them by triangle.
+void add_model_lights(const float* vertices, int stride, const unsigned int* indices, size_t num_triangles,
+	const material& mat, int model_id, const mat4& transform = mat4(1))
+{
+	if (mat.light_intensity <= 0)
+		return;
+
+	auto position = [&](unsigned int v)
+	{
+		const float* p = vertices + (size_t)stride * v;
+		return vec3(transform * vec4(p[0], p[1], p[2], 1));
+	};
+	for (size_t i = 0; i < num_triangles; ++i)
+	{
+		light_triangle t;
+		t.p0 = position(indices[3 * i + 0]);
+		t.p1 = position(indices[3 * i + 1]);
+		t.p2 = position(indices[3 * i + 2]);
+		t.area = length(cross(t.p1 - t.p0, t.p2 - t.p0)) / 2.f;
+		t.power = t.area * mat.light_intensity;
+		t.model_id = model_id;
+		light_triangles.push_back(t);
+	}
+}
+
+// the model of a mesh the accelerator has as geom_id
+void add_model(unsigned int geom_id, const float* vertices, int stride, const unsigned int* indices,
+	size_t num_triangles, const material& mat)
+{
+	model cur_model;
+	cur_model.mat = mat;
+	cur_model.mat.albedo = material_albedo(mat);
+	cur_model.geom_id = geom_id;
+
+	add_model_lights(vertices, stride, indices, num_triangles, mat, (int)models.size());
+	set_geometry_model(cur_model.geom_id, (int)models.size());
+	models.push_back(cur_model);
+}
+
+// Adds a triangle mesh with one material, and its triangles to the lights if
+// the material emits. Call update_light_sampling() once the scene is done.
+void add_model(accelerator& accel, const vector<float>& positions, const vector<unsigned int>& indices, const material& mat)
+{
+	unsigned int geom_id = accel.add_mesh(positions, indices);
+	add_model(geom_id, positions.data(), 3, indices.data(), indices.size() / 3, mat);
+}
+
+// The same for a mesh of a mesh_buffer, which has to outlive the accelerator
+// if it traces it
+void add_shared_model(accelerator& accel, mesh_buffer& buffer, size_t mesh, const material& mat)
+{
+	const mesh_span& m = buffer.meshes[mesh];
+	unsigned int geom_id = accel.add_shared_mesh(buffer.vertices(mesh), m.num_vertices, buffer.indices(mesh), m.num_triangles);
+	add_model(geom_id, buffer.vertices(mesh), 4, buffer.indices(mesh), m.num_triangles, mat);
+}
 
-void addObj(RTCScene& scene, string filename, vec3 origin = vec3(), float scale = 1)
+// The spectra of every .mtl material, fitted once however many shapes use it
+vector<material> fit_obj_materials(const vector<material_t>& materials)
 {
+	vector<material> fitted(materials.size());
+	for (int m = 0; m < (int)materials.size(); ++m)
+	{
+		const float* kd = materials[m].diffuse;
+		const float* ks = materials[m].specular;
+		const float* ke = materials[m].emission;
+		float e = std::max(ke[0], std::max(ke[1], ke[2]));
+		fitted[m].reflectance = fit_rgb_spectrum(vec3(kd[0], kd[1], kd[2]));
+		set_specular(fitted[m], vec3(kd[0], kd[1], kd[2]), vec3(ks[0], ks[1], ks[2]), materials[m].shininess, materials[m].ior);
+		if (e > 0.1)
+		{
+			fitted[m].light_intensity = 3.f * e / 440.f;
+			fitted[m].emission = fit_rgb_spectrum(vec3(ke[0], ke[1], ke[2]) / e);
+		}
+	}
+	return fitted;
+}
+
+// the fitted material of .mtl material material_id, or the default one if
+// there's no such material
+material obj_material(int material_id, const vector<material>& fitted)
+{
+	if (material_id >= 0 && material_id < (int)fitted.size())
+		return fitted[material_id];
+	return material();
+}
+
+// Adds the meshes of a mesh cache made for the same source, .mtl files and
+// transform instead of parsing the .obj. Returns false if there is no such
+// cache.
+bool addCachedObj(accelerator& accel, const string& cache_file, const mesh_cache_key& key, const string& mtl_basepath)
+{
+	std::unique_ptr<mesh_cache> cache(new mesh_cache());
+	if (!cache->open(cache_file, key, mtl_basepath))
+		return false;
+
+	printf("Loaded mesh cache %s. Transferring to %s.\n", cache_file.c_str(), accel.name());
+	int first_model = (int)models.size();
+	for (uint32_t i = 0; i < cache->header->num_meshes; ++i)
+	{
+		const mesh_cache_entry& e = cache->entries[i];
+		model cur_model;
+		cur_model.mat = e.mat;
+		cur_model.geom_id = accel.add_shared_mesh(cache->vertices(i), e.num_vertices, cache->indices(i), e.num_triangles);
+		set_geometry_model(cur_model.geom_id, (int)models.size());
+		models.push_back(cur_model);
+	}
+	for (uint32_t i = 0; i < cache->header->num_lights; ++i)
+	{
+		light_triangle t = cache->lights[i];
+		t.model_id += first_model;
+		light_triangles.push_back(t);
+	}
+
+	if (accel.traces_shared_meshes())
+		open_mesh_caches.push_back(std::move(cache));
+	update_light_sampling();
+	return true;
+}
+
+// use_cache reads <filename>.cache if it's up to date, and writes it if not.
+// pool parses the file.
+void addObj(accelerator& accel, thread_pool& pool, string filename, vec3 origin = vec3(), float scale = 1, bool use_cache = true)
+{
+	string cache_file = filename + ".cache";
+	mesh_cache_key key;
+	bool have_key = use_cache && make_mesh_cache_key(filename, origin, scale, key);
+	string mtl_basepath = "models/";
+	if (have_key && addCachedObj(accel, cache_file, key, mtl_basepath))
+		return;
+
 	printf("Loading .obj file: %s\n", filename.c_str());
 	
-	vector<shape_t> shapes;
+	std::unique_ptr<mesh_buffer> buffer(new mesh_buffer());
+	vector<obj_mesh> shapes;
 	vector<material_t> materials;
+	vector<string> mtl_files;
 
-	string err = LoadObj(shapes, materials, filename.c_str(), "models/");
+	string err = load_obj_meshes(*buffer, shapes, materials, filename.c_str(), mtl_basepath.c_str(), pool, vector<string>(), &mtl_files);
 
 	if (!err.empty())
 	{
 		printf("\n\nTINYOBJ ERROR: %s\n\n", err.c_str());
 	}
 	
-	printf("Loaded .obj file. Transferring to Embree.\n");
-	for (int i = 0; i < shapes.size(); ++i)
-	{
-		int mesh = rtcNewTriangleMesh(scene, 
-			RTC_GEOMETRY_STATIC, 
-			shapes[i].mesh.indices.size() / 3,
-			shapes[i].mesh.positions.size() / 3);
+	printf("Loaded .obj file. Transferring to %s.\n", accel.name());
 
-		// setup vertex buffer
-		embVert* verts = (embVert*)rtcMapBuffer(scene, mesh, RTC_VERTEX_BUFFER);
-		for (int v = 0; v < shapes[i].mesh.positions.size(); ++v)
-			shapes[i].mesh.positions[v] = shapes[i].mesh.positions[v] * scale + origin.x;
+	vector<material> fitted = fit_obj_materials(materials);
 
-		for (int v = 0; v < shapes[i].mesh.positions.size() / 3; ++v)
-		{
-			verts[v].x = shapes[i].mesh.positions[3 * v + 0];
-			verts[v].y = shapes[i].mesh.positions[3 * v + 1];
-			verts[v].z = shapes[i].mesh.positions[3 * v + 2];
-		}
-		rtcUnmapBuffer(scene, mesh, RTC_VERTEX_BUFFER);
+	int first_model = (int)models.size();
+	int first_light = (int)light_triangles.size();
+	for (size_t i = 0; i < shapes.size(); ++i)
+	{
+		float* vertices = buffer->vertices(i);
+		for (size_t v = 0; v < buffer->meshes[i].num_vertices; ++v)
+			for (int k = 0; k < 3; ++k)
+				vertices[4 * v + k] = vertices[4 * v + k] * scale + origin[k];
 
-		// setup index buffer
-		embTriangle* tris = (embTriangle*)rtcMapBuffer(scene, mesh, RTC_INDEX_BUFFER);
-		for (int v = 0; v < shapes[i].mesh.indices.size() / 3; ++v)
-		{
-			tris[v].v0 = shapes[i].mesh.indices[3 * v + 0];
-			tris[v].v1 = shapes[i].mesh.indices[3 * v + 1];
-			tris[v].v2 = shapes[i].mesh.indices[3 * v + 2];
-		}
-		rtcUnmapBuffer(scene, mesh, RTC_INDEX_BUFFER);
+		add_shared_model(accel, *buffer, i, obj_material(shapes[i].material, fitted));
+	}
 
-		// create model
-		model cur_model;
-		cur_model.geom_id = mesh;
+	update_light_sampling();
 
-		int material_id = shapes[i].mesh.material_ids[0];
-		float e = materials[material_id].emission[0];
-		cur_model.mat.light_intensity = 3.f * e / 440.f;
-		if (e > 0.1)
-		{
-			// Add the triangles to the light triangle cache
-			for (int v = 0; v < shapes[i].mesh.indices.size() / 3; ++v)
-			{
-				int v0 = shapes[i].mesh.indices[3 * v + 0];
-				int v1 = shapes[i].mesh.indices[3 * v + 1];
-				int v2 = shapes[i].mesh.indices[3 * v + 2];
-
-				light_triangle t;
-				t.p0 = vec3(verts[v0].x, verts[v0].y, verts[v0].z);
-				t.p1 = vec3(verts[v1].x, verts[v1].y, verts[v1].z);
-				t.p2 = vec3(verts[v2].x, verts[v2].y, verts[v2].z);
-				t.area = length(cross(t.p1 - t.p0, t.p2 - t.p0)) / 2.f;
-				t.model_id = models.size() - 1;
-				light_triangles.push_back(t);
-
-				total_light_area += t.area;
-			}
-		}
+	if (have_key)
+	{
+		vector<material> mats;
+		for (int i = first_model; i < (int)models.size(); ++i)
+			mats.push_back(models[i].mat);
+		vector<light_triangle> lights(light_triangles.begin() + first_light, light_triangles.end());
+		for (light_triangle& t : lights)
+			t.model_id -= first_model;
 
-		// converting between rgb colors and wavelength responses go here
-		// for now, just hardcoding some colors
-		if (i == 3)
-		{
-			cur_model.mat.diffuse_albedo = 0.8;
-			cur_model.mat.diffuse_mean = 680;
-			cur_model.mat.diffuse_stddev = 40;
-		}
-		else if (i == 5)
-		{
-			cur_model.mat.diffuse_albedo = 0.8;
-			cur_model.mat.diffuse_mean = 540;
-			cur_model.mat.diffuse_stddev = 40;
-		}
+		if (write_mesh_cache(cache_file, key, *buffer, mats, lights, mtl_basepath, mtl_files))
+			printf("Wrote mesh cache %s\n", cache_file.c_str());
 		else
-		{
-			cur_model.mat.diffuse_albedo = 0.5;
-			cur_model.mat.diffuse_mean = 600;
-			cur_model.mat.diffuse_stddev = 200;
-		}
-		
-		models.push_back(cur_model);
+			printf("Can't write mesh cache %s\n", cache_file.c_str());
 	}
+
+	if (accel.traces_shared_meshes())
+		shared_mesh_buffers.push_back(std::move(buffer));
 }
@@ -0,0 +1,742 @@
+#pragma once
+
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+using std::string;
+using std::vector;
+
+#include "tiny_obj_loader.h"
+
+#include "file.h"
+#include "mesh_buffer.h"
+#include "thread_pool.h"
+
+// A faster drop-in for tinyobj::LoadObj, with the same shapes and materials
+// out. The file is mapped, cut into chunks at line breaks, and the chunks
+// are parsed on the thread pool. The serial part after that only walks the
+// usemtl/g/o statements, then every shape builds its vertex list in
+// parallel, deduplicating corners through a flat hash table instead of a
+// std::map. The .mtl files still go through tinyobj.
+//
+// load_obj_meshes() is the renderer's loader: positions only, indexed
+// straight into a mesh_buffer the accelerator traces as it is.
+
+//-----------------------------------------------------------------------------
+// Tokens
+//-----------------------------------------------------------------------------
+inline const char* skip_space(const char* p, const char* end)
+{
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+		++p;
+	return p;
+}
+inline const char* skip_line(const char* p, const char* end)
+{
+	const char* nl = (const char*)memchr(p, '\n', end - p);
+	return nl ? nl + 1 : end;
+}
+inline bool is_digit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+// [+-]digits[.digits][(e|E)[+-]digits], what exporters write. Up to 19
+// significant digits are gathered in an integer and scaled once by an exact
+// power of ten, which rounds correctly for anything a float can hold; longer
+// or extreme numbers go to strtod. 0 if there is no number.
+inline const char* parse_obj_float(const char* p, const char* end, float& out)
+{
+	static const double pow10[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+	p = skip_space(p, end);
+	const char* start = p;
+	bool negative = false;
+	if (p < end && (*p == '+' || *p == '-'))
+		negative = *p++ == '-';
+
+	uint64_t mantissa = 0;
+	int digits = 0, exponent = 0;
+	bool any = false;
+	for (; p < end && is_digit(*p); ++p, any = true)
+	{
+		if (digits < 19)
+		{
+			mantissa = mantissa * 10 + (*p - '0');
+			digits += mantissa > 0;
+		}
+		else
+			++exponent;
+	}
+	if (p < end && *p == '.')
+	{
+		for (++p; p < end && is_digit(*p); ++p, any = true)
+		{
+			if (digits < 19)
+			{
+				mantissa = mantissa * 10 + (*p - '0');
+				digits += mantissa > 0;
+				--exponent;
+			}
+		}
+	}
+	if (!any)
+	{
+		out = 0;
+		while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+			++p;
+		return p;
+	}
+	if (p < end && (*p == 'e' || *p == 'E'))
+	{
+		const char* e = p + 1;
+		bool exp_negative = false;
+		if (e < end && (*e == '+' || *e == '-'))
+			exp_negative = *e++ == '-';
+		if (e < end && is_digit(*e))
+		{
+			int x = 0;
+			for (; e < end && is_digit(*e); ++e)
+				x = std::min(x * 10 + (*e - '0'), 100000);
+			exponent += exp_negative ? -x : x;
+			p = e;
+		}
+	}
+
+	double value;
+	if (digits <= 15 && exponent >= -22 && exponent <= 22)
+		value = exponent < 0 ? mantissa / pow10[-exponent] : mantissa * pow10[exponent];
+	else
+	{
+		string s(start, p);
+		value = fabs(strtod(s.c_str(), nullptr));
+	}
+	out = (float)(negative ? -value : value);
+	return p;
+}
+
+inline const char* parse_obj_int(const char* p, const char* end, int& out)
+{
+	bool negative = false;
+	if (p < end && (*p == '+' || *p == '-'))
+		negative = *p++ == '-';
+	int x = 0;
+	for (; p < end && is_digit(*p); ++p)
+		x = x * 10 + (*p - '0');
+	out = negative ? -x : x;
+	return p;
+}
+
+// the first whitespace separated word
+inline string parse_obj_name(const char* p, const char* end)
+{
+	p = skip_space(p, end);
+	const char* e = p;
+	while (e < end && *e != ' ' && *e != '\t' && *e != '\r' && *e != '\n')
+		++e;
+	return string(p, e);
+}
+
+//-----------------------------------------------------------------------------
+// Chunks
+//-----------------------------------------------------------------------------
+// position, texcoord and normal index of a face corner, -1 if absent
+struct obj_corner
+{
+	int v, vt, vn;
+};
+
+// a statement that ends the current shape
+struct obj_event
+{
+	enum kind { USEMTL, GROUP, OBJECT, MTLLIB };
+	kind type;
+	size_t face; // faces of the chunk before it
+	string name;
+};
+
+struct obj_chunk
+{
+	vector<float> v, vt, vn; // vt and vn only with texcoords
+	size_t num_vt = 0, num_vn = 0;
+	bool texcoords = true;
+	vector<obj_corner> corners;
+	vector<unsigned int> face_start; // first corner of each face, plus one past the last
+	vector<obj_event> events;
+	// Negative (relative) indices count back from the end of the chunk's own
+	// vertices, these corner fields still need the vertices of the chunks
+	// before added; 3 * corner + 0/1/2 for v/vt/vn
+	vector<size_t> relative;
+
+	void parse(const char* p, const char* end)
+	{
+		face_start.push_back(0);
+		while (p < end)
+		{
+			p = skip_space(p, end);
+			if (p >= end)
+				break;
+			const char* line_end = (const char*)memchr(p, '\n', end - p);
+			if (!line_end)
+				line_end = end;
+
+			char c = *p;
+			char c1 = p + 1 < line_end ? p[1] : '\n';
+			bool space1 = c1 == ' ' || c1 == '\t';
+			if (c == 'v' && space1)
+			{
+				float x, y, z;
+				p = parse_obj_float(p + 2, line_end, x);
+				p = parse_obj_float(p, line_end, y);
+				parse_obj_float(p, line_end, z);
+				v.push_back(x);
+				v.push_back(y);
+				v.push_back(z);
+			}
+			else if (c == 'v' && c1 == 'n')
+			{
+				float x, y, z;
+				p = parse_obj_float(p + 2, line_end, x);
+				p = parse_obj_float(p, line_end, y);
+				parse_obj_float(p, line_end, z);
+				num_vn++;
+				if (texcoords)
+				{
+					vn.push_back(x);
+					vn.push_back(y);
+					vn.push_back(z);
+				}
+			}
+			else if (c == 'v' && c1 == 't')
+			{
+				float x, y;
+				p = parse_obj_float(p + 2, line_end, x);
+				parse_obj_float(p, line_end, y);
+				num_vt++;
+				if (texcoords)
+				{
+					vt.push_back(x);
+					vt.push_back(y);
+				}
+			}
+			else if (c == 'f' && space1)
+				parse_face(p + 2, line_end);
+			else if (c == 'u' && is_statement(p, line_end, "usemtl"))
+				add_event(obj_event::USEMTL, parse_obj_name(p + 7, line_end));
+			else if (c == 'm' && is_statement(p, line_end, "mtllib"))
+				add_event(obj_event::MTLLIB, parse_obj_name(p + 7, line_end));
+			else if (c == 'g' && space1)
+				add_event(obj_event::GROUP, parse_obj_name(p + 1, line_end));
+			else if (c == 'o' && space1)
+				add_event(obj_event::OBJECT, parse_obj_name(p + 2, line_end));
+
+			p = line_end < end ? line_end + 1 : end;
+		}
+	}
+
+	// keyword followed by a space
+	static bool is_statement(const char* p, const char* end, const char* keyword)
+	{
+		size_t n = strlen(keyword);
+		return (size_t)(end - p) > n && memcmp(p, keyword, n) == 0 && (p[n] == ' ' || p[n] == '\t');
+	}
+
+	void add_event(obj_event::kind type, const string& name)
+	{
+		obj_event e;
+		e.type = type;
+		e.face = face_start.size() - 1;
+		e.name = name;
+		events.push_back(e);
+	}
+
+	// i, i/j, i//k or i/j/k per corner
+	void parse_face(const char* p, const char* end)
+	{
+		int counts[3] = { (int)v.size() / 3, (int)num_vt, (int)num_vn };
+		for (p = skip_space(p, end); p < end && *p != '\n'; p = skip_space(p, end))
+		{
+			obj_corner c = { -1, -1, -1 };
+			int* fields[3] = { &c.v, &c.vt, &c.vn };
+			for (int k = 0; k < 3; ++k)
+			{
+				if (k > 0)
+				{
+					if (p >= end || *p != '/')
+						break;
+					++p;
+					if (p < end && *p == '/')
+						continue; // i//k
+				}
+				int idx;
+				p = parse_obj_int(p, end, idx);
+				if (idx > 0)
+					*fields[k] = idx - 1;
+				else if (idx == 0)
+					*fields[k] = 0;
+				else
+				{
+					*fields[k] = counts[k] + idx;
+					relative.push_back(3 * corners.size() + k);
+				}
+			}
+			// skip whatever else is in this corner
+			while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+				++p;
+			corners.push_back(c);
+		}
+		face_start.push_back((unsigned int)corners.size());
+	}
+
+	size_t num_faces() const
+	{
+		return face_start.size() - 1;
+	}
+};
+
+//-----------------------------------------------------------------------------
+// Shapes
+//-----------------------------------------------------------------------------
+// the faces [first_face, end_face) of a chunk
+struct obj_face_range
+{
+	int chunk;
+	size_t first_face, end_face;
+};
+
+struct obj_shape_spec
+{
+	string name;
+	int material;
+	vector<obj_face_range> faces;
+	size_t num_corners;
+};
+
+// Open addressing hash from corner to vertex index, sized for a known
+// number of corners so it never grows.
+struct corner_table
+{
+	vector<obj_corner> keys;
+	vector<unsigned int> values;
+	size_t mask;
+
+	void init(size_t corners)
+	{
+		size_t size = 16;
+		while (size < 2 * corners)
+			size *= 2;
+		mask = size - 1;
+		obj_corner empty = { INT_MIN, 0, 0 };
+		keys.assign(size, empty);
+		values.resize(size);
+	}
+
+	// the index stored for c, or inserts next and returns that
+	unsigned int find_or_insert(const obj_corner& c, unsigned int next, bool& inserted)
+	{
+		uint32_t h = (uint32_t)c.v * 0x9E3779B1u ^ (uint32_t)c.vt * 0x85EBCA77u ^ (uint32_t)c.vn * 0xC2B2AE3Du;
+		h ^= h >> 15;
+		for (size_t i = h & mask;; i = (i + 1) & mask)
+		{
+			obj_corner& k = keys[i];
+			if (k.v == INT_MIN)
+			{
+				k = c;
+				values[i] = next;
+				inserted = true;
+				return next;
+			}
+			if (k.v == c.v && k.vt == c.vt && k.vn == c.vn)
+			{
+				inserted = false;
+				return values[i];
+			}
+		}
+	}
+};
+
+// Same as tinyobj's exportFaceGroupToShape(): triangle fans, and a vertex per
+// distinct corner in the order they're first used. False on a bad index.
+bool build_obj_shape(const obj_shape_spec& spec, const vector<obj_chunk>& chunks,
+	const vector<float>& v, const vector<float>& vt, const vector<float>& vn, tinyobj::shape_t& shape)
+{
+	shape.name = spec.name;
+	tinyobj::mesh_t& mesh = shape.mesh;
+
+	corner_table table;
+	table.init(spec.num_corners);
+	int num_v = (int)v.size() / 3, num_vt = (int)vt.size() / 2, num_vn = (int)vn.size() / 3;
+
+	unsigned int fan[3];
+	for (const obj_face_range& range : spec.faces)
+	{
+		const obj_chunk& chunk = chunks[range.chunk];
+		for (size_t f = range.first_face; f < range.end_face; ++f)
+		{
+			unsigned int first = chunk.face_start[f], count = chunk.face_start[f + 1] - first;
+			if (count < 3)
+				continue; // tinyobj skips these entirely, they have no triangles
+			for (unsigned int k = 0; k < count; ++k)
+			{
+				const obj_corner& c = chunk.corners[first + k];
+				if (c.v < 0 || c.v >= num_v || c.vt >= num_vt || c.vn >= num_vn)
+					return false;
+
+				bool inserted;
+				unsigned int index = table.find_or_insert(c, (unsigned int)(mesh.positions.size() / 3), inserted);
+				if (inserted)
+				{
+					mesh.positions.insert(mesh.positions.end(), &v[3 * c.v], &v[3 * c.v] + 3);
+					if (c.vn >= 0)
+						mesh.normals.insert(mesh.normals.end(), &vn[3 * c.vn], &vn[3 * c.vn] + 3);
+					if (c.vt >= 0)
+						mesh.texcoords.insert(mesh.texcoords.end(), &vt[2 * c.vt], &vt[2 * c.vt] + 2);
+				}
+
+				// corners 0, k - 1, k make a triangle
+				if (k == 0)
+					fan[0] = index;
+				else if (k == 1)
+					fan[2] = index;
+				else
+				{
+					fan[1] = fan[2];
+					fan[2] = index;
+					mesh.indices.insert(mesh.indices.end(), fan, fan + 3);
+					mesh.material_ids.push_back(spec.material);
+				}
+			}
+		}
+	}
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Meshes
+//-----------------------------------------------------------------------------
+// A shape's vertices by position alone, which is all the renderer uses: the
+// index in v of each, and 3 of them per triangle, fanned like
+// build_obj_shape() does. False on a bad index.
+bool index_obj_shape(const obj_shape_spec& spec, const vector<obj_chunk>& chunks, size_t num_v,
+	vector<unsigned int>& source, vector<unsigned int>& indices)
+{
+	size_t num_triangles = 0;
+	for (const obj_face_range& range : spec.faces)
+	{
+		const obj_chunk& chunk = chunks[range.chunk];
+		for (size_t f = range.first_face; f < range.end_face; ++f)
+			num_triangles += std::max(2u, chunk.face_start[f + 1] - chunk.face_start[f]) - 2;
+	}
+	indices.reserve(3 * num_triangles);
+
+	// Positions are numbered across the file, so a shape that uses a good
+	// part of them looks its vertices up in a table over all of them, which
+	// is no bigger than hashing its corners would be, and quicker.
+	bool direct = num_v <= 8 * spec.num_corners;
+	vector<unsigned int> vertex_of;
+	corner_table table;
+	if (direct)
+		vertex_of.assign(num_v, UINT_MAX);
+	else
+		table.init(spec.num_corners);
+
+	unsigned int fan[3];
+	for (const obj_face_range& range : spec.faces)
+	{
+		const obj_chunk& chunk = chunks[range.chunk];
+		for (size_t f = range.first_face; f < range.end_face; ++f)
+		{
+			unsigned int first = chunk.face_start[f], count = chunk.face_start[f + 1] - first;
+			if (count < 3)
+				continue;
+			for (unsigned int k = 0; k < count; ++k)
+			{
+				int v = chunk.corners[first + k].v;
+				if (v < 0 || (size_t)v >= num_v)
+					return false;
+
+				unsigned int index;
+				bool inserted;
+				if (direct)
+				{
+					inserted = vertex_of[v] == UINT_MAX;
+					if (inserted)
+						vertex_of[v] = (unsigned int)source.size();
+					index = vertex_of[v];
+				}
+				else
+				{
+					obj_corner c = { v, 0, 0 };
+					index = table.find_or_insert(c, (unsigned int)source.size(), inserted);
+				}
+				if (inserted)
+					source.push_back(v);
+
+				if (k == 0)
+					fan[0] = index;
+				else if (k == 1)
+					fan[2] = index;
+				else
+				{
+					fan[1] = fan[2];
+					fan[2] = index;
+					indices.insert(indices.end(), fan, fan + 3);
+				}
+			}
+		}
+	}
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Loading
+//-----------------------------------------------------------------------------
+// What both loaders start from: every chunk parsed, with absolute indices,
+// the positions (and with texcoords, the texcoords and normals) gathered in
+// file order, and the shapes the faces split into.
+struct obj_file_data
+{
+	vector<obj_chunk> chunks;
+	vector<float> v, vt, vn;
+	vector<obj_shape_spec> specs;
+	vector<string> mtl_files; // of the mtllib statements, in order
+};
+
+// An empty string on success, like load_obj()
+string parse_obj_file(obj_file_data& out, vector<tinyobj::material_t>& materials,
+	const char* filename, const char* mtl_basepath, bool texcoords, thread_pool& pool)
+{
+	mapped_file file;
+	if (!file.open(filename))
+		return string("Cannot open file [") + filename + "]\n";
+
+	// chunks of about 1 MB, cut after a line break
+	const char* data = file.data;
+	size_t size = file.size;
+	size_t num_chunks = std::max<size_t>(1, std::min<size_t>(size >> 20, 64 * pool.size()));
+	vector<const char*> cuts;
+	cuts.push_back(data);
+	for (size_t i = 1; i < num_chunks; ++i)
+	{
+		const char* p = std::max(cuts.back(), data + size * i / num_chunks);
+		cuts.push_back(skip_line(p, data + size));
+	}
+	cuts.push_back(data + size);
+
+	vector<obj_chunk>& chunks = out.chunks;
+	chunks.assign(num_chunks, obj_chunk());
+	pool.parallel_for((int)num_chunks, [&](int i)
+	{
+		chunks[i].texcoords = texcoords;
+		chunks[i].parse(cuts[i], cuts[i + 1]);
+		file.release(cuts[i], cuts[i + 1]);
+	});
+
+	// gather the vertex data and make relative indices absolute
+	vector<size_t> base_v(num_chunks), base_vt(num_chunks), base_vn(num_chunks);
+	size_t total_v = 0, total_vt = 0, total_vn = 0;
+	for (size_t i = 0; i < num_chunks; ++i)
+	{
+		base_v[i] = total_v;
+		base_vt[i] = total_vt;
+		base_vn[i] = total_vn;
+		total_v += chunks[i].v.size();
+		total_vt += 2 * chunks[i].num_vt;
+		total_vn += 3 * chunks[i].num_vn;
+	}
+	out.v.resize(total_v);
+	out.vt.resize(texcoords ? total_vt : 0);
+	out.vn.resize(texcoords ? total_vn : 0);
+	pool.parallel_for((int)num_chunks, [&](int i)
+	{
+		obj_chunk& c = chunks[i];
+		std::copy(c.v.begin(), c.v.end(), out.v.begin() + base_v[i]);
+		vector<float>().swap(c.v);
+		if (texcoords)
+		{
+			std::copy(c.vt.begin(), c.vt.end(), out.vt.begin() + base_vt[i]);
+			std::copy(c.vn.begin(), c.vn.end(), out.vn.begin() + base_vn[i]);
+		}
+		vector<float>().swap(c.vt);
+		vector<float>().swap(c.vn);
+
+		int bases[3] = { (int)base_v[i] / 3, (int)base_vt[i] / 2, (int)base_vn[i] / 3 };
+		for (size_t r : c.relative)
+		{
+			obj_corner& corner = c.corners[r / 3];
+			int* field = r % 3 == 0 ? &corner.v : r % 3 == 1 ? &corner.vt : &corner.vn;
+			*field += bases[r % 3];
+		}
+		vector<size_t>().swap(c.relative);
+	});
+
+	// split the faces into shapes at usemtl, g and o, like tinyobj does
+	std::map<string, int> material_map;
+	tinyobj::MaterialFileReader read_materials(mtl_basepath ? mtl_basepath : "");
+	vector<obj_shape_spec>& specs = out.specs;
+	obj_shape_spec cur;
+	cur.material = -1;
+	cur.num_corners = 0;
+
+	auto add_faces = [&](int chunk, size_t first, size_t end)
+	{
+		if (end <= first)
+			return;
+		const obj_chunk& c = chunks[chunk];
+		obj_face_range range = { chunk, first, end };
+		cur.faces.push_back(range);
+		cur.num_corners += c.face_start[end] - c.face_start[first];
+	};
+	auto flush = [&]()
+	{
+		if (!cur.faces.empty())
+			specs.push_back(cur);
+		cur.faces.clear();
+		cur.num_corners = 0;
+	};
+
+	for (int i = 0; i < (int)num_chunks; ++i)
+	{
+		size_t face = 0;
+		for (const obj_event& e : chunks[i].events)
+		{
+			add_faces(i, face, e.face);
+			face = e.face;
+
+			if (e.type == obj_event::MTLLIB)
+			{
+				out.mtl_files.push_back(e.name);
+				string err_mtl = read_materials(e.name, materials, material_map);
+				if (!err_mtl.empty())
+					return err_mtl;
+				continue;
+			}
+
+			flush();
+			if (e.type == obj_event::USEMTL)
+			{
+				auto it = material_map.find(e.name);
+				cur.material = it != material_map.end() ? it->second : -1;
+			}
+			else
+				cur.name = e.name;
+		}
+		add_faces(i, face, chunks[i].num_faces());
+	}
+	flush();
+	return string();
+}
+
+// Same arguments and results as tinyobj::LoadObj: an empty string on success.
+string load_obj(vector<tinyobj::shape_t>& shapes, vector<tinyobj::material_t>& materials,
+	const char* filename, const char* mtl_basepath, thread_pool& pool)
+{
+	shapes.clear();
+
+	obj_file_data file;
+	string err = parse_obj_file(file, materials, filename, mtl_basepath, true, pool);
+	if (!err.empty())
+		return err;
+
+	const vector<obj_shape_spec>& specs = file.specs;
+	shapes.resize(specs.size());
+	vector<char> ok(specs.size());
+	pool.parallel_for((int)specs.size(), [&](int i)
+	{
+		ok[i] = build_obj_shape(specs[i], file.chunks, file.v, file.vt, file.vn, shapes[i]);
+	});
+	for (size_t i = 0; i < specs.size(); ++i)
+		if (!ok[i])
+			err += "Face index out of range in shape [" + specs[i].name + "]\n";
+
+	return err;
+}
+
+// a shape load_obj_meshes() put in the buffer
+struct obj_mesh
+{
+	string name;
+	int material; // in the .mtl materials, -1 for none
+};
+
+// The shapes of filename as load_obj() would make them, positions only,
+// straight into buffer: no normals or texcoords, and a vertex per distinct
+// position rather than per corner. With objects, only the shapes of those
+// names. mtl_files gets the .mtl files it read, relative to mtl_basepath.
+// An empty string on success.
+string load_obj_meshes(mesh_buffer& buffer, vector<obj_mesh>& meshes, vector<tinyobj::material_t>& materials,
+	const char* filename, const char* mtl_basepath, thread_pool& pool, const vector<string>& objects = vector<string>(),
+	vector<string>* mtl_files = nullptr)
+{
+	meshes.clear();
+
+	obj_file_data file;
+	string err = parse_obj_file(file, materials, filename, mtl_basepath, false, pool);
+	if (mtl_files)
+		*mtl_files = file.mtl_files;
+	if (!err.empty())
+		return err;
+
+	vector<obj_shape_spec> specs;
+	for (obj_shape_spec& spec : file.specs)
+		if (objects.empty() || std::find(objects.begin(), objects.end(), spec.name) != objects.end())
+			specs.push_back(std::move(spec));
+	vector<obj_shape_spec>().swap(file.specs);
+
+	vector<vector<unsigned int>> source(specs.size()), indices(specs.size());
+	vector<char> ok(specs.size());
+	pool.parallel_for((int)specs.size(), [&](int i)
+	{
+		ok[i] = index_obj_shape(specs[i], file.chunks, file.v.size() / 3, source[i], indices[i]);
+	});
+	// the faces are all in the index lists now
+	vector<obj_chunk>().swap(file.chunks);
+
+	vector<uint32_t> num_vertices(specs.size()), num_triangles(specs.size());
+	for (size_t i = 0; i < specs.size(); ++i)
+	{
+		if (!ok[i])
+		{
+			err += "Face index out of range in shape [" + specs[i].name + "]\n";
+			source[i].clear();
+			indices[i].clear();
+		}
+		num_vertices[i] = (uint32_t)source[i].size();
+		num_triangles[i] = (uint32_t)(indices[i].size() / 3);
+	}
+	if (!buffer.allocate(num_vertices, num_triangles))
+		return err + "Out of memory for the meshes of [" + filename + "]\n";
+
+	pool.parallel_for((int)specs.size(), [&](int i)
+	{
+		float* vertices = buffer.vertices(i);
+		for (size_t k = 0; k < source[i].size(); ++k)
+		{
+			const float* p = &file.v[3 * (size_t)source[i][k]];
+			vertices[4 * k + 0] = p[0];
+			vertices[4 * k + 1] = p[1];
+			vertices[4 * k + 2] = p[2];
+			vertices[4 * k + 3] = 0;
+		}
+		if (!indices[i].empty())
+			memcpy(buffer.indices(i), indices[i].data(), indices[i].size() * sizeof(unsigned int));
+		vector<unsigned int>().swap(source[i]);
+		vector<unsigned int>().swap(indices[i]);
+	});
+
+	meshes.resize(specs.size());
+	for (size_t i = 0; i < specs.size(); ++i)
+	{
+		meshes[i].name = specs[i].name;
+		meshes[i].material = specs[i].material;
+	}
+	return err;
+}
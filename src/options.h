@@ -0,0 +1,460 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+using std::string;
+using std::vector;
+
+#include "accelerator.h"
+#include "image.h"
+#include "lights.h"
+#include "ray_stream.h"
+#include "sampler.h"
+
+const int DEFAULT_SAMPLES = 100;
+
+enum integrator_type
+{
+	INTEGRATOR_PT,   // camera paths, with a light sample at every vertex (MIS)
+	INTEGRATOR_BDPT, // camera and light paths, every connection between them
+};
+
+// how bidirectional strategies are weighted against each other
+enum mis_heuristic
+{
+	MIS_BALANCE,
+	MIS_POWER, // exponent 2
+};
+
+struct render_options
+{
+	int num_threads = 0; // 0 means one per hardware thread
+	sampler_type sampler = SAMPLER_INDEPENDENT;
+	trace_mode trace = TRACE_SINGLE;
+	int packet_width = 8;
+#ifndef ALBEDO_NO_EMBREE
+	accel_type accel = ACCEL_EMBREE;
+#else
+	accel_type accel = ACCEL_BVH;
+#endif
+	bvh_geometry geometry = BVH_GEOMETRY_COPY;
+	light_sampling_mode lights = LIGHTS_POWER;
+	integrator_type integrator = INTEGRATOR_BDPT;
+	mis_heuristic mis = MIS_POWER;
+	bool mesh_cache = true;
+	string scene; // scene file (see scene_file.h), empty for models/GP.obj
+	bool guide = false; // path guiding, see guiding.h
+	int guide_training = -1; // rounds the guide learns over; -1: half of samples, or 15
+
+	// stop at whichever limit comes first; 0 turns one off
+	int samples = -1; // -1: DEFAULT_SAMPLES, unless a time or noise limit is set
+	float time_limit = 0;
+	float noise_limit = 0;
+
+	// adaptive sampling: after min_samples, only tiles whose error is above
+	// this get more samples; 0 samples every pixel alike
+	float adaptive = 0;
+	int min_samples = 16;
+	string output = "image.png"; // tonemapped image, PNG or PPM
+	string hdr_output = "image.exr"; // linear image, OpenEXR or PFM; empty for none
+	post_settings post = { -2, TONEMAP_ACES, true, false }; // exposure for the Cornell box's bright light
+	float snapshot_interval = 0; // seconds between writing the outputs mid-render, 0 for never
+	string feature_prefix; // albedo, normal and depth images, empty for none
+	string heatmap; // samples per pixel image, empty for none
+	string timeline; // Chrome trace of the run, empty for none
+
+	string checkpoint; // file to save progress to, empty for none
+	float checkpoint_interval = 300;
+	string resume; // file to continue from, empty to start over
+
+	// a part of a frame split over processes, see checkpoint.h
+	int first_sample = 0; // sample index of each pixel's first sample
+	int first_tile = 0;
+	int last_tile = -1; // one past the last tile to render, -1 for all of them
+	vector<string> merge; // checkpoints to add up instead of rendering
+	int workers = 0; // processes to hand tiles to, see workers.h; 0 renders here
+	int worker_in = -1; // set for those processes: the coordinator's pipes,
+	int worker_out = -1; // and the file to save their film to
+	string worker_part;
+
+	bool bench_trace = false;
+	bool bench_load = false;
+	bool bench_paths = false;
+	bool bench_render = false;
+	bool bench_references = false;
+	float bench_guiding = 0; // seconds per render
+};
+
+void print_usage(const char* exe)
+{
+	printf("Usage: %s [options]\n", exe);
+	printf("  --threads N    number of render threads (default: all cores)\n");
+	printf("  --sampler S    'independent' (PCG32, default) or 'sobol' (Owen-scrambled)\n");
+	printf("  --trace M      'single' (one ray at a time, default), or trace each bounce\n");
+	printf("                 of a tile as a batch: 'packet' (rtcIntersectN) or 'stream' (rtcIntersect1M)\n");
+	printf("  --packet N     packet width for --trace packet: 4, 8 (default) or 16\n");
+	printf("  --accel A      ray tracing backend: 'embree' (default when built with it) or\n");
+	printf("                 'bvh' (built-in)\n");
+	printf("  --bvh-geometry G  how the built-in BVH keeps triangles: 'copy' (default, fastest),\n");
+	printf("                 'shared' (traces the loaded meshes, no copy) or 'quantized' (smallest)\n");
+	printf("  --lights L     how to pick the light for direct lighting: 'area', 'power'\n");
+	printf("                 (default, alias table) or 'tree' (light tree, by distance and orientation)\n");
+	printf("  --integrator I 'bdpt' (bidirectional, default) or 'pt' (path tracing); --trace\n");
+	printf("                 packet and stream always use 'pt'\n");
+	printf("  --mis H        weighting of bidirectional strategies: 'power' (default) or 'balance'\n");
+	printf("  --scene F      render the scene file F instead of models/GP.obj\n");
+	printf("  --guide        learn where light comes from while rendering, and bounce camera\n");
+	printf("                 paths towards it (path guiding)\n");
+	printf("  --guide-train N  rounds the guide learns over (default: half of --spp, or 15\n");
+	printf("                 with --time or --noise)\n");
+	printf("  --no-mesh-cache  always parse the .obj, don't read or write <file>.obj.cache\n");
+	printf("  --spp N        samples per pixel to stop at (default %d, or none with --time/--noise)\n", DEFAULT_SAMPLES);
+	printf("  --time S       stop after S seconds\n");
+	printf("  --noise E      stop once the average standard error of the tonemapped\n");
+	printf("                 luminance drops below E (e.g. 0.005)\n");
+	printf("  --adaptive E   after --min-spp samples, keep sampling only the tiles whose\n");
+	printf("                 average tonemapped error is above E (e.g. 0.01)\n");
+	printf("  --min-spp N    samples every pixel gets before --adaptive kicks in (default 16)\n");
+	printf("  --output F     tonemapped image, .png (default image.png) or .ppm\n");
+	printf("  --hdr F        linear image, .exr (default image.exr) or .pfm; 'none' for none\n");
+	printf("  --exposure EV  scale the image by 2^EV before tonemapping (default -2)\n");
+	printf("  --tonemap T    'aces' (default), 'filmic' (Hable) or 'reinhard'\n");
+	printf("  --snapshot-every S  rewrite the images every S seconds while rendering\n");
+	printf("  --denoise      run the a-trous denoiser on the images, snapshots included\n");
+	printf("  --features P   write the albedo, normal and depth buffers to P.albedo.exr etc.\n");
+	printf("  --heatmap F    write the number of samples each pixel got to F (PNG, or PPM by extension)\n");
+	printf("  --timeline F   write a timeline of the run to F, for chrome://tracing or Perfetto\n");
+	printf("  --checkpoint F save progress to F every --checkpoint-every seconds and at the end\n");
+	printf("  --checkpoint-every S  (default 300)\n");
+	printf("  --resume F     continue the render saved in F, and keep saving to it unless\n");
+	printf("                 --checkpoint names another file\n");
+	printf("  --first-sample N  start each pixel's samples at index N, so that renders of\n");
+	printf("                 different ranges can be merged (default 0)\n");
+	printf("  --tiles A B    only render tiles A up to B, counting the image's tiles row by\n");
+	printf("                 row from the top left\n");
+	printf("  --merge F      add up the --checkpoint files F (repeat it for each) and write\n");
+	printf("                 the outputs, without rendering\n");
+	printf("  --workers N    render in N processes started with the same options, handing\n");
+	printf("                 out tiles over pipes, then merge what they rendered (needs --spp)\n");
+	printf("  --bench-trace  time every backend and trace mode on a fixed set of rays and exit\n");
+	printf("  --bench-paths  time the per-sample render loop on one thread, count its heap\n");
+	printf("                 allocations and exit\n");
+	printf("  --bench-load   time the .obj parser against tinyobj and exit\n");
+	printf("  --bench-render render the bench scenes (scenes.h) at fixed settings, report their\n");
+	printf("                 speed and error against bench/*.ppm and exit, with 1 if one is off\n");
+	printf("  --bench-references  render the reference images for --bench-render and exit\n");
+	printf("  --bench-guiding S  render the indirect scene (scenes.h) for S seconds each without\n");
+	printf("                 and with --guide, compare their noise and exit\n");
+}
+
+render_options parse_options(int argc, char** argv)
+{
+	render_options opts;
+	bool integrator_given = false;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		const char* arg = argv[i];
+		bool has_value = i + 1 < argc;
+
+		if (strcmp(arg, "--threads") == 0 && has_value)
+		{
+			opts.num_threads = atoi(argv[++i]);
+		}
+		else if (strcmp(arg, "--sampler") == 0 && has_value)
+		{
+			const char* name = argv[++i];
+			if (strcmp(name, "independent") == 0)
+				opts.sampler = SAMPLER_INDEPENDENT;
+			else if (strcmp(name, "sobol") == 0)
+				opts.sampler = SAMPLER_SOBOL;
+			else
+			{
+				printf("Unknown sampler: %s\n", name);
+				print_usage(argv[0]);
+				exit(1);
+			}
+		}
+		else if (strcmp(arg, "--trace") == 0 && has_value)
+		{
+			const char* name = argv[++i];
+			if (strcmp(name, "single") == 0)
+				opts.trace = TRACE_SINGLE;
+			else if (strcmp(name, "packet") == 0)
+				opts.trace = TRACE_PACKET;
+			else if (strcmp(name, "stream") == 0)
+				opts.trace = TRACE_STREAM;
+			else
+			{
+				printf("Unknown trace mode: %s\n", name);
+				print_usage(argv[0]);
+				exit(1);
+			}
+		}
+		else if (strcmp(arg, "--packet") == 0 && has_value)
+		{
+			opts.packet_width = atoi(argv[++i]);
+			if (opts.packet_width != 4 && opts.packet_width != 8 && opts.packet_width != 16)
+			{
+				printf("Packet width must be 4, 8 or 16\n");
+				exit(1);
+			}
+		}
+		else if (strcmp(arg, "--accel") == 0 && has_value)
+		{
+			const char* name = argv[++i];
+			if (strcmp(name, "bvh") == 0)
+				opts.accel = ACCEL_BVH;
+#ifndef ALBEDO_NO_EMBREE
+			else if (strcmp(name, "embree") == 0)
+				opts.accel = ACCEL_EMBREE;
+#endif
+			else
+			{
+				printf("Unknown or unavailable accelerator: %s\n", name);
+				print_usage(argv[0]);
+				exit(1);
+			}
+		}
+		else if (strcmp(arg, "--bvh-geometry") == 0 && has_value)
+		{
+			const char* name = argv[++i];
+			if (strcmp(name, "copy") == 0)
+				opts.geometry = BVH_GEOMETRY_COPY;
+			else if (strcmp(name, "shared") == 0)
+				opts.geometry = BVH_GEOMETRY_SHARED;
+			else if (strcmp(name, "quantized") == 0)
+				opts.geometry = BVH_GEOMETRY_QUANTIZED;
+			else
+			{
+				printf("Unknown BVH geometry: %s\n", name);
+				print_usage(argv[0]);
+				exit(1);
+			}
+		}
+		else if (strcmp(arg, "--lights") == 0 && has_value)
+		{
+			const char* name = argv[++i];
+			if (strcmp(name, "area") == 0)
+				opts.lights = LIGHTS_AREA;
+			else if (strcmp(name, "power") == 0)
+				opts.lights = LIGHTS_POWER;
+			else if (strcmp(name, "tree") == 0)
+				opts.lights = LIGHTS_TREE;
+			else
+			{
+				printf("Unknown light sampling mode: %s\n", name);
+				print_usage(argv[0]);
+				exit(1);
+			}
+		}
+		else if (strcmp(arg, "--integrator") == 0 && has_value)
+		{
+			const char* name = argv[++i];
+			integrator_given = true;
+			if (strcmp(name, "pt") == 0)
+				opts.integrator = INTEGRATOR_PT;
+			else if (strcmp(name, "bdpt") == 0)
+				opts.integrator = INTEGRATOR_BDPT;
+			else
+			{
+				printf("Unknown integrator: %s\n", name);
+				print_usage(argv[0]);
+				exit(1);
+			}
+		}
+		else if (strcmp(arg, "--mis") == 0 && has_value)
+		{
+			const char* name = argv[++i];
+			if (strcmp(name, "balance") == 0)
+				opts.mis = MIS_BALANCE;
+			else if (strcmp(name, "power") == 0)
+				opts.mis = MIS_POWER;
+			else
+			{
+				printf("Unknown MIS heuristic: %s\n", name);
+				print_usage(argv[0]);
+				exit(1);
+			}
+		}
+		else if (strcmp(arg, "--scene") == 0 && has_value)
+		{
+			opts.scene = argv[++i];
+		}
+		else if (strcmp(arg, "--guide") == 0)
+		{
+			opts.guide = true;
+		}
+		else if (strcmp(arg, "--guide-train") == 0 && has_value)
+		{
+			opts.guide_training = atoi(argv[++i]);
+		}
+		else if (strcmp(arg, "--no-mesh-cache") == 0)
+		{
+			opts.mesh_cache = false;
+		}
+		else if (strcmp(arg, "--spp") == 0 && has_value)
+		{
+			opts.samples = atoi(argv[++i]);
+		}
+		else if (strcmp(arg, "--time") == 0 && has_value)
+		{
+			opts.time_limit = (float)atof(argv[++i]);
+		}
+		else if (strcmp(arg, "--noise") == 0 && has_value)
+		{
+			opts.noise_limit = (float)atof(argv[++i]);
+		}
+		else if (strcmp(arg, "--adaptive") == 0 && has_value)
+		{
+			opts.adaptive = (float)atof(argv[++i]);
+		}
+		else if (strcmp(arg, "--min-spp") == 0 && has_value)
+		{
+			opts.min_samples = std::max(2, atoi(argv[++i]));
+		}
+		else if (strcmp(arg, "--output") == 0 && has_value)
+		{
+			opts.output = argv[++i];
+		}
+		else if (strcmp(arg, "--hdr") == 0 && has_value)
+		{
+			opts.hdr_output = argv[++i];
+			if (opts.hdr_output == "none")
+				opts.hdr_output.clear();
+		}
+		else if (strcmp(arg, "--exposure") == 0 && has_value)
+		{
+			opts.post.exposure = (float)atof(argv[++i]);
+		}
+		else if (strcmp(arg, "--tonemap") == 0 && has_value)
+		{
+			const char* name = argv[++i];
+			if (strcmp(name, "aces") == 0)
+				opts.post.tonemap = TONEMAP_ACES;
+			else if (strcmp(name, "filmic") == 0)
+				opts.post.tonemap = TONEMAP_FILMIC;
+			else if (strcmp(name, "reinhard") == 0)
+				opts.post.tonemap = TONEMAP_REINHARD;
+			else
+			{
+				printf("Unknown tonemapper: %s\n", name);
+				print_usage(argv[0]);
+				exit(1);
+			}
+		}
+		else if (strcmp(arg, "--denoise") == 0)
+		{
+			opts.post.denoise = true;
+		}
+		else if (strcmp(arg, "--features") == 0 && has_value)
+		{
+			opts.feature_prefix = argv[++i];
+		}
+		else if (strcmp(arg, "--snapshot-every") == 0 && has_value)
+		{
+			opts.snapshot_interval = (float)atof(argv[++i]);
+		}
+		else if (strcmp(arg, "--heatmap") == 0 && has_value)
+		{
+			opts.heatmap = argv[++i];
+		}
+		else if (strcmp(arg, "--timeline") == 0 && has_value)
+		{
+			opts.timeline = argv[++i];
+		}
+		else if (strcmp(arg, "--checkpoint") == 0 && has_value)
+		{
+			opts.checkpoint = argv[++i];
+		}
+		else if (strcmp(arg, "--checkpoint-every") == 0 && has_value)
+		{
+			opts.checkpoint_interval = (float)atof(argv[++i]);
+		}
+		else if (strcmp(arg, "--resume") == 0 && has_value)
+		{
+			opts.resume = argv[++i];
+		}
+		else if (strcmp(arg, "--first-sample") == 0 && has_value)
+		{
+			opts.first_sample = std::max(0, atoi(argv[++i]));
+		}
+		else if (strcmp(arg, "--tiles") == 0 && i + 2 < argc)
+		{
+			opts.first_tile = std::max(0, atoi(argv[++i]));
+			opts.last_tile = std::max(opts.first_tile, atoi(argv[++i]));
+		}
+		else if (strcmp(arg, "--merge") == 0 && has_value)
+		{
+			opts.merge.push_back(argv[++i]);
+		}
+		else if (strcmp(arg, "--workers") == 0 && has_value)
+		{
+			opts.workers = atoi(argv[++i]);
+		}
+		else if (strcmp(arg, "--worker") == 0 && i + 3 < argc)
+		{
+			opts.worker_in = atoi(argv[++i]);
+			opts.worker_out = atoi(argv[++i]);
+			opts.worker_part = argv[++i];
+		}
+		else if (strcmp(arg, "--bench-paths") == 0)
+		{
+			opts.bench_paths = true;
+		}
+		else if (strcmp(arg, "--bench-load") == 0)
+		{
+			opts.bench_load = true;
+		}
+		else if (strcmp(arg, "--bench-render") == 0)
+		{
+			opts.bench_render = true;
+		}
+		else if (strcmp(arg, "--bench-references") == 0)
+		{
+			opts.bench_references = true;
+		}
+		else if (strcmp(arg, "--bench-guiding") == 0 && has_value)
+		{
+			opts.bench_guiding = (float)atof(argv[++i]);
+		}
+		else if (strcmp(arg, "--bench-trace") == 0)
+		{
+			opts.bench_trace = true;
+		}
+		else
+		{
+			printf("Unknown or incomplete option: %s\n", arg);
+			print_usage(argv[0]);
+			exit(1);
+		}
+	}
+
+	if (opts.checkpoint.empty())
+		opts.checkpoint = opts.resume;
+	// the wavefront renderer only knows how to advance camera paths
+	if (opts.trace != TRACE_SINGLE && opts.integrator != INTEGRATOR_PT)
+	{
+		if (integrator_given)
+		{
+			printf("--trace packet and stream only path trace, use --integrator pt\n");
+			exit(1);
+		}
+		printf("--trace packet and stream path trace (--integrator pt) instead of bdpt\n");
+		opts.integrator = INTEGRATOR_PT;
+	}
+	if (opts.samples < 0)
+		opts.samples = opts.time_limit > 0 || opts.noise_limit > 0 ? 0 : DEFAULT_SAMPLES;
+	if (opts.guide_training < 0)
+		opts.guide_training = opts.samples > 0 && opts.bench_guiding == 0 ? opts.samples / 2 : 15;
+
+	if (opts.num_threads <= 0)
+		opts.num_threads = std::max(1u, std::thread::hardware_concurrency());
+
+	return opts;
+}
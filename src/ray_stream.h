@@ -0,0 +1,100 @@
+#pragma once
+
+#include <vector>
+using std::vector;
+
+#include <glm/glm.hpp>
+using namespace glm;
+
+const unsigned int INVALID_GEOMETRY_ID = 0xFFFFFFFF;
+
+enum trace_mode
+{
+	TRACE_SINGLE, // one ray at a time, depth first
+	TRACE_PACKET, // a tile's rays per bounce as a batch, traced in SoA packets
+	TRACE_STREAM, // a tile's rays per bounce as a batch, traced as one stream
+};
+
+// One ray, and what it hit. After a closest-hit query geom_id is
+// INVALID_GEOMETRY_ID on a miss; after an occlusion query it is something
+// else if the ray was blocked. Hits follow Embree's conventions: tfar is the
+// hit distance, ng the unnormalized geometric normal and (u, v) the
+// barycentrics of vertices 1 and 2. A hit on an instance has the instance's
+// id in inst_id and the mesh's id within its prototype in geom_id; other
+// hits leave inst_id at INVALID_GEOMETRY_ID. ng is always in world space.
+struct ray_hit
+{
+	vec3 org;
+	vec3 dir;
+	float tfar;
+
+	unsigned int geom_id = INVALID_GEOMETRY_ID;
+	unsigned int prim_id = INVALID_GEOMETRY_ID;
+	unsigned int inst_id = INVALID_GEOMETRY_ID;
+	vec3 ng;
+	float u = 0, v = 0;
+
+	ray_hit() {}
+	ray_hit(vec3 o, vec3 d, float t_far) : org(o), dir(d), tfar(t_far) {}
+};
+
+// A batch of rays in SoA layout, plus what they hit
+struct ray_stream
+{
+	vector<float> org_x, org_y, org_z;
+	vector<float> dir_x, dir_y, dir_z;
+	vector<float> tfar;
+
+	vector<unsigned int> geom_id;
+	vector<unsigned int> prim_id;
+	vector<unsigned int> inst_id;
+	vector<float> ng_x, ng_y, ng_z;
+	vector<float> u, v;
+
+	int size() const
+	{
+		return (int)tfar.size();
+	}
+
+	void clear()
+	{
+		org_x.clear(); org_y.clear(); org_z.clear();
+		dir_x.clear(); dir_y.clear(); dir_z.clear();
+		tfar.clear();
+		geom_id.clear(); prim_id.clear(); inst_id.clear();
+		ng_x.clear(); ng_y.clear(); ng_z.clear();
+		u.clear(); v.clear();
+	}
+
+	int add(vec3 o, vec3 dir, float t_far)
+	{
+		org_x.push_back(o.x); org_y.push_back(o.y); org_z.push_back(o.z);
+		dir_x.push_back(dir.x); dir_y.push_back(dir.y); dir_z.push_back(dir.z);
+		tfar.push_back(t_far);
+		geom_id.push_back(INVALID_GEOMETRY_ID);
+		prim_id.push_back(INVALID_GEOMETRY_ID);
+		inst_id.push_back(INVALID_GEOMETRY_ID);
+		ng_x.push_back(0); ng_y.push_back(0); ng_z.push_back(0);
+		u.push_back(0); v.push_back(0);
+		return size() - 1;
+	}
+
+	vec3 org(int i) const { return vec3(org_x[i], org_y[i], org_z[i]); }
+	vec3 dir(int i) const { return vec3(dir_x[i], dir_y[i], dir_z[i]); }
+	vec3 ng(int i) const { return vec3(ng_x[i], ng_y[i], ng_z[i]); }
+
+	ray_hit ray(int i) const
+	{
+		return ray_hit(org(i), dir(i), tfar[i]);
+	}
+
+	void store(int i, const ray_hit& r)
+	{
+		tfar[i] = r.tfar;
+		geom_id[i] = r.geom_id;
+		prim_id[i] = r.prim_id;
+		inst_id[i] = r.inst_id;
+		ng_x[i] = r.ng.x; ng_y[i] = r.ng.y; ng_z[i] = r.ng.z;
+		u[i] = r.u; v[i] = r.v;
+	}
+};
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <math.h>
+#include <algorithm>
+
+#include <glm/glm.hpp>
+using namespace glm;
+
+#include "CIE.h"
+#include "spectrum.h"
+
+//-----------------------------------------------------------------------------
+// RGB to spectrum uplift (Jakob & Hanika 2019)
+//-----------------------------------------------------------------------------
+// A smooth spectrum between 0 and 1: a sigmoid of a quadratic in wavelength.
+// Three coefficients per color, fitted once when a material is loaded, and
+// a handful of multiply-adds and a square root per wavelength to evaluate.
+struct rgb_spectrum
+{
+	float c[3] = { 0, 0, 1e4f }; // white
+
+	float eval(float lambda) const
+	{
+		float t = (lambda - LAMBDA_MIN) / (LAMBDA_MAX - LAMBDA_MIN);
+		float x = (c[0] * t + c[1]) * t + c[2];
+		return 0.5f + 0.5f * x / sqrt(1 + x * x);
+	}
+	spectrum eval(const spectrum& lambda) const
+	{
+		spectrum s;
+		for (int i = 0; i < SPECTRUM_LANES; ++i)
+			s[i] = eval(lambda[i]);
+		return s;
+	}
+};
+
+// Linear sRGB of a reflectance lit by a flat (equal energy) spectrum,
+// white balanced so that a reflectance of 1 is (1, 1, 1).
+vec3 reflectance_to_rgb(const rgb_spectrum& s)
+{
+	vec3 xyz = vec3(0), white = vec3(0);
+	for (int i = 0; i < CIE_SAMPLES; ++i)
+	{
+		vec3 cmf = vec3(x_bar[i], y_bar[i], z_bar[i]);
+		xyz += s.eval(LAMBDA_MIN + i * CIE_STEP) * cmf;
+		white += cmf;
+	}
+	return xyz_to_linear_rgb(xyz) / xyz_to_linear_rgb(white);
+}
+
+// The coefficients whose reflectance_to_rgb() comes closest to rgb, by
+// Levenberg-Marquardt from the flat spectrum of the same average. Components
+// are clamped a little inside [0, 1], which a sigmoid only reaches at infinity.
+rgb_spectrum fit_rgb_spectrum(vec3 rgb)
+{
+	rgb = clamp(rgb, 1e-4f, 1 - 1e-4f);
+
+	rgb_spectrum s;
+	float a = 2 * (rgb.x + rgb.y + rgb.z) / 3 - 1;
+	s.c[0] = 0;
+	s.c[1] = 0;
+	s.c[2] = a / sqrt(1 - a * a);
+
+	auto error = [&](const rgb_spectrum& f)
+	{
+		vec3 d = reflectance_to_rgb(f) - rgb;
+		return dot(d, d);
+	};
+
+	float err = error(s);
+	float damping = 1e-3f;
+	for (int iteration = 0; iteration < 100 && err > 1e-10f; ++iteration)
+	{
+		// Jacobian by central differences, one column per coefficient
+		vec3 r = reflectance_to_rgb(s) - rgb;
+		mat3 J;
+		for (int k = 0; k < 3; ++k)
+		{
+			const float h = 1e-3f;
+			rgb_spectrum lo = s, hi = s;
+			lo.c[k] -= h;
+			hi.c[k] += h;
+			J[k] = (reflectance_to_rgb(hi) - reflectance_to_rgb(lo)) / (2 * h);
+		}
+
+		mat3 JtJ = transpose(J) * J;
+		vec3 Jtr = transpose(J) * r;
+		while (damping < 1e8f)
+		{
+			mat3 A = JtJ;
+			for (int k = 0; k < 3; ++k)
+				A[k][k] += damping * std::max(A[k][k], 1e-6f);
+			vec3 step = inverse(A) * Jtr;
+
+			rgb_spectrum next = s;
+			for (int k = 0; k < 3; ++k)
+				next.c[k] = std::min(std::max(s.c[k] - step[k], -1e4f), 1e4f);
+			float next_err = error(next);
+			if (next_err < err)
+			{
+				s = next;
+				err = next_err;
+				damping = std::max(damping / 3, 1e-7f);
+				break;
+			}
+			damping *= 4;
+		}
+		if (damping >= 1e8f)
+			break;
+	}
+	return s;
+}
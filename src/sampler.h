@@ -0,0 +1,203 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <glm/glm.hpp>
+using namespace glm;
+
+//-----------------------------------------------------------------------------
+// Random number generators
+//-----------------------------------------------------------------------------
+// PCG32 (pcg-random.org), 64 bits of state plus a stream selector
+struct pcg32
+{
+	uint64_t state = 0x853c49e6748fea9bULL;
+	uint64_t inc = 0xda3e39cb94b95bdbULL;
+
+	void seed(uint64_t init_state, uint64_t stream)
+	{
+		state = 0;
+		inc = (stream << 1u) | 1u;
+		next();
+		state += init_state;
+		next();
+	}
+
+	uint32_t next()
+	{
+		uint64_t old = state;
+		state = old * 6364136223846793005ULL + inc;
+		uint32_t xorshifted = (uint32_t)(((old >> 18u) ^ old) >> 27u);
+		uint32_t rot = (uint32_t)(old >> 59u);
+		return (xorshifted >> rot) | (xorshifted << ((~rot + 1u) & 31));
+	}
+};
+
+// 32 bit integer hash (lowbias32), used to derive seeds
+uint32_t hash_u32(uint32_t x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352dU;
+	x ^= x >> 15;
+	x *= 0x846ca68bU;
+	x ^= x >> 16;
+	return x;
+}
+uint32_t hash_combine(uint32_t seed, uint32_t v)
+{
+	return hash_u32(seed ^ (v + 0x9e3779b9U + (seed << 6) + (seed >> 2)));
+}
+
+// [0, 1) from the top 24 bits
+float u32_to_float(uint32_t x)
+{
+	return (x >> 8) * (1.f / 16777216.f);
+}
+
+//-----------------------------------------------------------------------------
+// Owen-scrambled Sobol
+//-----------------------------------------------------------------------------
+// Burley 2020, "Practical Hash-based Owen Scrambling". The first four Sobol
+// dimensions are generated; higher dimensions are padded with independently
+// shuffled and scrambled copies of those four.
+const int SOBOL_DIMS = 4;
+uint32_t sobol_directions[SOBOL_DIMS][32];
+
+void init_sobol_directions()
+{
+	// Joe & Kuo primitive polynomials (degree s, coefficients a) and initial m values
+	const int s[SOBOL_DIMS] = { 0, 1, 2, 3 };
+	const int a[SOBOL_DIMS] = { 0, 0, 1, 1 };
+	const uint32_t m_init[SOBOL_DIMS][3] = { { 0 }, { 1 }, { 1, 3 }, { 1, 3, 1 } };
+
+	for (int i = 0; i < 32; ++i)
+		sobol_directions[0][i] = 1u << (31 - i); // van der Corput
+
+	for (int d = 1; d < SOBOL_DIMS; ++d)
+	{
+		uint32_t m[32];
+		for (int k = 0; k < 32; ++k)
+		{
+			if (k < s[d])
+			{
+				m[k] = m_init[d][k];
+				continue;
+			}
+
+			m[k] = m[k - s[d]] ^ (m[k - s[d]] << s[d]);
+			for (int j = 1; j < s[d]; ++j)
+				if ((a[d] >> (s[d] - 1 - j)) & 1)
+					m[k] ^= m[k - j] << j;
+		}
+
+		for (int k = 0; k < 32; ++k)
+			sobol_directions[d][k] = m[k] << (31 - k);
+	}
+}
+
+uint32_t sobol(uint32_t index, int dim)
+{
+	uint32_t x = 0;
+	for (int bit = 0; index; ++bit, index >>= 1)
+		if (index & 1)
+			x ^= sobol_directions[dim][bit];
+	return x;
+}
+
+uint32_t reverse_bits(uint32_t x)
+{
+	x = (x << 16) | (x >> 16);
+	x = ((x & 0x00ff00ffU) << 8) | ((x & 0xff00ff00U) >> 8);
+	x = ((x & 0x0f0f0f0fU) << 4) | ((x & 0xf0f0f0f0U) >> 4);
+	x = ((x & 0x33333333U) << 2) | ((x & 0xccccccccU) >> 2);
+	x = ((x & 0x55555555U) << 1) | ((x & 0xaaaaaaaaU) >> 1);
+	return x;
+}
+
+uint32_t laine_karras_permutation(uint32_t x, uint32_t seed)
+{
+	x += seed;
+	x ^= x * 0x6c50b47cU;
+	x ^= x * 0xb82f1e52U;
+	x ^= x * 0xc7afe638U;
+	x ^= x * 0x8d22f6e6U;
+	return x;
+}
+
+uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed)
+{
+	return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+float sobol_owen(uint32_t index, uint32_t dim, uint32_t seed)
+{
+	// all dims of one group of four share the index shuffle, so they stay
+	// jointly stratified
+	uint32_t group_seed = hash_combine(seed, dim / SOBOL_DIMS);
+	uint32_t shuffled = nested_uniform_scramble(index, group_seed);
+	uint32_t x = sobol(shuffled, dim % SOBOL_DIMS);
+	return u32_to_float(nested_uniform_scramble(x, hash_combine(seed, dim + 0x10000)));
+}
+
+//-----------------------------------------------------------------------------
+// Sampler
+//-----------------------------------------------------------------------------
+enum sampler_type
+{
+	SAMPLER_INDEPENDENT, // PCG32 per pixel and sample
+	SAMPLER_SOBOL,       // Owen-scrambled Sobol
+};
+
+// Hands out the random numbers of one path. Every draw takes the next
+// dimension, so as long as a path makes the same draws in the same order
+// (camera, wavelength, then BSDF / russian roulette per bounce and the light
+// selection at the end), a given dimension always drives the same decision.
+// Seeded from (pixel, sample index) only, which makes the image independent
+// of thread count and tile order.
+struct sampler
+{
+	sampler_type type = SAMPLER_INDEPENDENT;
+	uint32_t seed = 0;
+	uint32_t sample_index = 0;
+	uint32_t dimension = 0;
+	pcg32 rng;
+
+	void start_sample(sampler_type t, int x, int y, uint32_t index)
+	{
+		type = t;
+		seed = hash_combine(hash_u32(x), y);
+		sample_index = index;
+		dimension = 0;
+		rng.seed(seed, index);
+	}
+
+	float get_1d()
+	{
+		if (type == SAMPLER_SOBOL)
+			return sobol_owen(sample_index, dimension++, seed);
+		return u32_to_float(rng.next());
+	}
+
+	vec2 get_2d()
+	{
+		// keep both halves inside the same group of four
+		if (type == SAMPLER_SOBOL && dimension % 2)
+			++dimension;
+		float u = get_1d();
+		float v = get_1d();
+		return vec2(u, v);
+	}
+};
+
+// the sampler of the path the current thread is tracing
+thread_local sampler path_sampler;
+
+// [0, 1)
+float nrand()
+{
+	return path_sampler.get_1d();
+}
+vec2 nrand2()
+{
+	return path_sampler.get_2d();
+}
@@ -0,0 +1,378 @@
+#pragma once
+
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+using std::string;
+using std::vector;
+
+#include <glm/glm.hpp>
+using namespace glm;
+
+#include "tiny_obj_loader.h"
+
+#include "accelerator.h"
+#include "model.h"
+#include "obj_parser.h"
+#include "thread_pool.h"
+
+// Scenes in a text file, one statement per line, # to the end of a line is a
+// comment:
+//
+//   camera <position> <target> <horizontal field of view in degrees>
+//   material <name> <diffuse rgb> [specular <rgb> <exponent> [ior <n>]]
+//                   [emission <rgb> <intensity>]
+//   mesh <name> <file.obj> [<object> ...]
+//   instance <mesh> [material <name>] [scale <s> | scale <xyz>]
+//                   [rotate <axis> <degrees>] [translate <xyz>] ...
+//
+// Points, colors and axes are three numbers. Specular is Ks, Ns and Ni of
+// an .mtl, see set_specular(). A mesh is the shapes of the
+// .obj, or of the objects and groups named, with the materials of its .mtl.
+// Every mesh is built once as a prototype, and each instance places it with
+// its transforms applied in the order they're written, and with every shape
+// in one material if it names one. Relative paths are from the scene file.
+
+//-----------------------------------------------------------------------------
+// Camera
+//-----------------------------------------------------------------------------
+// A pinhole camera. The ray through the image at (x, y), both from -1/2 to
+// 1/2, points along forward + x * right + y * up.
+struct camera_settings
+{
+	vec3 position = vec3(0, 1, 2.9f);
+	vec3 forward = vec3(0, 0, -1);
+	vec3 right = vec3(1, 0, 0);
+	vec3 up = vec3(0, 1, 0);
+
+	void look_at(vec3 from, vec3 target, float fov_degrees, int width, int height)
+	{
+		float image_width = 2 * tan(fov_degrees * 3.14159265f / 360);
+		position = from;
+		forward = normalize(target - from);
+		vec3 r = normalize(cross(forward, vec3(0, 1, 0)));
+		right = r * image_width;
+		up = cross(r, forward) * (image_width * height / width);
+	}
+};
+camera_settings scene_camera;
+
+//-----------------------------------------------------------------------------
+// Loading
+//-----------------------------------------------------------------------------
+// a mesh statement, built into the accelerator
+struct scene_mesh
+{
+	unsigned int prototype;
+	// by geometry id within the prototype, which is also the mesh's in the
+	// buffer; it stays for the accelerator if that traces it, and otherwise
+	// only for instances that make it a light, until loading is done
+	vector<material> materials;
+	std::unique_ptr<mesh_buffer> buffer;
+};
+
+struct scene_parser
+{
+	string filename;
+	string directory; // of the scene file, with the separator
+	int line = 0;
+	vector<string> words;
+	size_t next = 0;
+
+	bool error(const char* message, const string& what = string())
+	{
+		printf("%s:%d: %s%s%s\n", filename.c_str(), line, message, what.empty() ? "" : " ", what.c_str());
+		return false;
+	}
+
+	bool more() const
+	{
+		return next < words.size();
+	}
+	bool number_next() const
+	{
+		if (!more())
+			return false;
+		char* end;
+		strtof(words[next].c_str(), &end);
+		return *end == 0;
+	}
+	bool word(string& out)
+	{
+		if (!more())
+			return error("missing argument");
+		out = words[next++];
+		return true;
+	}
+	bool number(float& out)
+	{
+		if (!more())
+			return error("missing number");
+		if (!number_next())
+			return error("not a number:", words[next]);
+		out = strtof(words[next++].c_str(), nullptr);
+		return true;
+	}
+	bool vector3(vec3& out)
+	{
+		return number(out.x) && number(out.y) && number(out.z);
+	}
+	// true if the next word is keyword, and takes it
+	bool keyword(const char* keyword)
+	{
+		if (!more() || words[next] != keyword)
+			return false;
+		next++;
+		return true;
+	}
+};
+
+// the words of each line, without comments
+void split_scene_line(const char* line, vector<string>& words)
+{
+	words.clear();
+	const char* p = line;
+	while (*p && *p != '#')
+	{
+		if (isspace((unsigned char)*p))
+		{
+			++p;
+			continue;
+		}
+		const char* start = p;
+		while (*p && *p != '#' && !isspace((unsigned char)*p))
+			++p;
+		words.push_back(string(start, p));
+	}
+}
+
+// rotation by degrees around axis, Rodrigues' formula
+mat4 rotation_matrix(vec3 axis, float degrees)
+{
+	vec3 a = normalize(axis);
+	float angle = degrees * 3.14159265f / 180;
+	float c = cos(angle), s = sin(angle), t = 1 - c;
+	mat4 m(1);
+	m[0] = vec4(t * a.x * a.x + c, t * a.x * a.y + s * a.z, t * a.x * a.z - s * a.y, 0);
+	m[1] = vec4(t * a.x * a.y - s * a.z, t * a.y * a.y + c, t * a.y * a.z + s * a.x, 0);
+	m[2] = vec4(t * a.x * a.z + s * a.y, t * a.y * a.z - s * a.x, t * a.z * a.z + c, 0);
+	return m;
+}
+
+bool load_scene_mesh(accelerator& accel, thread_pool& pool, scene_parser& in, scene_mesh& mesh)
+{
+	string file;
+	if (!in.word(file))
+		return false;
+	vector<string> objects(in.words.begin() + in.next, in.words.end());
+	in.next = in.words.size();
+
+	bool absolute = file[0] == '/' || file[0] == '\\' || (file.size() > 1 && file[1] == ':');
+	string path = absolute ? file : in.directory + file;
+	size_t slash = path.find_last_of("/\\");
+	string mtl_path = slash == string::npos ? string() : path.substr(0, slash + 1);
+
+	printf("Loading .obj file: %s\n", path.c_str());
+	mesh.buffer.reset(new mesh_buffer());
+	vector<obj_mesh> shapes;
+	vector<material_t> materials;
+	string err = load_obj_meshes(*mesh.buffer, shapes, materials, path.c_str(), mtl_path.c_str(), pool, objects);
+	if (!err.empty())
+		printf("\n\nTINYOBJ ERROR: %s\n\n", err.c_str());
+	vector<material> fitted = fit_obj_materials(materials);
+
+	mesh.prototype = accel.begin_prototype();
+	for (size_t i = 0; i < shapes.size(); ++i)
+	{
+		const mesh_span& m = mesh.buffer->meshes[i];
+		accel.add_shared_mesh(mesh.buffer->vertices(i), m.num_vertices, mesh.buffer->indices(i), m.num_triangles);
+		mesh.materials.push_back(obj_material(shapes[i].material, fitted));
+	}
+	accel.end_prototype();
+
+	if (mesh.materials.empty())
+		return in.error("no shapes in", path);
+	return true;
+}
+
+bool add_scene_instance(accelerator& accel, scene_parser& in, const std::map<string, scene_mesh>& meshes,
+	const std::map<string, material>& materials)
+{
+	string name;
+	if (!in.word(name))
+		return false;
+	auto mesh = meshes.find(name);
+	if (mesh == meshes.end())
+		return in.error("unknown mesh", name);
+
+	mat4 transform(1);
+	const material* override_mat = nullptr;
+	while (in.more())
+	{
+		if (in.keyword("material"))
+		{
+			string mat_name;
+			if (!in.word(mat_name))
+				return false;
+			auto m = materials.find(mat_name);
+			if (m == materials.end())
+				return in.error("unknown material", mat_name);
+			override_mat = &m->second;
+		}
+		else if (in.keyword("scale"))
+		{
+			vec3 s;
+			if (!in.number(s.x))
+				return false;
+			s.y = s.z = s.x;
+			if (in.number_next() && !(in.number(s.y) && in.number(s.z)))
+				return false;
+			mat4 m(1);
+			m[0][0] = s.x;
+			m[1][1] = s.y;
+			m[2][2] = s.z;
+			transform = m * transform;
+		}
+		else if (in.keyword("rotate"))
+		{
+			vec3 axis;
+			float degrees;
+			if (!in.vector3(axis) || !in.number(degrees))
+				return false;
+			transform = rotation_matrix(axis, degrees) * transform;
+		}
+		else if (in.keyword("translate"))
+		{
+			vec3 t;
+			if (!in.vector3(t))
+				return false;
+			mat4 m(1);
+			m[3] = vec4(t, 1);
+			transform = m * transform;
+		}
+		else
+			return in.error("unknown instance setting", in.words[in.next]);
+	}
+
+	const scene_mesh& sm = mesh->second;
+	unsigned int instance = accel.add_instance(sm.prototype, transform);
+	int first_model = (int)models.size();
+	set_geometry_model(instance, first_model);
+	for (size_t i = 0; i < sm.materials.size(); ++i)
+	{
+		model cur_model;
+		cur_model.mat = override_mat ? *override_mat : sm.materials[i];
+		cur_model.mat.albedo = material_albedo(cur_model.mat);
+		cur_model.geom_id = (unsigned int)i;
+		add_model_lights(sm.buffer->vertices(i), 4, sm.buffer->indices(i), sm.buffer->meshes[i].num_triangles,
+			cur_model.mat, (int)models.size(), transform);
+		models.push_back(cur_model);
+	}
+	return true;
+}
+
+// Adds the scene in filename to accel and sets scene_camera for an image of
+// width by height. Prints what's wrong and returns false on errors.
+bool load_scene(accelerator& accel, thread_pool& pool, const string& filename, int width, int height)
+{
+	FILE* f = fopen(filename.c_str(), "r");
+	if (!f)
+	{
+		printf("Can't open scene %s\n", filename.c_str());
+		return false;
+	}
+
+	scene_parser in;
+	in.filename = filename;
+	size_t slash = filename.find_last_of("/\\");
+	in.directory = slash == string::npos ? string() : filename.substr(0, slash + 1);
+
+	std::map<string, scene_mesh> meshes;
+	std::map<string, material> materials;
+	int num_instances = 0;
+	bool ok = true;
+	char buffer[4096];
+	while (ok && fgets(buffer, sizeof(buffer), f))
+	{
+		in.line++;
+		split_scene_line(buffer, in.words);
+		in.next = 0;
+		if (in.words.empty())
+			continue;
+
+		string statement = in.words[in.next++];
+		if (statement == "camera")
+		{
+			vec3 from, target;
+			float fov;
+			ok = in.vector3(from) && in.vector3(target) && in.number(fov);
+			if (ok)
+				scene_camera.look_at(from, target, fov, width, height);
+		}
+		else if (statement == "material")
+		{
+			string name;
+			vec3 kd;
+			ok = in.word(name) && in.vector3(kd);
+			material mat;
+			mat.reflectance = fit_rgb_spectrum(kd);
+			if (ok && in.keyword("specular"))
+			{
+				vec3 ks;
+				float exponent, ior = 0;
+				ok = in.vector3(ks) && in.number(exponent);
+				if (ok && in.keyword("ior"))
+					ok = in.number(ior);
+				set_specular(mat, kd, ks, exponent, ior);
+			}
+			if (ok && in.keyword("emission"))
+			{
+				vec3 ke;
+				ok = in.vector3(ke) && in.number(mat.light_intensity);
+				mat.emission = fit_rgb_spectrum(ke);
+			}
+			materials[name] = mat;
+		}
+		else if (statement == "mesh")
+		{
+			string name;
+			ok = in.word(name);
+			if (ok && meshes.count(name))
+				ok = in.error("mesh defined twice:", name);
+			if (ok)
+				ok = load_scene_mesh(accel, pool, in, meshes[name]);
+		}
+		else if (statement == "instance")
+		{
+			ok = add_scene_instance(accel, in, meshes, materials);
+			num_instances++;
+		}
+		else
+			ok = in.error("unknown statement", statement);
+
+		if (ok && in.more())
+			ok = in.error("too many arguments");
+	}
+	fclose(f);
+	if (!ok)
+		return false;
+
+	size_t triangles = 0;
+	for (auto& m : meshes)
+	{
+		for (const mesh_span& span : m.second.buffer->meshes)
+			triangles += span.num_triangles;
+		if (accel.traces_shared_meshes())
+			shared_mesh_buffers.push_back(std::move(m.second.buffer));
+	}
+	printf("Scene %s: %d meshes, %zu triangles, %d instances\n", filename.c_str(), (int)meshes.size(), triangles, num_instances);
+
+	update_light_sampling();
+	return true;
+}
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <math.h>
+#include <vector>
+using std::vector;
+
+#include <glm/glm.hpp>
+using namespace glm;
+
+#include "accelerator.h"
+#include "material.h"
+#include "model.h"
+#include "thread_pool.h"
+
+// The scenes --bench-render renders: the Cornell box with the dragon, and two
+// made from it in code for what it doesn't have, lots of triangles and lots
+// of lights. Also one with only indirect light, for --bench-guiding.
+
+//-----------------------------------------------------------------------------
+// Generated geometry
+//-----------------------------------------------------------------------------
+// A sphere with ripples on it, 2 * rings * segments triangles
+void add_bumpy_sphere(accelerator& accel, vec3 center, float radius, int rings, int segments, const material& mat)
+{
+	const float pi = 3.14159265f;
+	vector<float> positions;
+	vector<unsigned int> indices;
+	positions.reserve(3 * (rings + 1) * segments);
+	indices.reserve(6 * rings * segments);
+
+	for (int r = 0; r <= rings; ++r)
+	{
+		float theta = pi * r / rings;
+		for (int s = 0; s < segments; ++s)
+		{
+			float phi = 2 * pi * s / segments;
+			vec3 n = vec3(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi));
+			float bump = 1 + 0.03f * sin(40 * theta) * sin(24 * phi);
+			vec3 p = center + radius * bump * n;
+			positions.push_back(p.x);
+			positions.push_back(p.y);
+			positions.push_back(p.z);
+		}
+	}
+	for (int r = 0; r < rings; ++r)
+	{
+		for (int s = 0; s < segments; ++s)
+		{
+			unsigned int a = r * segments + s;
+			unsigned int b = r * segments + (s + 1) % segments;
+			unsigned int c = a + segments;
+			unsigned int d = b + segments;
+			unsigned int quad[6] = { a, c, b, b, c, d };
+			indices.insert(indices.end(), quad, quad + 6);
+		}
+	}
+
+	add_model(accel, positions, indices, mat);
+}
+
+// size by size squares facing +z, two triangles each, as one model
+void add_squares(accelerator& accel, const vector<vec3>& centers, float size, const material& mat)
+{
+	vector<float> positions;
+	vector<unsigned int> indices;
+	float h = size / 2;
+	for (vec3 c : centers)
+	{
+		unsigned int first = (unsigned int)positions.size() / 3;
+		vec3 corners[4] = { c + vec3(-h, -h, 0), c + vec3(h, -h, 0), c + vec3(h, h, 0), c + vec3(-h, h, 0) };
+		for (vec3 p : corners)
+		{
+			positions.push_back(p.x);
+			positions.push_back(p.y);
+			positions.push_back(p.z);
+		}
+		unsigned int quad[6] = { first, first + 1, first + 2, first, first + 2, first + 3 };
+		indices.insert(indices.end(), quad, quad + 6);
+	}
+
+	add_model(accel, positions, indices, mat);
+}
+
+//-----------------------------------------------------------------------------
+// Bench scenes
+//-----------------------------------------------------------------------------
+void build_cornell_scene(accelerator& accel, thread_pool& pool, bool use_cache)
+{
+	addObj(accel, pool, "models/GP.obj", vec3(0, 0, 0), 1, use_cache);
+}
+
+// about a million triangles in one sphere, up in a corner
+void build_dense_scene(accelerator& accel, thread_pool& pool, bool use_cache)
+{
+	addObj(accel, pool, "models/GP.obj", vec3(0, 0, 0), 1, use_cache);
+
+	material mat;
+	mat.reflectance = fit_rgb_spectrum(vec3(0.8f, 0.6f, 0.2f));
+	add_bumpy_sphere(accel, vec3(0.55f, 1.4f, -0.5f), 0.3f, 512, 1024, mat);
+	update_light_sampling();
+}
+
+// 256 small lights in four colors on the back wall
+void build_many_lights_scene(accelerator& accel, thread_pool& pool, bool use_cache)
+{
+	addObj(accel, pool, "models/GP.obj", vec3(0, 0, 0), 1, use_cache);
+
+	const vec3 colors[4] = { vec3(1, 0.3f, 0.1f), vec3(0.2f, 0.5f, 1), vec3(0.3f, 1, 0.3f), vec3(1, 1, 1) };
+	const int grid = 16;
+	for (int c = 0; c < 4; ++c)
+	{
+		vector<vec3> centers;
+		for (int i = c; i < grid * grid; i += 4)
+		{
+			int x = i % grid, y = i / grid;
+			centers.push_back(vec3(-0.9f + 1.8f * x / (grid - 1), 0.1f + 1.8f * y / (grid - 1), -1.02f));
+		}
+
+		material mat;
+		mat.reflectance = fit_rgb_spectrum(vec3(0.1f));
+		mat.emission = fit_rgb_spectrum(colors[c]);
+		mat.light_intensity = 0.3f;
+		add_squares(accel, centers, 0.04f, mat);
+	}
+	update_light_sampling();
+}
+
+// The light boxed in from below by a panel, so it only gets out through the
+// gap between that and the ceiling: nearly all the room sees of it comes off
+// the ceiling first. --bench-guiding renders it.
+void build_indirect_scene(accelerator& accel, thread_pool& pool, bool use_cache)
+{
+	addObj(accel, pool, "models/GP.obj", vec3(0, 0, 0), 1, use_cache);
+
+	vector<float> positions = { -1, 1.9f, -1.04f, 1, 1.9f, -1.04f, 1, 1.9f, 0.75f, -1, 1.9f, 0.75f };
+	vector<unsigned int> indices = { 0, 1, 2, 0, 2, 3 };
+	material mat;
+	mat.reflectance = fit_rgb_spectrum(vec3(0.8f));
+	add_model(accel, positions, indices, mat);
+	update_light_sampling();
+}
+
+struct bench_scene
+{
+	const char* name; // the reference image is bench/<name>.ppm
+	void (*build)(accelerator& accel, thread_pool& pool, bool use_cache);
+	float max_rmse;   // of the tonemapped image against the reference
+};
+
+// The bounds are about 1.2 times what the renderer that made the references
+// gets at BENCH_SAMPLES, mostly noise: far enough off to fail is a change in
+// brightness, or in how noisy the estimator is.
+const bench_scene bench_scenes[] =
+{
+	{ "cornell", build_cornell_scene, 0.08f },
+	{ "dense", build_dense_scene, 0.085f },
+	{ "lights", build_many_lights_scene, 0.115f },
+};
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <math.h>
+#include <algorithm>
+
+// Number of wavelengths every path carries. 4 fills an SSE register, 8 an
+// AVX one; the loops below are written so the compiler can vectorize them.
+#ifndef SPECTRUM_LANES
+#define SPECTRUM_LANES 4
+#endif
+
+const float LAMBDA_MIN = 390;
+const float LAMBDA_MAX = 830;
+
+//-----------------------------------------------------------------------------
+// Spectrum
+//-----------------------------------------------------------------------------
+// One value per wavelength of a path. Lane 0 belongs to the hero wavelength.
+struct alignas(4 * SPECTRUM_LANES) spectrum
+{
+	float v[SPECTRUM_LANES];
+
+	spectrum() {}
+	explicit spectrum(float x)
+	{
+		for (int i = 0; i < SPECTRUM_LANES; ++i)
+			v[i] = x;
+	}
+
+	float& operator[](int i) { return v[i]; }
+	float operator[](int i) const { return v[i]; }
+
+	spectrum& operator+=(const spectrum& b)
+	{
+		for (int i = 0; i < SPECTRUM_LANES; ++i)
+			v[i] += b.v[i];
+		return *this;
+	}
+	spectrum& operator*=(const spectrum& b)
+	{
+		for (int i = 0; i < SPECTRUM_LANES; ++i)
+			v[i] *= b.v[i];
+		return *this;
+	}
+	spectrum& operator*=(float b)
+	{
+		for (int i = 0; i < SPECTRUM_LANES; ++i)
+			v[i] *= b;
+		return *this;
+	}
+	spectrum& operator/=(float b)
+	{
+		return *this *= 1 / b;
+	}
+};
+
+inline spectrum operator+(spectrum a, const spectrum& b) { return a += b; }
+inline spectrum operator*(spectrum a, const spectrum& b) { return a *= b; }
+inline spectrum operator*(spectrum a, float b) { return a *= b; }
+inline spectrum operator*(float a, spectrum b) { return b *= a; }
+inline spectrum operator/(spectrum a, float b) { return a /= b; }
+
+inline float max_value(const spectrum& s)
+{
+	float m = s[0];
+	for (int i = 1; i < SPECTRUM_LANES; ++i)
+		m = std::max(m, s[i]);
+	return m;
+}
+
+//-----------------------------------------------------------------------------
+// Hero wavelength sampling (Wilkie et al. 2014)
+//-----------------------------------------------------------------------------
+const int WAVELENGTH_BINS = 88;
+
+// Piecewise constant pdf over WAVELENGTH_BINS equal bins of the visible
+// range, sampled by inverting its CDF. Uniform until built.
+struct wavelength_distribution
+{
+	float pdf[WAVELENGTH_BINS]; // per nm
+	float cdf[WAVELENGTH_BINS + 1];
+
+	wavelength_distribution()
+	{
+		float w[WAVELENGTH_BINS];
+		std::fill(w, w + WAVELENGTH_BINS, 1.f);
+		build(w);
+	}
+
+	// weights of the bins, not all 0
+	void build(const float* weights)
+	{
+		const float bin_width = (LAMBDA_MAX - LAMBDA_MIN) / WAVELENGTH_BINS;
+		double total = 0;
+		for (int i = 0; i < WAVELENGTH_BINS; ++i)
+			total += weights[i];
+
+		cdf[0] = 0;
+		double sum = 0;
+		for (int i = 0; i < WAVELENGTH_BINS; ++i)
+		{
+			pdf[i] = (float)(weights[i] / (total * bin_width));
+			sum += weights[i];
+			cdf[i + 1] = (float)(sum / total);
+		}
+		cdf[WAVELENGTH_BINS] = 1;
+	}
+
+	float sample(float u) const
+	{
+		const float bin_width = (LAMBDA_MAX - LAMBDA_MIN) / WAVELENGTH_BINS;
+		int i = (int)(std::upper_bound(cdf, cdf + WAVELENGTH_BINS + 1, u) - cdf) - 1;
+		i = std::max(0, std::min(i, WAVELENGTH_BINS - 1));
+		float f = (u - cdf[i]) / std::max(cdf[i + 1] - cdf[i], 1e-12f);
+		return LAMBDA_MIN + (i + std::min(f, 1.f)) * bin_width;
+	}
+
+	float eval(float lambda) const
+	{
+		int i = (int)((lambda - LAMBDA_MIN) * (WAVELENGTH_BINS / (LAMBDA_MAX - LAMBDA_MIN)));
+		return pdf[std::max(0, std::min(i, WAVELENGTH_BINS - 1))];
+	}
+};
+
+// The hero wavelength is drawn from this; the other lanes are spaced evenly
+// after it, wrapping around the visible range, so each path covers the whole
+// spectrum.
+wavelength_distribution hero_wavelengths;
+
+inline float rotate_wavelength(float lambda, int lanes)
+{
+	const float range = LAMBDA_MAX - LAMBDA_MIN;
+	float x = lambda - LAMBDA_MIN + lanes * (range / SPECTRUM_LANES);
+	x -= range * floor(x / range);
+	return LAMBDA_MIN + x;
+}
+
+inline float wavelength_pdf(float lambda)
+{
+	return hero_wavelengths.eval(lambda);
+}
+
+inline spectrum sample_wavelengths(float u)
+{
+	spectrum lambda;
+	lambda[0] = hero_wavelengths.sample(u);
+	for (int i = 1; i < SPECTRUM_LANES; ++i)
+		lambda[i] = rotate_wavelength(lambda[0], i);
+	return lambda;
+}
+
+// Spectral MIS: any lane's wavelength could have been the hero, so weight each
+// lane by the balance heuristic over all of those ways to generate it. The
+// result already contains the 1 / pdf, multiply it with the path's value and
+// sum the lanes.
+inline spectrum wavelength_weights(const spectrum& lambda)
+{
+	spectrum w;
+	for (int i = 0; i < SPECTRUM_LANES; ++i)
+	{
+		float pdf_sum = 0;
+		for (int k = 0; k < SPECTRUM_LANES; ++k)
+			pdf_sum += wavelength_pdf(rotate_wavelength(lambda[i], -k));
+		w[i] = 1 / pdf_sum;
+	}
+	return w;
+}
@@ -0,0 +1,326 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+using std::string;
+using std::vector;
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "psapi.lib")
+#endif
+#else
+#include <sys/resource.h>
+#endif
+
+// Counters and timers for where render time goes. Every thread counts into
+// a block of its own, so the hot path only ever touches its own cache lines;
+// the blocks are added up for the summary at the end. Define ALBEDO_NO_STATS
+// to compile all of it out.
+
+//-----------------------------------------------------------------------------
+// Clock
+//-----------------------------------------------------------------------------
+// The time stamp counter where there is one: a few cycles to read, where the
+// steady clock takes tens of nanoseconds. Converted to seconds by comparing
+// both over the whole run.
+inline uint64_t stats_ticks()
+{
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// Per thread counters
+//-----------------------------------------------------------------------------
+const int PATH_LENGTH_BINS = 16; // the last one counts every longer path too
+
+// why a camera path stopped
+enum path_end
+{
+	PATH_ESCAPED,
+	PATH_RUSSIAN_ROULETTE,
+	PATH_HIT_LIGHT,
+	PATH_TOO_LONG,
+	PATH_ABSORBED, // a glossy reflection that would leave below the surface
+	PATH_END_COUNT,
+};
+const char* path_end_names[PATH_END_COUNT] = { "escaped", "russian roulette", "hit a light", "too long", "absorbed" };
+
+// a span of time on one thread, for the timeline
+struct stats_event
+{
+	const char* name;
+	uint64_t begin, end;
+};
+
+struct thread_stats
+{
+	int thread; // in order of first use; the main thread is usually 0
+
+	uint64_t primary_rays = 0;
+	uint64_t bounce_rays = 0;
+	uint64_t light_rays = 0; // extending bidirectional light paths
+	uint64_t shadow_rays = 0;
+	uint64_t path_ends[PATH_END_COUNT] = {};
+	uint64_t path_lengths[PATH_LENGTH_BINS] = {}; // surface vertices of camera paths
+
+	uint64_t trace_ticks = 0; // inside the accelerator
+	uint64_t busy_ticks = 0;  // rendering tiles, tracing included
+
+	vector<stats_event> events; // only with a timeline
+
+	uint64_t rays() const
+	{
+		return primary_rays + bounce_rays + light_rays + shadow_rays;
+	}
+};
+
+struct stats_registry
+{
+	std::mutex lock;
+	vector<std::unique_ptr<thread_stats>> threads;
+	bool timeline = false; // record events for write_timeline()
+
+	uint64_t start_ticks = stats_ticks();
+	std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+
+	thread_stats* add_thread()
+	{
+		std::lock_guard<std::mutex> l(lock);
+		threads.emplace_back(new thread_stats());
+		threads.back()->thread = (int)threads.size() - 1;
+		return threads.back().get();
+	}
+
+	double ticks_per_second() const
+	{
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+		return seconds > 0 ? (stats_ticks() - start_ticks) / seconds : 1e9;
+	}
+};
+stats_registry all_stats;
+
+inline thread_stats& local_stats()
+{
+	thread_local thread_stats* s = all_stats.add_thread();
+	return *s;
+}
+
+// Adds the ticks it was alive to one of the thread's counters, and if name
+// isn't null and the timeline is on, records it as an event.
+struct stats_timer
+{
+	uint64_t thread_stats::* total;
+	const char* name;
+	uint64_t begin;
+
+	stats_timer(uint64_t thread_stats::* total, const char* name = nullptr) : total(total), name(name), begin(stats_ticks()) {}
+	~stats_timer()
+	{
+		uint64_t end = stats_ticks();
+		thread_stats& s = local_stats();
+		if (total)
+			s.*total += end - begin;
+		if (name && all_stats.timeline)
+			s.events.push_back({ name, begin, end });
+	}
+};
+
+//-----------------------------------------------------------------------------
+// Stages
+//-----------------------------------------------------------------------------
+// The big steps of a run, timed on the thread that runs them.
+struct stats_stage_time
+{
+	const char* name;
+	uint64_t ticks;
+};
+vector<stats_stage_time> stats_stages;
+
+struct stats_stage
+{
+	const char* name;
+	uint64_t begin;
+
+	stats_stage(const char* name) : name(name), begin(stats_ticks())
+	{
+		local_stats(); // so the main thread comes first
+	}
+	~stats_stage()
+	{
+		uint64_t end = stats_ticks();
+		if (all_stats.timeline)
+			local_stats().events.push_back({ name, begin, end });
+
+		// a stage that runs more than once, like saving checkpoints, adds up
+		for (stats_stage_time& s : stats_stages)
+		{
+			if (strcmp(s.name, name) == 0)
+			{
+				s.ticks += end - begin;
+				return;
+			}
+		}
+		stats_stages.push_back({ name, end - begin });
+	}
+};
+
+#ifndef ALBEDO_NO_STATS
+#define STATS_CONCAT2(a, b) a##b
+#define STATS_CONCAT(a, b) STATS_CONCAT2(a, b)
+#define STATS_ADD(field, n) (local_stats().field += (n))
+#define STATS_PATH_END(reason, length) stats_path_end(reason, length)
+#define STATS_TIME(field) stats_timer STATS_CONCAT(stats_timer_, __LINE__)(&thread_stats::field)
+#define STATS_TIME_EVENT(field, name) stats_timer STATS_CONCAT(stats_timer_, __LINE__)(&thread_stats::field, name)
+#define STATS_STAGE(name) stats_stage STATS_CONCAT(stats_stage_, __LINE__)(name)
+#else
+#define STATS_ADD(field, n) ((void)0)
+#define STATS_PATH_END(reason, length) ((void)0)
+#define STATS_TIME(field) ((void)0)
+#define STATS_TIME_EVENT(field, name) ((void)0)
+#define STATS_STAGE(name) ((void)0)
+#endif
+
+inline void stats_path_end(path_end reason, int length)
+{
+	thread_stats& s = local_stats();
+	s.path_ends[reason]++;
+	s.path_lengths[length < PATH_LENGTH_BINS ? length : PATH_LENGTH_BINS - 1]++;
+}
+
+//-----------------------------------------------------------------------------
+// Memory
+//-----------------------------------------------------------------------------
+// The most memory the process has had resident at once so far, in bytes, 0
+// where that's unknown. Not compiled out with the rest.
+uint64_t peak_memory()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return 0;
+	return counters.PeakWorkingSetSize;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+#ifdef __APPLE__
+	return (uint64_t)usage.ru_maxrss; // bytes there, KB elsewhere
+#else
+	return (uint64_t)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// Output
+//-----------------------------------------------------------------------------
+// every thread's counters added up, without the events
+thread_stats stats_total()
+{
+	std::lock_guard<std::mutex> l(all_stats.lock);
+	thread_stats total;
+	total.thread = -1;
+	for (const auto& t : all_stats.threads)
+	{
+		total.primary_rays += t->primary_rays;
+		total.bounce_rays += t->bounce_rays;
+		total.light_rays += t->light_rays;
+		total.shadow_rays += t->shadow_rays;
+		for (int i = 0; i < PATH_END_COUNT; ++i)
+			total.path_ends[i] += t->path_ends[i];
+		for (int i = 0; i < PATH_LENGTH_BINS; ++i)
+			total.path_lengths[i] += t->path_lengths[i];
+		total.trace_ticks += t->trace_ticks;
+		total.busy_ticks += t->busy_ticks;
+	}
+	return total;
+}
+
+// render_seconds is the wall clock time of the render loop, for the ray rates
+void print_stats_summary(double render_seconds)
+{
+#ifndef ALBEDO_NO_STATS
+	double tps = all_stats.ticks_per_second();
+	thread_stats total = stats_total();
+
+	printf("Stats:\n");
+	for (const stats_stage_time& s : stats_stages)
+		printf("  %-12s %10.1f ms\n", s.name, s.ticks / tps * 1000);
+	printf("  peak memory: %.1f MB\n", peak_memory() / (1024.0 * 1024.0));
+	if (total.busy_ticks > 0)
+	{
+		double trace = std::min(1.0, (double)total.trace_ticks / total.busy_ticks);
+		printf("  of the render threads' time: %.0f%% tracing, %.0f%% shading\n", trace * 100, (1 - trace) * 100);
+	}
+
+	uint64_t rays = total.rays();
+	printf("  rays: %.2fM primary, %.2fM bounce, %.2fM light path, %.2fM shadow; %.2f Mrays/s\n",
+		total.primary_rays / 1e6, total.bounce_rays / 1e6, total.light_rays / 1e6, total.shadow_rays / 1e6,
+		render_seconds > 0 ? rays / render_seconds / 1e6 : 0.0);
+
+	uint64_t paths = 0;
+	for (int i = 0; i < PATH_END_COUNT; ++i)
+		paths += total.path_ends[i];
+	if (paths == 0)
+		return;
+	printf("  camera paths: %.2fM, ended by", paths / 1e6);
+	for (int i = 0; i < PATH_END_COUNT; ++i)
+		printf("%s %s %.1f%%", i ? "," : "", path_end_names[i], 100.0 * total.path_ends[i] / paths);
+	printf("\n  surface vertices:");
+	for (int i = 0; i < PATH_LENGTH_BINS; ++i)
+		if (total.path_lengths[i] > 0)
+			printf(" %d%s: %.1f%%", i, i == PATH_LENGTH_BINS - 1 ? "+" : "", 100.0 * total.path_lengths[i] / paths);
+	printf("\n");
+#endif
+}
+
+// Every recorded event as a Chrome trace (chrome://tracing, Perfetto), one
+// row per thread.
+bool write_timeline(const string& filename)
+{
+	FILE* f = fopen(filename.c_str(), "w");
+	if (!f)
+	{
+		printf("Can't write timeline %s\n", filename.c_str());
+		return false;
+	}
+
+	double us_per_tick = 1e6 / all_stats.ticks_per_second();
+	fprintf(f, "{\"traceEvents\":[\n");
+	bool first = true;
+	for (const auto& t : all_stats.threads)
+	{
+		fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,\"args\":{\"name\":\"%s %d\"}}",
+			first ? "" : ",\n", t->thread, t->thread == 0 ? "main" : "thread", t->thread);
+		first = false;
+		for (const stats_event& e : t->events)
+		{
+			fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+				e.name, t->thread, (e.begin - all_stats.start_ticks) * us_per_tick, (e.end - e.begin) * us_per_tick);
+		}
+	}
+	fprintf(f, "\n]}\n");
+	bool ok = ferror(f) == 0;
+	fclose(f);
+	return ok;
+}
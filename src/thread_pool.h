@@ -0,0 +1,175 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+using std::atomic;
+using std::condition_variable;
+using std::deque;
+using std::function;
+using std::lock_guard;
+using std::mutex;
+using std::thread;
+using std::unique_lock;
+using std::unique_ptr;
+using std::vector;
+
+// Work-stealing pool. parallel_for() deals the items out to one queue per
+// worker; a worker drains its own queue from the back and, once it runs dry,
+// steals from the front of the other queues. Tiles in the middle of the image
+// cost a lot more than the ones in the corners, so stealing keeps every core
+// busy until the very end of a pass.
+struct thread_pool
+{
+	// items carry their task so a worker that wakes up late can never run
+	// an index from one parallel_for() against the function of another
+	struct work_item
+	{
+		const function<void(int)>* fn;
+		int index;
+	};
+	struct work_queue
+	{
+		mutex lock;
+		deque<work_item> items;
+	};
+
+	vector<thread> threads;
+	vector<unique_ptr<work_queue>> queues;
+
+	atomic<int> remaining;
+
+	mutex state_lock;
+	condition_variable work_ready;
+	condition_variable work_done;
+	unsigned int generation = 0;
+	bool quit = false;
+
+	thread_pool(int num_threads)
+	{
+		if (num_threads < 1)
+			num_threads = 1;
+
+		remaining = 0;
+		for (int i = 0; i < num_threads; ++i)
+			queues.emplace_back(new work_queue());
+		for (int i = 0; i < num_threads; ++i)
+			threads.emplace_back(&thread_pool::worker_main, this, i);
+	}
+
+	~thread_pool()
+	{
+		{
+			lock_guard<mutex> l(state_lock);
+			quit = true;
+		}
+		work_ready.notify_all();
+		for (thread& t : threads)
+			t.join();
+	}
+
+	int size() const
+	{
+		return (int)threads.size();
+	}
+
+	// runs fn(0) .. fn(count - 1) on the workers and blocks until all are done
+	void parallel_for(int count, const function<void(int)>& fn)
+	{
+		if (count <= 0)
+			return;
+
+		// set before any item is visible, a worker still spinning on the
+		// previous batch may pick up one of these straight away
+		remaining = count;
+
+		// hand out contiguous runs so neighbouring tiles start on the same core
+		int num_queues = (int)queues.size();
+		for (int q = 0; q < num_queues; ++q)
+		{
+			lock_guard<mutex> l(queues[q]->lock);
+			for (int i = count * q / num_queues; i < count * (q + 1) / num_queues; ++i)
+				queues[q]->items.push_back({ &fn, i });
+		}
+
+		{
+			lock_guard<mutex> l(state_lock);
+			++generation;
+		}
+		work_ready.notify_all();
+
+		unique_lock<mutex> l(state_lock);
+		work_done.wait(l, [this] { return remaining == 0; });
+	}
+
+	bool pop_or_steal(int self, work_item& item)
+	{
+		// own queue first, newest item
+		{
+			work_queue& q = *queues[self];
+			lock_guard<mutex> l(q.lock);
+			if (!q.items.empty())
+			{
+				item = q.items.back();
+				q.items.pop_back();
+				return true;
+			}
+		}
+
+		// then steal the oldest item from someone else
+		int num_queues = (int)queues.size();
+		for (int i = 1; i < num_queues; ++i)
+		{
+			work_queue& q = *queues[(self + i) % num_queues];
+			lock_guard<mutex> l(q.lock);
+			if (!q.items.empty())
+			{
+				item = q.items.front();
+				q.items.pop_front();
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void worker_main(int self)
+	{
+		unsigned int seen_generation = 0;
+		while (true)
+		{
+			{
+				unique_lock<mutex> l(state_lock);
+				work_ready.wait(l, [&] { return quit || generation != seen_generation; });
+				if (quit)
+					return;
+				seen_generation = generation;
+			}
+
+			work_item item;
+			while (pop_or_steal(self, item))
+			{
+				(*item.fn)(item.index);
+				if (--remaining == 0)
+				{
+					lock_guard<mutex> l(state_lock);
+					work_done.notify_all();
+				}
+			}
+		}
+	}
+};
+
+// parallel_for() on the pool if there is one, a plain loop on this thread if not
+void run_parallel(thread_pool* pool, int count, const function<void(int)>& fn)
+{
+	if (pool)
+		pool->parallel_for(count, fn);
+	else
+		for (int i = 0; i < count; ++i)
+			fn(i);
+}
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+using std::string;
+using std::vector;
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+// Worker processes for --workers, on this machine as a stand-in for a
+// cluster. Each is this program started again with the same arguments and
+// "--worker <in fd> <out fd> <file>" after them; it loads the scene itself,
+// then takes one line at a time from the coordinator over a pipe,
+//
+//   tile <index>    render every sample of the tile, answer "done <index>"
+//   quit            save the accumulated film to <file> and exit
+//
+// so the coordinator can hand tiles to whichever worker is free, and add
+// up the files when they're all done.
+
+struct worker_process
+{
+#ifndef _WIN32
+	pid_t pid = -1;
+#endif
+	int to = -1;             // the worker's commands
+	FILE* from = nullptr;    // its answers
+	string part;             // the film it saves
+	int tile = -1;           // the one it's rendering, -1 if none
+};
+
+#ifndef _WIN32
+// Starts argv (argv[0] the program) with the worker arguments for a film
+// saved to part. Returns false if it can't.
+bool start_worker(const vector<string>& argv, const string& part, worker_process& w)
+{
+	int to_worker[2], from_worker[2];
+	if (pipe(to_worker) != 0)
+		return false;
+	if (pipe(from_worker) != 0)
+	{
+		close(to_worker[0]);
+		close(to_worker[1]);
+		return false;
+	}
+	// only this worker gets the other ends, so it sees the coordinator go
+	fcntl(to_worker[1], F_SETFD, FD_CLOEXEC);
+	fcntl(from_worker[0], F_SETFD, FD_CLOEXEC);
+
+	vector<string> args = argv;
+	args.push_back("--worker");
+	args.push_back(std::to_string(to_worker[0]));
+	args.push_back(std::to_string(from_worker[1]));
+	args.push_back(part);
+	vector<char*> c_args;
+	for (string& a : args)
+		c_args.push_back(&a[0]);
+	c_args.push_back(nullptr);
+
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		close(to_worker[1]);
+		close(from_worker[0]);
+		execvp(c_args[0], c_args.data());
+		printf("Can't start worker %s\n", c_args[0]);
+		_exit(127);
+	}
+	close(to_worker[0]);
+	close(from_worker[1]);
+	if (pid < 0)
+	{
+		close(to_worker[1]);
+		close(from_worker[0]);
+		return false;
+	}
+
+	w.pid = pid;
+	w.to = to_worker[1];
+	w.from = fdopen(from_worker[0], "r");
+	w.part = part;
+	w.tile = -1;
+	return true;
+}
+
+bool send_to_worker(worker_process& w, const string& line)
+{
+	string s = line + "\n";
+	return write(w.to, s.data(), s.size()) == (ssize_t)s.size();
+}
+
+// Waits until one of the workers answers, and returns which with its line,
+// or -1 if one of them went away instead.
+int wait_for_worker(vector<worker_process>& workers, string& line)
+{
+	vector<pollfd> fds(workers.size());
+	for (size_t i = 0; i < workers.size(); ++i)
+	{
+		fds[i].fd = workers[i].from ? fileno(workers[i].from) : -1;
+		fds[i].events = POLLIN;
+	}
+	while (poll(fds.data(), fds.size(), -1) < 0)
+	{
+		if (errno != EINTR)
+			return -1;
+	}
+
+	for (size_t i = 0; i < workers.size(); ++i)
+	{
+		if (fds[i].revents == 0)
+			continue;
+		char buffer[256];
+		if (!fgets(buffer, sizeof(buffer), workers[i].from))
+			return -1;
+		line = buffer;
+		while (!line.empty() && (line.back() == '\n' || line.back() == '\r'))
+			line.pop_back();
+		return (int)i;
+	}
+	return -1;
+}
+
+// Tells the worker to save and waits for it. Returns false unless it
+// exited cleanly.
+bool finish_worker(worker_process& w)
+{
+	send_to_worker(w, "quit");
+	close(w.to);
+	int status = 0;
+	bool ok = waitpid(w.pid, &status, 0) == w.pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+	if (w.from)
+		fclose(w.from);
+	w.to = -1;
+	w.from = nullptr;
+	return ok;
+}
+
+// The worker's end: the pipes it was started with.
+struct worker_channel
+{
+	FILE* in = nullptr;
+	FILE* out = nullptr;
+
+	bool open(int in_fd, int out_fd)
+	{
+		in = fdopen(in_fd, "r");
+		out = fdopen(out_fd, "w");
+		return in && out;
+	}
+
+	// the next command, false once the coordinator is gone
+	bool next(string& line)
+	{
+		char buffer[256];
+		if (!fgets(buffer, sizeof(buffer), in))
+			return false;
+		line = buffer;
+		while (!line.empty() && (line.back() == '\n' || line.back() == '\r'))
+			line.pop_back();
+		return true;
+	}
+
+	void answer(const string& line)
+	{
+		fprintf(out, "%s\n", line.c_str());
+		fflush(out);
+	}
+};
+#endif